@@ -0,0 +1,126 @@
+// scratch_tlb_bench.cc - TLB misses of the scratchpad allocation strategies.
+//
+// Runs Scrypt::hash with p = 1, so ROMix runs on this thread, once per
+// allocation strategy, and reports the wall time and the dTLB read misses
+// counted by perf. At N = 2^20, r = 8 the V table is 1 GiB.
+//
+// Usage: scratch_tlb_bench [log2 N = 16] [r = 8] [runs = 3]
+
+#include <scratchpad.h>
+#include <scrypt.h>
+#include <utilities.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Counts dTLB read misses of this thread while it lives. Reports -1 where
+// perf is not available, e.g. with perf_event_paranoid > 2.
+class TlbMissCounter {
+  int fd = -1;
+
+ public:
+  TlbMissCounter() {
+#ifdef __linux__
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  ~TlbMissCounter() {
+#ifdef __linux__
+    if (fd >= 0) {
+      close(fd);
+    }
+#endif
+  }
+
+  int64_t read() {
+#ifdef __linux__
+    uint64_t count = 0;
+    if (fd >= 0 && ::read(fd, &count, sizeof(count)) == sizeof(count)) {
+      return static_cast<int64_t>(count);
+    }
+#endif
+    return -1;
+  }
+};
+
+const char* pagesName(ScratchAllocation::Pages pages) {
+  switch (pages) {
+    case ScratchAllocation::Pages::Normal:
+      return "normal";
+    case ScratchAllocation::Pages::Transparent:
+      return "transparent";
+    case ScratchAllocation::Pages::HugeTLB:
+      return "hugetlb";
+  }
+  return "unknown";
+}
+
+int main(int argc, char** argv) {
+  unsigned log2_N = argc > 1 ? std::atoi(argv[1]) : 16;
+  uint32_t r = argc > 2 ? std::atoi(argv[2]) : 8;
+  int runs = argc > 3 ? std::atoi(argv[3]) : 3;
+  uint64_t N = uint64_t{1} << log2_N;
+
+  std::cout << "N = 2^" << log2_N << ", r = " << r << ", V = "
+            << (128 * r * N >> 20) << " MiB\n";
+  std::cout << "requested    backing      node_local  seconds  dTLB misses\n";
+
+  using Pages = ScratchAllocation::Pages;
+  for (Pages pages : {Pages::Normal, Pages::Transparent, Pages::HugeTLB}) {
+    for (bool node_local : {false, true}) {
+      ScratchAllocation allocation{pages, node_local};
+
+      // What the strategy falls back to on this host.
+      Scratchpad probe(size_t{4} << 20, allocation);
+
+      Scrypt scrypt;
+      scrypt.set_scratch_allocation(allocation);
+      for (int run = 0; run < runs; run++) {
+        TlbMissCounter counter;
+        auto start = std::chrono::steady_clock::now();
+        scrypt.hash(utilities::stringToBytes("password"),
+                    utilities::stringToBytes("NaCl"), N, r, 1, 64);
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        int64_t misses = counter.read();
+
+        std::string requested = pagesName(pages);
+        std::string backing = pagesName(probe.pages());
+        std::cout << requested << std::string(13 - requested.size(), ' ')
+                  << backing << std::string(13 - backing.size(), ' ')
+                  << (node_local ? "yes         " : "no          ")
+                  << elapsed.count() << "  "
+                  << (misses < 0 ? std::string("n/a") : std::to_string(misses))
+                  << "\n";
+      }
+    }
+  }
+
+  return 0;
+}
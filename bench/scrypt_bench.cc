@@ -0,0 +1,411 @@
+// scrypt_bench.cc - Microbenchmarks for each stage of scrypt, and end to end.
+//
+// Salsa20/8, ChaCha20/8, BlockMix, ROMix and PBKDF2 report bytes/s;
+// Scrypt::hash reports hashes/s over a grid of N, r and p. Grid points whose
+// scratch, p lanes of 128 * r * (N + 1) bytes, exceeds
+// CPP_SCRYPT_BENCH_MAX_MIB (1024 by default) are left out.
+//
+// For machine-readable results, run with
+//   scrypt_bench --benchmark_out=scrypt_bench.json --benchmark_out_format=json
+// or build the bench_json target.
+
+#include <benchmark/benchmark.h>
+#include <chacha20.h>
+#include <openssl/evp.h>
+#include <pbkdf2.h>
+#include <romix.h>
+#include <salsa20.h>
+#include <scratchpad.h>
+#include <scrypt.h>
+#include <sha256.h>
+#include <utilities.h>
+#include <verify_cache.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+const Salsa20::Kernel kKernels[] = {Salsa20::Kernel::Scalar,
+                                    Salsa20::Kernel::SSE2,
+                                    Salsa20::Kernel::AVX2,
+                                    Salsa20::Kernel::AVX512};
+
+const SHA256::Kernel kSHA256Kernels[] = {
+    SHA256::Kernel::Scalar, SHA256::Kernel::SSE2, SHA256::Kernel::AVX2,
+    SHA256::Kernel::AVX512};
+
+uint64_t MaxScratchBytes() {
+  const char* mib = std::getenv("CPP_SCRYPT_BENCH_MAX_MIB");
+  return (mib != nullptr ? std::strtoull(mib, nullptr, 10) : 1024) << 20;
+}
+
+// One Salsa20/8 core on 64 bytes, with each kernel this CPU supports.
+void BM_Salsa20_8(benchmark::State& state) {
+  Salsa20::Kernel kernel = kKernels[state.range(0)];
+  state.SetLabel(Salsa20::kernel_name(kernel));
+  if (!Salsa20::set_kernel(kernel)) {
+    state.SkipWithError("kernel not supported");
+    return;
+  }
+
+  Salsa20 salsa20_8(8);
+  uint32_t X[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+  for (auto _ : state) {
+    salsa20_8.hash(X);
+    benchmark::DoNotOptimize(X);
+  }
+  state.SetBytesProcessed(state.iterations() * 64);
+  Salsa20::set_kernel(Salsa20::Kernel::Auto);
+}
+BENCHMARK(BM_Salsa20_8)->DenseRange(0, 3);
+
+const ChaCha20::Kernel kChaChaKernels[] = {
+    ChaCha20::Kernel::Scalar, ChaCha20::Kernel::SSE2, ChaCha20::Kernel::AVX2,
+    ChaCha20::Kernel::AVX512};
+
+// One ChaCha20/8 core on 64 bytes, the core of the ChaCha mixing function.
+void BM_ChaCha20_8(benchmark::State& state) {
+  ChaCha20::Kernel kernel = kChaChaKernels[state.range(0)];
+  state.SetLabel(ChaCha20::kernel_name(kernel));
+  if (!ChaCha20::set_kernel(kernel)) {
+    state.SkipWithError("kernel not supported");
+    return;
+  }
+
+  ChaCha20 chacha20_8(8);
+  uint32_t X[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+  for (auto _ : state) {
+    chacha20_8.hash(X);
+    benchmark::DoNotOptimize(X);
+  }
+  state.SetBytesProcessed(state.iterations() * 64);
+  ChaCha20::set_kernel(ChaCha20::Kernel::Auto);
+}
+BENCHMARK(BM_ChaCha20_8)->DenseRange(0, 3);
+
+// BlockMix of a 128r-byte block xor V, as in the second loop of ROMix.
+void BM_BlockMix(benchmark::State& state) {
+  size_t two_r = 2 * static_cast<size_t>(state.range(0));
+  std::vector<uint32_t> B(16 * two_r, 1), V(16 * two_r, 2), Y(16 * two_r);
+  Salsa20 salsa20_8(8);
+  for (auto _ : state) {
+    romix::BlockMix(B.data(), V.data(), Y.data(), two_r, salsa20_8);
+    std::swap(B, Y);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * 64 * two_r);
+}
+BENCHMARK(BM_BlockMix)->RangeMultiplier(2)->Range(1, 32);
+
+// BlockMix<R>, with r fixed at compile time.
+template <uint32_t R>
+void BM_BlockMixFixed(benchmark::State& state) {
+  std::vector<uint32_t> B(32 * R, 1), V(32 * R, 2), Y(32 * R);
+  Salsa20 salsa20_8(8);
+  for (auto _ : state) {
+    romix::BlockMix<R>(B.data(), V.data(), Y.data(), salsa20_8);
+    std::swap(B, Y);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * 128 * R);
+}
+BENCHMARK_TEMPLATE(BM_BlockMixFixed, 1);
+BENCHMARK_TEMPLATE(BM_BlockMixFixed, 8);
+BENCHMARK_TEMPLATE(BM_BlockMixFixed, 32);
+
+// ROMix on one block. Bytes are those of V, written once and read once.
+void BM_ROMix(benchmark::State& state) {
+  uint64_t cost_factor_N = uint64_t{1} << state.range(0);
+  uint32_t block_size_factor_r = static_cast<uint32_t>(state.range(1));
+  std::vector<uint32_t> B(32 * block_size_factor_r, 1);
+  Scratchpad scratch(
+      romix::ROMixScratchSize(block_size_factor_r, cost_factor_N));
+  for (auto _ : state) {
+    romix::ROMix(block_size_factor_r, B.data(), cost_factor_N,
+                 scratch.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * 2 * 128 * block_size_factor_r *
+                          cost_factor_N);
+}
+BENCHMARK(BM_ROMix)
+    ->ArgNames({"log2N", "r"})
+    ->ArgsProduct({{10, 14, 17}, {1, 8, 32}})
+    ->Unit(benchmark::kMillisecond);
+
+// ROMix over ChaCha20/8 on one block, to compare with BM_ROMix.
+void BM_ROMixChaCha(benchmark::State& state) {
+  uint64_t cost_factor_N = uint64_t{1} << state.range(0);
+  uint32_t block_size_factor_r = static_cast<uint32_t>(state.range(1));
+  std::vector<uint32_t> B(32 * block_size_factor_r, 1);
+  Scratchpad scratch(
+      romix::ROMixScratchSize(block_size_factor_r, cost_factor_N));
+  for (auto _ : state) {
+    romix::ROMixChaCha(block_size_factor_r, B.data(), cost_factor_N,
+                       scratch.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * 2 * 128 * block_size_factor_r *
+                          cost_factor_N);
+}
+BENCHMARK(BM_ROMixChaCha)
+    ->ArgNames({"log2N", "r"})
+    ->ArgsProduct({{10, 14, 17}, {1, 8, 32}})
+    ->Unit(benchmark::kMillisecond);
+
+// ROMix on several blocks on one thread, interleaved with prefetches of
+// V[j]. Bytes are those of every V, so the rate is per core; lanes 1 is
+// plain ROMix.
+void BM_ROMixInterleaved(benchmark::State& state) {
+  uint64_t cost_factor_N = uint64_t{1} << state.range(0);
+  uint32_t block_size_factor_r = static_cast<uint32_t>(state.range(1));
+  size_t lanes = static_cast<size_t>(state.range(2));
+  size_t scratch_size =
+      romix::ROMixScratchSize(block_size_factor_r, cost_factor_N);
+  if (lanes * scratch_size > MaxScratchBytes()) {
+    state.SkipWithError("needs more scratch than CPP_SCRYPT_BENCH_MAX_MIB");
+    return;
+  }
+
+  std::vector<std::vector<uint32_t>> B(
+      lanes, std::vector<uint32_t>(32 * block_size_factor_r, 1));
+  std::vector<Scratchpad> scratch;
+  scratch.reserve(lanes);
+  std::vector<uint32_t*> blocks, scratches;
+  for (size_t l = 0; l < lanes; l++) {
+    scratch.emplace_back(scratch_size);
+    blocks.push_back(B[l].data());
+    scratches.push_back(scratch[l].data());
+  }
+  for (auto _ : state) {
+    if (lanes == 1) {
+      romix::ROMix(block_size_factor_r, blocks[0], cost_factor_N,
+                   scratches[0]);
+    } else {
+      romix::ROMixInterleaved(block_size_factor_r, blocks.data(), lanes,
+                              cost_factor_N, scratches.data());
+    }
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * lanes * 2 * 128 *
+                          block_size_factor_r * cost_factor_N);
+}
+BENCHMARK(BM_ROMixInterleaved)
+    ->ArgNames({"log2N", "r", "lanes"})
+    ->ArgsProduct({{10, 14, 17}, {8}, {1, 2, 4}})
+    ->Unit(benchmark::kMillisecond);
+
+// ROMix keeping every stride-th entry of V. Bytes are those of a full V,
+// so the rate falls as the stride grows.
+void BM_ROMixTMTO(benchmark::State& state) {
+  uint64_t cost_factor_N = uint64_t{1} << state.range(0);
+  uint32_t block_size_factor_r = static_cast<uint32_t>(state.range(1));
+  uint64_t stride = static_cast<uint64_t>(state.range(2));
+  std::vector<uint32_t> B(32 * block_size_factor_r, 1);
+  Scratchpad scratch(romix::ROMixTMTOScratchSize(block_size_factor_r,
+                                                 cost_factor_N, stride));
+  for (auto _ : state) {
+    romix::ROMixTMTO(block_size_factor_r, B.data(), cost_factor_N, stride,
+                     scratch.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * 2 * 128 * block_size_factor_r *
+                          cost_factor_N);
+  state.counters["scratch_bytes"] = scratch.size();
+}
+BENCHMARK(BM_ROMixTMTO)
+    ->ArgNames({"log2N", "r", "stride"})
+    ->ArgsProduct({{14}, {8}, {1, 2, 4, 8, 16}})
+    ->Unit(benchmark::kMillisecond);
+
+// The PBKDF2-HMAC-SHA256 that expands the passphrase into p * 128r bytes.
+void BM_PBKDF2(benchmark::State& state) {
+  std::vector<std::byte> passphrase(16, std::byte{'p'});
+  std::vector<std::byte> salt(16, std::byte{'s'});
+  std::vector<std::byte> output(state.range(0));
+  PBKDF2 PBKDF2_SHA256(EVP_sha256());
+  for (auto _ : state) {
+    PBKDF2_SHA256.hash(passphrase.data(), passphrase.size(), salt.data(),
+                       salt.size(), 1, output.data(), output.size());
+    benchmark::DoNotOptimize(output.data());
+  }
+  state.SetBytesProcessed(state.iterations() * output.size());
+}
+BENCHMARK(BM_PBKDF2)->RangeMultiplier(4)->Range(128, 128 * 32 * 16);
+
+// The same expansion through a precomputed key schedule, with each SHA-256
+// multi-buffer kernel this CPU supports.
+void BM_PBKDF2Key(benchmark::State& state) {
+  SHA256::Kernel kernel = kSHA256Kernels[state.range(0)];
+  state.SetLabel(SHA256::kernel_name(kernel));
+  if (!SHA256::set_kernel(kernel)) {
+    state.SkipWithError("kernel not supported");
+    return;
+  }
+
+  std::vector<std::byte> passphrase(16, std::byte{'p'});
+  std::vector<std::byte> salt(16, std::byte{'s'});
+  std::vector<std::byte> output(state.range(1));
+  PBKDF2::Key key(EVP_sha256(), passphrase.data(), passphrase.size());
+  for (auto _ : state) {
+    key.derive(salt.data(), salt.size(), 1, 0, output.data(), output.size());
+    benchmark::DoNotOptimize(output.data());
+  }
+  state.SetBytesProcessed(state.iterations() * output.size());
+  SHA256::set_kernel(SHA256::Kernel::Auto);
+}
+BENCHMARK(BM_PBKDF2Key)
+    ->ArgNames({"kernel", "bytes"})
+    ->ArgsProduct({{0, 1, 2, 3}, {128, 128 * 32 * 16}});
+
+// The expansions of a batch of r = 1, p = 1 hashes, each of 128 bytes, one
+// derive at a time (batched = 0) or sharing the SHA-256 lanes (batched = 1).
+void BM_PBKDF2Batch(benchmark::State& state) {
+  SHA256::Kernel kernel = kSHA256Kernels[state.range(0)];
+  state.SetLabel(SHA256::kernel_name(kernel));
+  if (!SHA256::set_kernel(kernel)) {
+    state.SkipWithError("kernel not supported");
+    return;
+  }
+
+  const size_t jobs = 64;
+  std::vector<std::byte> salt(16, std::byte{'s'});
+  std::vector<std::byte> output(jobs * 128);
+  std::vector<PBKDF2::Key> keys;
+  std::vector<PBKDF2::Key::Request> requests;
+  for (size_t n = 0; n < jobs; n++) {
+    std::vector<std::byte> passphrase(16, std::byte(n));
+    keys.emplace_back(EVP_sha256(), passphrase.data(), passphrase.size());
+  }
+  for (size_t n = 0; n < jobs; n++) {
+    requests.push_back({&keys.at(n), salt.data(), salt.size(), 0,
+                        output.data() + n * 128, 128});
+  }
+  for (auto _ : state) {
+    if (state.range(1)) {
+      PBKDF2::Key::derive_batch(requests.data(), requests.size(), 1);
+    } else {
+      for (const auto& request : requests) {
+        request.key->derive(request.salt, request.salt_length, 1, 0,
+                            request.output, request.length);
+      }
+    }
+    benchmark::DoNotOptimize(output.data());
+  }
+  state.SetBytesProcessed(state.iterations() * output.size());
+  SHA256::set_kernel(SHA256::Kernel::Auto);
+}
+BENCHMARK(BM_PBKDF2Batch)
+    ->ArgNames({"kernel", "batched"})
+    ->ArgsProduct({{0, 1, 2, 3}, {0, 1}});
+
+// The end-to-end grid, less the points over the scratch limit.
+void ScryptGrid(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"log2N", "r", "p"});
+  uint64_t max_bytes = MaxScratchBytes();
+  for (int64_t log2_N : {10, 12, 14, 16, 18, 20}) {
+    for (int64_t r : {1, 8, 32}) {
+      for (int64_t p : {1, 4, 16}) {
+        uint64_t lane_bytes = 128 * r * ((uint64_t{1} << log2_N) + 1);
+        if (lane_bytes * p <= max_bytes) {
+          b->Args({log2_N, r, p});
+        }
+      }
+    }
+  }
+}
+
+void BM_Scrypt(benchmark::State& state) {
+  uint64_t cost_factor_N = uint64_t{1} << state.range(0);
+  uint32_t block_size_factor_r = static_cast<uint32_t>(state.range(1));
+  uint32_t parallelization_factor_p = static_cast<uint32_t>(state.range(2));
+  std::vector<std::byte> passphrase(16, std::byte{'p'});
+  std::vector<std::byte> salt(16, std::byte{'s'});
+  std::byte output[64];
+  Scrypt Scrypt;
+  for (auto _ : state) {
+    if (!Scrypt.hash(passphrase.data(), passphrase.size(), salt.data(),
+                     salt.size(), cost_factor_N, block_size_factor_r,
+                     parallelization_factor_p, output, sizeof(output))) {
+      state.SkipWithError("memory budget refused the hash");
+      return;
+    }
+    benchmark::DoNotOptimize(output);
+  }
+  state.counters["hashes/s"] =
+      benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Scrypt)
+    ->Apply(ScryptGrid)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// The codecs that stored hashes and audit logs go through, on a 64-byte key.
+void BM_BytesToHex(benchmark::State& state) {
+  std::vector<std::byte> key(64, std::byte{0x5a});
+  for (auto _ : state) {
+    std::string hex = utilities::bytesToHex(key);
+    benchmark::DoNotOptimize(hex.data());
+  }
+  state.SetBytesProcessed(state.iterations() * key.size());
+}
+BENCHMARK(BM_BytesToHex);
+
+void BM_EncodeHex(benchmark::State& state) {
+  std::vector<std::byte> key(64, std::byte{0x5a});
+  char hex[128];
+  for (auto _ : state) {
+    utilities::encodeHex(key.data(), key.size(), hex);
+    benchmark::DoNotOptimize(hex);
+  }
+  state.SetBytesProcessed(state.iterations() * key.size());
+}
+BENCHMARK(BM_EncodeHex);
+
+void BM_HexToBytes(benchmark::State& state) {
+  std::string hex = utilities::bytesToHex(std::vector<std::byte>(64));
+  for (auto _ : state) {
+    std::vector<std::byte> key = utilities::hexToBytesStrict(hex);
+    benchmark::DoNotOptimize(key.data());
+  }
+  state.SetBytesProcessed(state.iterations() * 64);
+}
+BENCHMARK(BM_HexToBytes);
+
+void BM_DecodeBase64(benchmark::State& state) {
+  std::vector<std::byte> key(64, std::byte{0x5a});
+  char encoded[96];
+  size_t length = utilities::encodeBase64(key.data(), key.size(), encoded);
+  for (auto _ : state) {
+    utilities::decodeBase64(encoded, length, key.data(), key.size());
+    benchmark::DoNotOptimize(key.data());
+  }
+  state.SetBytesProcessed(state.iterations() * key.size());
+}
+BENCHMARK(BM_DecodeBase64);
+
+// Scrypt::verify of the same credential over and over, without (0) and with
+// (1) a verify cache.
+void BM_Verify(benchmark::State& state) {
+  Scrypt scrypt;
+  if (state.range(0) == 1) {
+    scrypt.set_verify_cache(std::make_shared<VerifyCache>());
+  }
+  std::vector<std::byte> passphrase = utilities::stringToBytes("password");
+  std::string encoded = scrypt.encode(
+      passphrase, utilities::stringToBytes("NaCl"), 1024, 8, 1, 32);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(scrypt.verify(passphrase, encoded));
+  }
+}
+BENCHMARK(BM_Verify)->ArgName("cached")->DenseRange(0, 1);
+
+}  // namespace
+
+BENCHMARK_MAIN();
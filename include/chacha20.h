@@ -0,0 +1,33 @@
+#ifndef CHACHA20_H
+#define CHACHA20_H
+
+#include <cstddef>
+#include <cstdint>
+
+// The ChaCha core ("ChaCha, a variant of Salsa20", Bernstein) as a hash of
+// 16 words: the double rounds, then the input added back in, as Salsa20 does
+// it. Its rows map onto 4-lane SIMD registers directly, where Salsa20 has to
+// shuffle its words onto diagonals first.
+class ChaCha20 {
+ private:
+  uint8_t rounds;
+
+ public:
+  // Implementations of the core. The best one the CPU supports is picked when
+  // the library is loaded; Auto goes back to that choice.
+  enum class Kernel { Auto, Scalar, SSE2, AVX2, AVX512 };
+
+  ChaCha20(uint8_t rounds = 20);
+
+  // Hashes 16 words in place, without allocating.
+  void hash(uint32_t state[16]) const;
+
+  // Forces the kernel used by every ChaCha20, e.g. to A/B test them. Returns
+  // false, and keeps the current kernel, if this CPU does not support k.
+  static bool set_kernel(Kernel k);
+  static Kernel kernel();
+  static bool kernel_supported(Kernel k);
+  static const char* kernel_name(Kernel k);
+};
+
+#endif  // CHACHA20_H
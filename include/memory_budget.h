@@ -0,0 +1,89 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+// A governor for scratch memory. Scrypt reserves the scratch a hash needs
+// before it runs ROMix, and gives it back afterwards; once the limit is
+// reached, further hashes block, wait up to a timeout, or fail, depending on
+// their Admission policy. Waiters are admitted in arrival order.
+class MemoryBudget {
+ public:
+  static constexpr size_t unlimited = SIZE_MAX;
+
+  enum class Admission {
+    Block,     // wait for as long as it takes
+    Timeout,   // wait up to a timeout, then fail
+    FailFast,  // fail at once if the memory is not free
+  };
+
+  explicit MemoryBudget(size_t limit = unlimited);
+
+  MemoryBudget(const MemoryBudget&) = delete;
+  MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+  // The budget Scrypt uses unless it is given one. Unlimited until
+  // set_limit is called.
+  static MemoryBudget& global();
+
+  // Lowering the limit below what is in use does not revoke reservations; it
+  // only holds back new ones.
+  void set_limit(size_t bytes);
+  size_t limit() const { return limit_bytes; }
+
+  // Reserves bytes, returning false if the policy gives up. A request larger
+  // than the limit can never be met and fails at once.
+  bool acquire(size_t bytes, Admission policy = Admission::Block,
+               std::chrono::milliseconds timeout = {});
+  void release(size_t bytes);
+
+  // Counters
+  size_t in_use() const { return in_use_bytes; }
+  size_t peak() const { return peak_bytes; }
+  size_t waiters() const { return waiting; }
+  uint64_t rejected() const { return rejections; }
+
+  // Holds a reservation for its lifetime. Check admitted() before using the
+  // memory.
+  class Reservation {
+    MemoryBudget* budget;
+    std::atomic<size_t> bytes;
+
+   public:
+    Reservation(MemoryBudget& b, size_t n, Admission policy,
+                std::chrono::milliseconds timeout);
+    ~Reservation();
+
+    Reservation(const Reservation&) = delete;
+    Reservation& operator=(const Reservation&) = delete;
+
+    bool admitted() const { return budget != nullptr; }
+
+    // Hands n bytes of the reservation over to the caller, who then owns
+    // their charge to b and releases it later. Fails, keeping them, if the
+    // reservation is not held against b or holds fewer than n bytes.
+    bool transfer(const MemoryBudget& b, size_t n);
+  };
+
+ private:
+  bool fits(size_t bytes) const;
+
+  std::mutex mutex;
+  std::condition_variable released;
+  std::deque<uint64_t> queue;
+  uint64_t next_ticket;
+
+  std::atomic<size_t> limit_bytes;
+  std::atomic<size_t> in_use_bytes;
+  std::atomic<size_t> peak_bytes;
+  std::atomic<size_t> waiting;
+  std::atomic<uint64_t> rejections;
+};
+
+#endif  // MEMORY_BUDGET_H
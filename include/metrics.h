@@ -0,0 +1,189 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Timers and counters on the hot path of Scrypt::hash, ROMix and PBKDF2.
+//
+// They cost a relaxed load per stage until a hook is set or the histograms
+// are enabled. Building with CPP_SCRYPT_METRICS=0 (the CMake option of the
+// same name) removes them: the hot-path types below become empty, and the
+// hook and histograms are never fed.
+#ifndef CPP_SCRYPT_METRICS
+#define CPP_SCRYPT_METRICS 1
+#endif
+
+namespace metrics {
+
+enum class Stage {
+  MemoryWait,   // waiting for the memory budget to admit the hash
+  PBKDF2,       // keying HMAC and running PBKDF2, both times
+  ThreadStart,  // from handing a lane to the pool until a thread takes it
+  ROMixFill,    // the first loop of ROMix, filling V
+  ROMixMix,     // the second loop of ROMix, reading V at random
+  Hash,         // the whole of Scrypt::hash
+};
+constexpr size_t stage_count = 6;
+
+const char* stage_name(Stage stage);
+
+// What one Scrypt::hash spent. The stages run by every lane add up the time
+// of all its lanes.
+struct HashMetrics {
+  std::chrono::nanoseconds time[stage_count];
+  size_t bytes_allocated;  // the ROMix scratch reserved for the lanes
+  size_t threads;          // how many threads ran lanes
+};
+
+// Called with the metrics of every Scrypt::hash, on the thread that called
+// it, just before it returns. An empty hook removes the current one.
+using Hook = std::function<void(const HashMetrics&)>;
+void set_hook(Hook hook);
+
+// Times in nanoseconds, in power-of-two buckets: bucket b counts the times t
+// with 2^(b-1) <= t < 2^b, and bucket 0 the zeros. Recording and reading
+// are lock free, so it can be scraped while hashes run.
+class Histogram {
+ public:
+  static constexpr size_t buckets = 64;
+
+  struct Snapshot {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t bucket[buckets];
+  };
+
+  Histogram();
+
+  void record(std::chrono::nanoseconds time);
+  Snapshot snapshot() const;
+  void reset();
+
+ private:
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> counts[buckets];
+};
+
+// The process-wide histogram of each stage, across every hash and batch.
+// They are only fed while enabled.
+void enable_histograms(bool enable);
+Histogram& histogram(Stage stage);
+
+namespace internal {
+extern std::atomic<bool> listening;
+}
+
+// Whether a hook or the histograms want the metrics.
+inline bool enabled() {
+  return CPP_SCRYPT_METRICS &&
+         internal::listening.load(std::memory_order_relaxed);
+}
+
+#if CPP_SCRYPT_METRICS
+
+// Collects the metrics of one Scrypt::hash across the threads of its lanes,
+// and hands them to the hook when it goes away.
+class Recorder {
+  bool on;
+  std::chrono::steady_clock::time_point start;
+  std::atomic<uint64_t> time[stage_count];
+  std::atomic<size_t> bytes;
+  std::mutex mutex;
+  std::vector<std::thread::id> thread_ids;
+
+ public:
+  Recorder();
+  ~Recorder();
+
+  Recorder(const Recorder&) = delete;
+  Recorder& operator=(const Recorder&) = delete;
+
+  void add(Stage stage, std::chrono::nanoseconds elapsed);
+  void allocated(size_t n);
+  void joined();
+};
+
+// Makes recorder the one this thread records into while in scope.
+class Scope {
+  Recorder* previous;
+
+ public:
+  explicit Scope(Recorder& recorder);
+  ~Scope();
+
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+};
+
+// Records elapsed time for stage in the recorder of this thread, if any,
+// and in the histograms.
+void record(Stage stage, std::chrono::nanoseconds elapsed);
+
+// A point in time, taken only if the metrics are enabled.
+class Stamp {
+  bool on;
+  std::chrono::steady_clock::time_point start;
+
+ public:
+  Stamp() : on{enabled()} {
+    if (on) {
+      start = std::chrono::steady_clock::now();
+    }
+  }
+
+  // Records the time since the stamp as stage.
+  void record(Stage stage) const {
+    if (on) {
+      metrics::record(stage, std::chrono::steady_clock::now() - start);
+    }
+  }
+};
+
+// Records its lifetime as stage.
+class Timer {
+  Stage stage;
+  Stamp stamp;
+
+ public:
+  explicit Timer(Stage s) : stage{s} {}
+  ~Timer() { stamp.record(stage); }
+
+  Timer(const Timer&) = delete;
+  Timer& operator=(const Timer&) = delete;
+};
+
+#else
+
+class Recorder {
+ public:
+  void allocated(size_t) {}
+};
+
+class Scope {
+ public:
+  explicit Scope(Recorder&) {}
+};
+
+class Stamp {
+ public:
+  void record(Stage) const {}
+};
+
+class Timer {
+ public:
+  explicit Timer(Stage) {}
+};
+
+#endif  // CPP_SCRYPT_METRICS
+
+}  // namespace metrics
+
+#endif  // METRICS_H
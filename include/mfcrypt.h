@@ -0,0 +1,58 @@
+#ifndef MFCRYPT_H
+#define MFCRYPT_H
+
+#include <openssl/evp.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// The PRF and mixing function policies of MFcrypt, the construction scrypt
+// instantiates (Section 5 of [SCRYPT]):
+//
+//   B = PBKDF2-PRF(P, S, 1, p * 128r); Bi = MF(Bi, N); DK = PBKDF2-PRF(P, B)
+//
+// Scrypt::hash<PRF, MF> takes one of each as template arguments, so the
+// choice is made at compile time and nothing in the ROMix loops is virtual.
+// scrypt is MFcrypt<HMACSHA256, ROMixSalsa20_8>; every other pair derives
+// different keys. The pipeline is instantiated for the policies below only.
+namespace mfcrypt {
+
+// A PRF is HMAC over an OpenSSL digest:
+//   static const EVP_MD* digest();
+struct HMACSHA256 {
+  static const EVP_MD* digest();
+};
+
+struct HMACSHA512 {
+  static const EVP_MD* digest();
+};
+
+// A mixing function works on one block of 32r host order words in place:
+//   static size_t scratch_size(uint32_t r, uint64_t N);
+//   static bool mix(uint32_t r, uint32_t* B, uint64_t N, uint32_t* scratch,
+//                   const std::atomic<bool>* cancelled);
+// with scratch and cancelled as for romix::ROMix.
+
+// scryptROMix over Salsa20/8, the one that takes the interleaving and
+// time-memory tradeoff settings of Scrypt.
+struct ROMixSalsa20_8 {
+  static size_t scratch_size(uint32_t block_size_factor_r,
+                             uint64_t cost_factor_N);
+  static bool mix(uint32_t block_size_factor_r, uint32_t* B,
+                  uint64_t cost_factor_N, uint32_t* scratch,
+                  const std::atomic<bool>* cancelled);
+};
+
+// ROMix over ChaCha20/8, as in scrypt-jane (see romix::ROMixChaCha).
+struct ROMixChaCha20_8 {
+  static size_t scratch_size(uint32_t block_size_factor_r,
+                             uint64_t cost_factor_N);
+  static bool mix(uint32_t block_size_factor_r, uint32_t* B,
+                  uint64_t cost_factor_N, uint32_t* scratch,
+                  const std::atomic<bool>* cancelled);
+};
+
+}  // namespace mfcrypt
+
+#endif  // MFCRYPT_H
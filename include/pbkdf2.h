@@ -4,17 +4,85 @@
 #include <openssl/evp.h>
 
 #include <cstddef>
+#include <cstdint>
 #include <vector>
 
 class PBKDF2 {
   const EVP_MD* digest;
 
  public:
+  class Key;
+
   PBKDF2(const EVP_MD* d);
 
-  std::vector<std::byte> hash(std::vector<std::byte> passphrase,
-                              std::vector<std::byte> salt, uint32_t iterations,
-                              size_t desired_length);
+  std::vector<std::byte> hash(const std::vector<std::byte>& passphrase,
+                              const std::vector<std::byte>& salt,
+                              uint32_t iterations, size_t desired_length);
+
+  // Writes desired_length bytes of key to output. The inputs go to OpenSSL
+  // as they are, without copies.
+  void hash(const std::byte* passphrase, size_t passphrase_length,
+            const std::byte* salt, size_t salt_length, uint32_t iterations,
+            std::byte* output, size_t desired_length);
+};
+
+// A passphrase keyed into HMAC once. The key schedule, the digest states after
+// the inner and outer padded keys, is kept and copied for every HMAC, so runs
+// of PBKDF2 over the same passphrase never rehash it.
+//
+// For SHA-256 the states are kept as words, and the output blocks are
+// computed SHA256::lanes() at a time on the multi-buffer kernels. Other
+// digests go through OpenSSL.
+class PBKDF2::Key {
+  EVP_MD_CTX* inner;
+  EVP_MD_CTX* outer;
+  size_t digest_size;
+
+  bool sha256;
+  uint32_t inner_state[8];
+  uint32_t outer_state[8];
+
+  void finish_hmac(EVP_MD_CTX* ctx, unsigned char* mac) const;
+
+ public:
+  // One derive of a batch: bytes [offset, offset + length) of the output of
+  // key for salt, written to output.
+  struct Request {
+    const Key* key;
+    const std::byte* salt;
+    size_t salt_length;
+    size_t offset;
+    std::byte* output;
+    size_t length;
+  };
+
+ private:
+  static void derive_sha256(const Request* requests, size_t n,
+                            uint32_t iterations);
+
+ public:
+  Key(const EVP_MD* digest, const std::byte* passphrase,
+      size_t passphrase_length);
+  ~Key();
+
+  // Moves wipe the key schedule they leave behind.
+  Key(Key&& other) noexcept;
+  Key& operator=(Key&& other) noexcept;
+  Key(const Key&) = delete;
+  Key& operator=(const Key&) = delete;
+
+  // Writes bytes [offset, offset + length) of the PBKDF2 output for salt to
+  // output, computing only the blocks that cover them. Different ranges can
+  // be derived on different threads at once.
+  void derive(const std::byte* salt, size_t salt_length, uint32_t iterations,
+              size_t offset, std::byte* output, size_t length) const;
+
+  // Runs n requests as derive would, each with iterations. For SHA-256 the
+  // output blocks of all of them share the lanes of the multi-buffer kernel,
+  // so a batch of short derives, of different keys and salts, fills the
+  // lanes as one long derive does.
+  static void derive_batch(const Request* requests, size_t n,
+                           uint32_t iterations);
 };
 
 #endif  // PBKDF2_H
@@ -0,0 +1,119 @@
+#ifndef ROMIX_H
+#define ROMIX_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "salsa20.h"
+
+// The memory-hard core of scrypt, scryptBlockMix and scryptROMix (Sections 4
+// and 5 of RFC 7914), on host order words. A block of block size factor r is
+// 32r words, 2r 64-byte Salsa20 blocks of 16 words each.
+namespace romix {
+
+// The RFC requires N to be larger than 1 and a power of two.
+bool ValidCostFactor(uint64_t cost_factor_N);
+
+// Whether the caller has given up: cancelled is given and set.
+bool Cancelled(const std::atomic<bool>* cancelled);
+
+// BlockMix over two_r 64-byte blocks, of B xor V when V is given. Each
+// Salsa20/8 output is written straight to its shuffled place in output: the
+// even blocks first, then the odd ones. output must not alias B or V.
+void BlockMix(const uint32_t* B, const uint32_t* V, uint32_t* output,
+              size_t two_r, const Salsa20& salsa20_8);
+
+// BlockMix for r fixed at compile time: the 2R steps are unrolled, with
+// every block offset a constant. Instantiated for the r of specialized_r.
+template <uint32_t R>
+void BlockMix(const uint32_t* B, const uint32_t* V, uint32_t* output,
+              const Salsa20& salsa20_8);
+
+// Bytes of scratch ROMix needs: the N blocks of V, then one block to ping-pong
+// with B. The scratch sizes are SIZE_MAX when they do not fit in a size_t;
+// no scratch that large can be allocated.
+size_t ROMixScratchSize(uint32_t block_size_factor_r, uint64_t cost_factor_N);
+
+// ROMix on B, 32r words, in place. scratch must hold
+// ROMixScratchSize(block_size_factor_r, cost_factor_N) bytes. If cancelled is
+// given, it is checked before every iteration; once it is set ROMix gives up,
+// leaving B garbled, and returns false.
+//
+// For the r in specialized_r this runs ROMix<r>; other r take the generic
+// loops.
+bool ROMix(uint32_t block_size_factor_r, uint32_t* B, uint64_t cost_factor_N,
+           uint32_t* scratch, const std::atomic<bool>* cancelled = nullptr);
+
+// ROMix over BlockMix<R>, with the block it ping-pongs with B on the stack.
+// scratch is as for ROMix.
+template <uint32_t R>
+bool ROMix(uint32_t* B, uint64_t cost_factor_N, uint32_t* scratch,
+           const std::atomic<bool>* cancelled = nullptr);
+
+// The block size factors with a BlockMix<R> and ROMix<R>.
+constexpr uint32_t specialized_r[] = {1, 2, 4, 8, 16, 32};
+
+// ROMix with ChaCha20/8 in place of Salsa20/8 in BlockMix, as scrypt-jane
+// offers. This is not scrypt: keys differ from those of RFC 7914. scratch
+// is as for ROMix.
+bool ROMixChaCha(uint32_t block_size_factor_r, uint32_t* B,
+                 uint64_t cost_factor_N, uint32_t* scratch,
+                 const std::atomic<bool>* cancelled = nullptr);
+
+// ROMixInterleaved runs at most this many blocks at once.
+constexpr size_t max_interleaved = 8;
+
+// ROMix on count independent blocks of 32r words, in place, all on the
+// calling thread: their BlockMix steps take turns, and the block of V each
+// one reads next is prefetched while the others compute. At large N this
+// hides the memory latency of the random reads. Block l uses scratch[l], of
+// ROMixScratchSize(block_size_factor_r, cost_factor_N) bytes; cancelled is
+// as for ROMix.
+bool ROMixInterleaved(uint32_t block_size_factor_r, uint32_t* const* blocks,
+                      size_t count, uint64_t cost_factor_N,
+                      uint32_t* const* scratch,
+                      const std::atomic<bool>* cancelled = nullptr);
+
+// Bytes of scratch ROMixTMTO needs: every stride-th entry of V, then three
+// blocks.
+size_t ROMixTMTOScratchSize(uint32_t block_size_factor_r,
+                            uint64_t cost_factor_N, uint64_t stride);
+
+// The smallest stride whose ROMixTMTO scratch fits in bytes, or 0 if none
+// does.
+uint64_t TMTOStride(uint32_t block_size_factor_r, uint64_t cost_factor_N,
+                    size_t bytes);
+
+// ROMix for hosts short of memory, trading time for it: only every
+// stride-th entry of V is kept, and a read of another entry recomputes it
+// from the kept one before it, (stride - 1) / 2 extra BlockMix on average.
+// The result is that of ROMix. scratch must hold
+// ROMixTMTOScratchSize(block_size_factor_r, cost_factor_N, stride) bytes;
+// cancelled is as for ROMix. A stride of 1 is ROMix itself.
+bool ROMixTMTO(uint32_t block_size_factor_r, uint32_t* B,
+               uint64_t cost_factor_N, uint64_t stride, uint32_t* scratch,
+               const std::atomic<bool>* cancelled = nullptr);
+
+// BlockMix on Salsa20::lanes() independent blocks, one per SIMD lane.
+// B and Y hold two_r transposed 64-byte blocks: word k of block i of lane l is
+// at [(i * 16 + k) * lanes + l].
+void BlockMixLanes(const uint32_t* B, uint32_t* Y, size_t two_r,
+                   const Salsa20& salsa20_8);
+
+// Bytes of scratch ROMixLanes needs: the V table of every lane, then X and Y.
+size_t ROMixLanesScratchSize(uint32_t block_size_factor_r,
+                             uint64_t cost_factor_N);
+
+// ROMix on Salsa20::lanes() independent blocks of 32r words at once, in place,
+// with the BlockMix chains of the lanes running side by side in the SIMD
+// registers. scratch must hold
+// ROMixLanesScratchSize(block_size_factor_r, cost_factor_N) bytes; cancelled
+// is as for ROMix.
+bool ROMixLanes(uint32_t block_size_factor_r, uint32_t* const* blocks,
+                uint64_t cost_factor_N, uint32_t* scratch,
+                const std::atomic<bool>* cancelled = nullptr);
+
+}  // namespace romix
+
+#endif  // ROMIX_H
@@ -10,9 +10,45 @@ class Salsa20 {
   uint8_t rounds;
 
  public:
+  // Implementations of the core. The best one the CPU supports is picked when
+  // the library is loaded; Auto goes back to that choice.
+  enum class Kernel { Auto, Scalar, SSE2, AVX2, AVX512 };
+
   Salsa20(uint8_t rounds = 20);
 
-  std::vector<std::byte> hash(std::vector<std::byte> message);
+  std::vector<std::byte> hash(const std::vector<std::byte>& message);
+
+  // Hashes the 64 bytes at message into the 64 bytes at output, which may be
+  // the same.
+  void hash(const std::byte* message, std::byte* output) const;
+
+  // Hashes 16 little endian words in place, without allocating.
+  void hash(uint32_t state[16]) const;
+
+  // The order the SIMD kernels hold a state in: the four diagonals of the
+  // 4x4 matrix, (x0, x5, x10, x15), (x4, x9, x14, x3), (x8, x13, x2, x7) and
+  // (x12, x1, x6, x11). Word w of a state is at diagonal_position(w).
+  static constexpr size_t diagonal_position(size_t w) { return 13 * w % 16; }
+  static void to_diagonal(uint32_t state[16]);
+  static void from_diagonal(uint32_t state[16]);
+
+  // hash on a state kept in the diagonal order, which the SIMD kernels load
+  // as it is. Blocks that are hashed over and over, as in ROMix, are put in
+  // that order once instead of being shuffled on every hash.
+  void hash_diagonal(uint32_t state[16]) const;
+
+  // Hashes lanes() independent states in place, one per SIMD lane. The states
+  // are transposed: word k of state l is at states[k * lanes() + l]. The lane
+  // count depends on the kernel, so read it again after set_kernel.
+  void hash_lanes(uint32_t* states) const;
+  static size_t lanes();
+
+  // Forces the kernel used by every Salsa20, e.g. to A/B test them. Returns
+  // false, and keeps the current kernel, if this CPU does not support k.
+  static bool set_kernel(Kernel k);
+  static Kernel kernel();
+  static bool kernel_supported(Kernel k);
+  static const char* kernel_name(Kernel k);
 
   int test_primitives();
 };
@@ -0,0 +1,53 @@
+#ifndef SCRATCHPAD_H
+#define SCRATCHPAD_H
+
+#include <cstddef>
+#include <cstdint>
+
+// How a Scratchpad gets its memory. At large N the random reads of ROMix
+// miss the TLB on almost every block; backing V with 2 MiB pages cuts that
+// down, and keeping it on the NUMA node of the thread that runs the lane
+// avoids remote memory. Everything but Normal pages is Linux-only, and falls
+// back to plain aligned memory elsewhere.
+struct ScratchAllocation {
+  enum class Pages {
+    Normal,       // the C++ heap
+    Transparent,  // anonymous memory advised with MADV_HUGEPAGE
+    HugeTLB,      // MAP_HUGETLB, falling back to Transparent without pages
+  };
+
+  Pages pages = Pages::Normal;
+  // Bind the memory to the NUMA node of the allocating thread.
+  bool node_local = false;
+};
+
+// One contiguous, 64-byte aligned block of memory for ROMix: the V table and
+// the working blocks live in it as 32-bit words.
+class Scratchpad {
+  uint32_t* memory;
+  size_t length;
+  size_t mapped;  // bytes mmapped, or 0 for heap memory
+  ScratchAllocation::Pages backing;
+
+ public:
+  static constexpr size_t alignment = 64;
+
+  explicit Scratchpad(size_t bytes, ScratchAllocation allocation = {});
+  ~Scratchpad();
+
+  Scratchpad(Scratchpad&& other) noexcept;
+  Scratchpad& operator=(Scratchpad&& other) noexcept;
+  Scratchpad(const Scratchpad&) = delete;
+  Scratchpad& operator=(const Scratchpad&) = delete;
+
+  uint32_t* data() { return memory; }
+  const uint32_t* data() const { return memory; }
+
+  // Size in bytes.
+  size_t size() const { return length; }
+
+  // The pages actually backing the memory, after any fallback.
+  ScratchAllocation::Pages pages() const { return backing; }
+};
+
+#endif  // SCRATCHPAD_H
@@ -1,24 +1,211 @@
 #ifndef SCRYPT_H
 #define SCRYPT_H
 
+#include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include "memory_budget.h"
+#include "mfcrypt.h"
+#include "scrypt_context.h"
+
+class ThreadPool;
+class VerifyCache;
+
 class Scrypt {
+  std::shared_ptr<ThreadPool> pool;
+  std::shared_ptr<MemoryBudget> memory_budget;
+  MemoryBudget::Admission admission = MemoryBudget::Admission::Block;
+  std::chrono::milliseconds admission_timeout{0};
+  std::shared_ptr<ScryptContext> context;
+  std::shared_ptr<VerifyCache> verify_cache;
+  ScratchAllocation scratch_allocation;
+  size_t interleaving = 1;
+  uint64_t tmto_stride = 1;
+  size_t lane_memory_limit = SIZE_MAX;
+
+  ThreadPool& thread_pool() const;
+  MemoryBudget& budget() const;
+  ScryptContext::Lease borrow_scratch(
+      size_t bytes, MemoryBudget::Reservation* reservation) const;
+
+  template <typename PRF, typename MF>
+  bool hash(const std::byte* passphrase, size_t passphrase_length,
+            const std::byte* salt, size_t salt_length, uint64_t cost_factor_N,
+            uint32_t block_size_factor_r, uint32_t parallelization_factor_p,
+            std::byte* output, size_t desired_key_length,
+            const std::atomic<bool>* cancelled);
+
  public:
-  // Eventually, I want to modify this to take in a PRF and a MF as in MFcrypt
-  // algorithm in [SCRYPT]. For now, we use the scrypt defaults (HMAC_SHA256,
-  // ROMMix).
+  // hash is scrypt, the MFcrypt algorithm of [SCRYPT] with HMAC_SHA256 and
+  // ROMix; hash<PRF, MF> below takes others.
+  //
+  // The ROMix lanes run on the given pool, or on ThreadPool::shared() if there
+  // is none. With p = 1 hash runs on the calling thread alone.
   Scrypt();
+  explicit Scrypt(std::shared_ptr<ThreadPool> pool);
+
+  // Before ROMix runs, hash reserves its scratch memory, 128 * r * N bytes
+  // per lane, from this budget or from MemoryBudget::global(). If the policy
+  // gives up, hash returns an empty vector (and hash_batch an empty batch).
+  void set_memory_budget(std::shared_ptr<MemoryBudget> budget);
+  void set_admission(MemoryBudget::Admission policy,
+                     std::chrono::milliseconds timeout = {});
 
-  std::vector<std::byte> hash(std::vector<std::byte> passphrase,
-                              std::vector<std::byte> salt,
+  // Borrows ROMix scratchpads from this context instead of allocating them
+  // for every hash. Contexts can be shared between Scrypt objects. If the
+  // context is charged to the memory budget of this Scrypt, it frees idle
+  // scratchpads to let a hash in.
+  void set_context(std::shared_ptr<ScryptContext> context);
+
+  // Lets verify answer checks that succeeded recently from this cache,
+  // without hashing, and record the ones that succeed. Caches can be shared
+  // between Scrypt objects.
+  void set_verify_cache(std::shared_ptr<VerifyCache> cache);
+
+  // How new ROMix scratchpads are allocated: huge pages, and whether to bind
+  // them to the NUMA node of the thread running the lane. Each lane allocates
+  // its scratchpad on the thread that mixes it.
+  void set_scratch_allocation(ScratchAllocation allocation);
+
+  // How many ROMix lanes of a hash one thread mixes at once, interleaved so
+  // that the random reads of each lane are prefetched while the others
+  // compute (see romix::ROMixInterleaved). The default of 1 mixes every
+  // lane on a thread of its own; at most romix::max_interleaved.
+  void set_interleaving(size_t lanes);
+
+  // Time-memory tradeoff for hosts short of memory (see romix::ROMixTMTO).
+  // With a stride k > 1 each lane keeps every k-th entry of V and recomputes
+  // the others as they are read. With a lane memory limit, each hash takes
+  // the smallest stride whose scratch fits in that many bytes per lane, if
+  // it is larger; a hash that cannot fit even then returns false, like a
+  // refusal of the memory budget. Keys are the same either way. Lanes with
+  // a stride above 1 are not interleaved, and hash_batch ignores both.
+  void set_tmto_stride(uint64_t stride);
+  void set_lane_memory_limit(size_t bytes);
+
+  std::vector<std::byte> hash(const std::vector<std::byte>& passphrase,
+                              const std::vector<std::byte>& salt,
                               uint64_t cost_factor_N,
                               uint32_t block_size_factor_r,
                               uint32_t parallelization_factor_p,
                               size_t desired_key_length);
 
+  // Writes desired_key_length bytes of key to output. The passphrase and salt
+  // are passed down to OpenSSL without copies. Returns false, with output
+  // untouched, if the memory budget refuses the hash, if N is not a power of
+  // two larger than 1, or if r or p is 0 or r * p is not below 2^30 (Section
+  // 6 of RFC 7914).
+  bool hash(const std::byte* passphrase, size_t passphrase_length,
+            const std::byte* salt, size_t salt_length, uint64_t cost_factor_N,
+            uint32_t block_size_factor_r, uint32_t parallelization_factor_p,
+            std::byte* output, size_t desired_key_length);
+
+  // MFcrypt with the PRF and mixing function policies of include/mfcrypt.h,
+  // e.g. hash<mfcrypt::HMACSHA512, mfcrypt::ROMixChaCha20_8>. The keys are
+  // not scrypt keys unless the policies are the scrypt ones. The memory
+  // budget, context and lane memory limit apply as for hash; interleaving
+  // and the time-memory tradeoff only to ROMixSalsa20_8, so with another
+  // mixing function a hash whose scratch exceeds the lane memory limit
+  // returns false.
+  template <typename PRF, typename MF>
+  bool hash(const std::byte* passphrase, size_t passphrase_length,
+            const std::byte* salt, size_t salt_length, uint64_t cost_factor_N,
+            uint32_t block_size_factor_r, uint32_t parallelization_factor_p,
+            std::byte* output, size_t desired_key_length);
+
+  // Setting the flag of a hash_async or hash_batch stops it before its next
+  // PBKDF2 run or ROMix iteration.
+  using Cancellation = std::shared_ptr<std::atomic<bool>>;
+  using Callback = std::function<void(std::vector<std::byte>)>;
+
+  // Runs hash on the pool and returns at once. done is called on a pool
+  // thread with the key, or with an empty vector if the memory budget refused
+  // the hash or it was cancelled. The hash works on a copy of this Scrypt, so
+  // this object may go away before it finishes; a pool of its own must not.
+  void hash_async(std::vector<std::byte> passphrase,
+                  std::vector<std::byte> salt, uint64_t cost_factor_N,
+                  uint32_t block_size_factor_r,
+                  uint32_t parallelization_factor_p, size_t desired_key_length,
+                  Callback done, Cancellation cancelled = nullptr);
+
+  // hash_async that hands the key over through a future.
+  std::future<std::vector<std::byte>> hash_async(
+      std::vector<std::byte> passphrase, std::vector<std::byte> salt,
+      uint64_t cost_factor_N, uint32_t block_size_factor_r,
+      uint32_t parallelization_factor_p, size_t desired_key_length,
+      Cancellation cancelled = nullptr);
+
+  // One hash of a batch, with parameters of its own.
+  struct Job {
+    std::vector<std::byte> passphrase;
+    std::vector<std::byte> salt;
+    uint64_t cost_factor_N;
+    uint32_t block_size_factor_r;
+    uint32_t parallelization_factor_p;
+    size_t desired_key_length;
+  };
+
+  // Hashes a batch of jobs, returning their keys in order. The ROMix lanes of
+  // every job are scheduled on the pool together: lanes of jobs that share N
+  // and r are interleaved across SIMD lanes, Salsa20::lanes() at a time, and
+  // the most expensive lanes start first. The PBKDF2 blocks of all the jobs
+  // share the lanes of the multi-buffer SHA-256 kernels. This trades the
+  // latency of single hashes for throughput. The scratch of the whole batch
+  // is reserved at once; if the memory budget refuses it, any job has an N,
+  // r or p that hash would refuse, or the batch is cancelled, hash_batch
+  // returns an empty batch.
+  std::vector<std::vector<std::byte>> hash_batch(
+      const std::vector<Job>& jobs, Cancellation cancelled = nullptr);
+
+  // hash_batch for (passphrase, salt) pairs that share N, r and p.
+  std::vector<std::vector<std::byte>> hash_multi(
+      const std::vector<std::pair<std::vector<std::byte>,
+                                  std::vector<std::byte>>>& inputs,
+      uint64_t cost_factor_N, uint32_t block_size_factor_r,
+      uint32_t parallelization_factor_p, size_t desired_key_length,
+      Cancellation cancelled = nullptr);
+
+  // Password hashes in the PHC string format,
+  //   $scrypt$ln=<log2 N>,r=<r>,p=<p>$<salt>$<key>
+  // with the salt and key in base64 without padding. Salts and keys of up to
+  // max_phc_bytes bytes are supported.
+  static constexpr size_t max_phc_bytes = 64;
+  static constexpr size_t max_phc_length = 256;
+
+  // Writes the PHC string of a key to encoded, without allocating. Returns
+  // its length, or 0 if it does not fit in capacity, the salt or key is too
+  // long, or N is not a power of two larger than 1.
+  static size_t encode(const std::byte* salt, size_t salt_length,
+                       uint64_t cost_factor_N, uint32_t block_size_factor_r,
+                       uint32_t parallelization_factor_p, const std::byte* key,
+                       size_t key_length, char* encoded, size_t capacity);
+
+  // Hashes passphrase and returns its PHC string, or an empty string if the
+  // memory budget refused the hash.
+  std::string encode(const std::vector<std::byte>& passphrase,
+                     const std::vector<std::byte>& salt,
+                     uint64_t cost_factor_N, uint32_t block_size_factor_r,
+                     uint32_t parallelization_factor_p,
+                     size_t desired_key_length);
+
+  // Checks passphrase against a PHC string. Malformed strings are rejected
+  // before any hashing, and the key is compared in constant time. Parsing
+  // does not allocate. Returns false as well if the memory budget refused
+  // the hash. With a verify cache, a check that succeeded within its ttl
+  // returns true at once.
+  bool verify(const std::byte* passphrase, size_t passphrase_length,
+              const char* encoded, size_t encoded_length);
+  bool verify(const std::vector<std::byte>& passphrase,
+              const std::string& encoded);
+
   int test_primitives();
 };
 
@@ -0,0 +1,120 @@
+#ifndef SCRYPT_CONTEXT_H
+#define SCRYPT_CONTEXT_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "memory_budget.h"
+#include "scratchpad.h"
+
+// A cache of scratchpads for servers that hash over and over with the same
+// N and r. Scratchpads come back to the context after each ROMix and are lent
+// out again, preferably to the thread that used them last, so consecutive
+// hashes skip the allocation and the page faults.
+//
+// ROMix writes every word of V before it reads it, so reused scratch need not
+// be zeroed for correctness; set wipe to scrub it when it comes back anyway.
+//
+// A lent scratchpad is covered by the reservation of the hash that borrows
+// it, so a request is only lent one of exactly its size. Idle scratchpads are
+// charged to a memory budget: a returned one takes its charge over from the
+// reservation of its borrower when that is against the same budget, and is
+// freed if the budget cannot take it otherwise.
+class ScryptContext {
+ public:
+  // max_cached_bytes bounds the memory kept between hashes. Scratchpads idle
+  // for longer than idle_timeout are freed on the next acquire or release,
+  // or by trim. The cache is charged to budget, or to MemoryBudget::global()
+  // if there is none.
+  explicit ScryptContext(
+      size_t max_cached_bytes = size_t{1} << 30,
+      std::chrono::milliseconds idle_timeout = std::chrono::seconds(30),
+      bool wipe = false, std::shared_ptr<MemoryBudget> budget = nullptr);
+  ~ScryptContext();
+
+  ScryptContext(const ScryptContext&) = delete;
+  ScryptContext& operator=(const ScryptContext&) = delete;
+
+  // A borrowed scratchpad, returned to its context when destroyed. A lease
+  // made from a plain Scratchpad just frees it. A lease outlives neither its
+  // context nor the reservation it was acquired with.
+  class Lease {
+    ScryptContext* owner;
+    Scratchpad pad;
+    // The reservation of the borrower, or whether the lease carries the
+    // charge of its scratchpad itself, as the leases of take do.
+    MemoryBudget::Reservation* reservation;
+    bool charged;
+
+   public:
+    explicit Lease(Scratchpad p, ScryptContext* o = nullptr,
+                   MemoryBudget::Reservation* r = nullptr, bool c = false);
+    ~Lease();
+
+    Lease(Lease&& other) noexcept;
+    Lease& operator=(Lease&&) = delete;
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+
+    uint32_t* data() { return pad.data(); }
+    size_t size() const { return pad.size(); }
+  };
+
+  // Lends a scratchpad of bytes, which reservation, if given, covers. New
+  // scratchpads are made with allocation and pre-faulted by the calling
+  // thread, so their pages are local to it; cached ones are lent whatever
+  // their allocation.
+  Lease acquire(size_t bytes, ScratchAllocation allocation = {},
+                MemoryBudget::Reservation* reservation = nullptr);
+
+  // Lends up to count cached scratchpads of bytes, if the context is charged
+  // to budget, with their charge. A hash takes them before it reserves
+  // memory, and reserves only for the rest of its lanes.
+  std::vector<Lease> take(const MemoryBudget& budget, size_t bytes,
+                          size_t count);
+
+  // Frees scratchpads idle for longer than the idle timeout.
+  void trim();
+  // Frees the least recently returned scratchpads until bytes more fit in
+  // budget, if the cache is charged to it. Scrypt calls this before it
+  // reserves memory, so that idle scratch does not hold a hash back.
+  void make_room(const MemoryBudget& budget, size_t bytes);
+  // Frees every cached scratchpad.
+  void clear();
+
+  size_t cached_bytes() const;
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  struct Entry {
+    Scratchpad pad;
+    std::thread::id last_user;
+    std::chrono::steady_clock::time_point returned;
+  };
+
+  void release(Scratchpad pad, MemoryBudget::Reservation* reservation,
+               bool charged_already);
+  void evict_idle(std::chrono::steady_clock::time_point now);
+  void evict_oldest();
+
+  const size_t max_cached;
+  const std::chrono::milliseconds idle_timeout;
+  const bool wipe;
+  const std::shared_ptr<MemoryBudget> own_budget;
+  MemoryBudget& charged;
+
+  mutable std::mutex mutex;
+  std::list<Entry> cache;  // most recently returned first
+  size_t cached;
+  uint64_t hit_count;
+  uint64_t miss_count;
+};
+
+#endif  // SCRYPT_CONTEXT_H
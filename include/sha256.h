@@ -0,0 +1,40 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+
+// The SHA-256 compression function (FIPS 180-4), on one state or on several
+// independent states at once, for the HMAC blocks of PBKDF2.
+class SHA256 {
+ public:
+  // Implementations of the multi-buffer compression. The best one the CPU
+  // supports is picked when the library is loaded; Auto goes back to that
+  // choice. Scalar also turns off SHA-NI in compress.
+  enum class Kernel { Auto, Scalar, SSE2, AVX2, AVX512 };
+
+  static const uint32_t initial_state[8];
+
+  // Runs the compression function on state with each of n 64-byte blocks in
+  // turn, with SHA-NI where the CPU has it.
+  static void compress(uint32_t state[8], const std::byte* blocks, size_t n);
+
+  // Runs the compression function on lanes() independent states, each with a
+  // 64-byte block of its own, one per SIMD lane. The states are transposed:
+  // word k of state l is at states[k * lanes() + l]. The lane count depends
+  // on the kernel, so read it again after set_kernel.
+  static void compress_lanes(uint32_t* states, const std::byte* const* blocks);
+  static size_t lanes();
+
+  // The whole hash of a message, into 32 bytes of digest.
+  static void hash(const std::byte* message, size_t length, std::byte* digest);
+
+  // Forces the kernel, e.g. to A/B test them. Returns false, and keeps the
+  // current kernel, if this CPU does not support k.
+  static bool set_kernel(Kernel k);
+  static Kernel kernel();
+  static bool kernel_supported(Kernel k);
+  static const char* kernel_name(Kernel k);
+};
+
+#endif  // SHA256_H
@@ -0,0 +1,106 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A persistent, work-stealing pool of worker threads.
+//
+// Work arrives in TaskGroups, e.g. the ROMix lanes of one Scrypt::hash call.
+// Groups submitted from outside the pool are served round-robin, one task at a
+// time, so concurrent callers interleave fairly instead of queueing behind
+// each other. Tasks submitted from a worker go to that worker's own deque,
+// which it pops from the back and idle workers steal from the front.
+class ThreadPool {
+ public:
+  class TaskGroup;
+
+  explicit ThreadPool(size_t workers = std::thread::hardware_concurrency());
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t size() const { return threads.size(); }
+
+  // A process-wide pool with one worker per hardware thread, created on
+  // first use.
+  static std::shared_ptr<ThreadPool> shared();
+
+  // Runs task on the pool without waiting for it. The pool's destructor
+  // waits for posted tasks.
+  void post(std::function<void()> task);
+
+ private:
+  struct Task {
+    std::function<void()> function;
+    TaskGroup* group;
+  };
+
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void submit(TaskGroup* group, std::function<void()> function);
+  bool try_run_one(size_t worker);
+  bool pop_local(size_t worker, Task& task);
+  bool pop_ready(Task& task);
+  bool steal(size_t thief, Task& task);
+  void run(Task& task);
+  void work(size_t worker);
+
+  std::vector<std::unique_ptr<WorkerQueue>> queues;
+  std::vector<std::thread> threads;
+
+  // Guards ready, the pending tasks of every group and stopping.
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<TaskGroup*> ready;
+  std::atomic<size_t> local_tasks;
+  bool stopping;
+
+  // The group of the tasks from post.
+  std::unique_ptr<TaskGroup> posted;
+};
+
+// A set of tasks that can be waited on together. Destroying a group waits for
+// its tasks.
+class ThreadPool::TaskGroup {
+ public:
+  explicit TaskGroup(ThreadPool& pool);
+  ~TaskGroup();
+
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  void run(std::function<void()> task);
+
+  // Blocks until every task has run. The caller runs queued tasks of the
+  // group itself while it waits.
+  void wait();
+
+ private:
+  friend class ThreadPool;
+
+  void finish();
+
+  ThreadPool& pool;
+
+  // Guarded by pool.mutex.
+  std::deque<std::function<void()>> pending;
+  bool scheduled;
+
+  std::mutex done_mutex;
+  std::condition_variable done;
+  size_t outstanding;
+};
+
+#endif  // THREAD_POOL_H
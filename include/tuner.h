@@ -0,0 +1,84 @@
+#ifndef TUNER_H
+#define TUNER_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "memory_budget.h"
+#include "scrypt.h"
+
+// Picks scrypt parameters for the running machine by timing Scrypt::hash on
+// it, as libscrypt's pickparams does: the largest N, and p where the cores
+// allow it, whose hashes still take no more than a target latency and fit in
+// a memory cap when a number of them run at once.
+class Tuner {
+ public:
+  struct Target {
+    std::chrono::milliseconds latency{100};
+
+    // The scratch memory the concurrent hashes may use together. Each hash
+    // takes ROMixScratchSize(r, N) bytes per lane.
+    size_t memory = MemoryBudget::unlimited;
+
+    // How many hashes are expected to run at once. They share the memory and
+    // the cores, and are timed running together.
+    unsigned concurrency = 1;
+
+    uint32_t block_size_factor_r = 8;
+
+    // Hashes timed per thread for each measurement; the median counts.
+    unsigned samples = 3;
+  };
+
+  struct Measurement {
+    uint64_t cost_factor_N;
+    uint32_t block_size_factor_r;
+    uint32_t parallelization_factor_p;
+    unsigned concurrency;
+
+    // The median wall time of one hash.
+    std::chrono::nanoseconds latency;
+
+    // Of all the concurrent hashes together.
+    double hashes_per_second;
+  };
+
+  struct Result {
+    uint64_t cost_factor_N;
+    uint32_t block_size_factor_r;
+    uint32_t parallelization_factor_p;
+
+    // False if even the cheapest parameters that fit miss the target, or
+    // nothing fits in the memory cap at all; the parameters are then those
+    // cheapest ones.
+    bool met;
+
+    // The measurement of the chosen parameters.
+    Measurement chosen;
+
+    // Every configuration timed along the way, in order.
+    std::vector<Measurement> measurements;
+  };
+
+  // Times hashes of scrypt, with its pool and memory budget. cores is how
+  // many lanes can run in parallel; it should match the size of the pool.
+  explicit Tuner(Scrypt scrypt = Scrypt(),
+                 size_t cores = std::thread::hardware_concurrency());
+
+  // Times concurrency threads hashing with the given parameters at once,
+  // samples hashes each.
+  Measurement measure(uint64_t cost_factor_N, uint32_t block_size_factor_r,
+                      uint32_t parallelization_factor_p,
+                      unsigned concurrency = 1, unsigned samples = 3);
+
+  Result tune(const Target& target);
+
+ private:
+  Scrypt scrypt;
+  size_t cores;
+};
+
+#endif  // TUNER_H
@@ -9,8 +9,59 @@ class utilities {
  public:
   utilities();
 
-  static std::string bytesToHex(std::vector<std::byte> data);
-  static std::vector<std::byte> hexToBytes(std::string hex_string);
+  // Hex as "00ff..." (Compact), or with a space after every byte and a
+  // newline after every 16 bytes and at the end (Spaced), as bytesToHex
+  // writes it. Decoding Spaced accepts any whitespace between bytes.
+  enum class HexFormat { Compact, Spaced };
+
+  // Base64 with the standard alphabet, with or without '=' padding.
+  enum class Base64Format { Unpadded, Padded };
+
+  enum class CodecError {
+    None,
+    InvalidCharacter,  // not a digit of the alphabet, or misplaced
+    InvalidLength,     // e.g. half a byte of hex
+    NonCanonical,      // base64 whose unused trailing bits are not zero
+    Overflow,          // the output does not fit in its buffer
+  };
+
+  // How a decode went: the bytes written, and on failure the error and the
+  // offset in the input where it was found.
+  struct Decoded {
+    size_t length;
+    CodecError error;
+    size_t position;
+
+    bool ok() const { return error == CodecError::None; }
+  };
+
+  // Encoders write exactly hexLength or base64Length characters to out,
+  // which must have room for them, and return that length. Decoders write
+  // at most capacity bytes to out. None of them allocates.
+  static size_t hexLength(size_t n, HexFormat format = HexFormat::Compact);
+  static size_t encodeHex(const std::byte* in, size_t n, char* out,
+                          HexFormat format = HexFormat::Compact);
+  static Decoded decodeHex(const char* in, size_t n, std::byte* out,
+                           size_t capacity,
+                           HexFormat format = HexFormat::Compact);
+
+  static size_t base64Length(size_t n,
+                             Base64Format format = Base64Format::Unpadded);
+  static size_t encodeBase64(const std::byte* in, size_t n, char* out,
+                             Base64Format format = Base64Format::Unpadded);
+  static Decoded decodeBase64(const char* in, size_t n, std::byte* out,
+                              size_t capacity,
+                              Base64Format format = Base64Format::Unpadded);
+
+  // Spaced hex. hexToBytes reads whitespace separated hex numbers, as
+  // istream does, and keeps the low byte of each: "a" and "0x0a" are one
+  // byte, and so is "abcd" (0xcd). hexToBytesStrict decodes with decodeHex,
+  // two digits per byte, without the allocations of a stream. Both return
+  // the bytes before the first error.
+  static std::string bytesToHex(const std::vector<std::byte>& data);
+  static std::vector<std::byte> hexToBytes(const std::string& hex_string);
+  static std::vector<std::byte> hexToBytesStrict(
+      const std::string& hex_string);
 
   static std::vector<std::byte> stringToBytes(std::string s);
 };
@@ -0,0 +1,95 @@
+#ifndef VERIFY_CACHE_H
+#define VERIFY_CACHE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A cache of successful password checks, for servers that verify the same
+// credential over and over. Scrypt::verify with a cache set answers a check
+// it has seen succeed within the ttl without hashing; misses and failures
+// always take the full path, and failures are never cached.
+//
+// Entries hold neither passphrases nor keys: a check is known by the
+// HMAC-SHA256, under a secret drawn at construction, of the passphrase and
+// the stored PHC string. Lookups take no lock and do not allocate. The
+// slots are split into shards, each with a lock for its writers, and every
+// slot is a seqlock, so a reader that races a writer sees a miss.
+class VerifyCache {
+ public:
+  // capacity bounds the entries kept, spread over shards; when a slot is
+  // needed, an expired entry or the one closest to expiring makes way.
+  explicit VerifyCache(
+      size_t capacity = 4096,
+      std::chrono::milliseconds ttl = std::chrono::seconds(60),
+      size_t shards = 16);
+  ~VerifyCache();
+
+  VerifyCache(const VerifyCache&) = delete;
+  VerifyCache& operator=(const VerifyCache&) = delete;
+
+  // Whether passphrase was recorded as matching encoded within the ttl.
+  bool contains(const std::byte* passphrase, size_t passphrase_length,
+                const char* encoded, size_t encoded_length);
+
+  // Records that passphrase matches encoded, for the next ttl.
+  void insert(const std::byte* passphrase, size_t passphrase_length,
+              const char* encoded, size_t encoded_length);
+
+  // Forgets every check against encoded, e.g. when the credential is
+  // revoked or rehashed.
+  void invalidate(const char* encoded, size_t encoded_length);
+  // Forgets every check.
+  void clear();
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  // 32 bytes of HMAC, as words.
+  struct Tag {
+    uint64_t words[4];
+  };
+
+  // Written under the lock of its shard, read without it. sequence is odd
+  // while a write is under way; an expiry of 0 marks an empty slot.
+  struct Slot {
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<uint64_t> check[4] = {};
+    std::atomic<uint64_t> stored{0};
+    std::atomic<int64_t> expiry{0};
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::unique_ptr<Slot[]> slots;
+  };
+
+  static constexpr size_t ways = 4;
+
+  Tag mac(uint8_t domain, const std::byte* passphrase,
+          size_t passphrase_length, const char* encoded,
+          size_t encoded_length) const;
+  Shard& shard_of(const Tag& check);
+  Slot* bucket_of(Shard& shard, const Tag& check) const;
+  static bool matches(const Slot& slot, const Tag& check, int64_t now);
+  static void write(Slot& slot, const Tag& check, uint64_t stored,
+                    int64_t expiry);
+
+  const std::chrono::milliseconds ttl;
+  const size_t buckets_per_shard;
+  std::vector<Shard> shard_list;
+
+  // SHA-256 states after the inner and outer padded secret.
+  uint32_t inner_state[8];
+  uint32_t outer_state[8];
+
+  std::atomic<uint64_t> hit_count{0};
+  std::atomic<uint64_t> miss_count{0};
+};
+
+#endif  // VERIFY_CACHE_H
@@ -0,0 +1,221 @@
+// chacha20.cc - The ChaCha core, for BlockMix in place of Salsa20.
+// Based on the paper (https://cr.yp.to/chacha/chacha-20080128.pdf) and
+// Section 2.3 of RFC 7539.
+
+#include "chacha20.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <initializer_list>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHACHA20_X86 1
+#endif
+
+namespace {
+
+uint32_t Rotate(uint32_t x, int c) { return (x << c) | (x >> (32 - c)); }
+
+void QuarterRound(uint32_t* x, int a, int b, int c, int d) {
+  x[a] += x[b];
+  x[d] = Rotate(x[d] ^ x[a], 16);
+  x[c] += x[d];
+  x[b] = Rotate(x[b] ^ x[c], 12);
+  x[a] += x[b];
+  x[d] = Rotate(x[d] ^ x[a], 8);
+  x[c] += x[d];
+  x[b] = Rotate(x[b] ^ x[c], 7);
+}
+
+void chacha_core(uint32_t state[16], uint32_t rounds) {
+  uint32_t x[16];
+  for (size_t i = 0; i < 16; i++) {
+    x[i] = state[i];
+  }
+  for (uint32_t i = 0; i < rounds; i += 2) {
+    // Columns, then diagonals.
+    QuarterRound(x, 0, 4, 8, 12);
+    QuarterRound(x, 1, 5, 9, 13);
+    QuarterRound(x, 2, 6, 10, 14);
+    QuarterRound(x, 3, 7, 11, 15);
+    QuarterRound(x, 0, 5, 10, 15);
+    QuarterRound(x, 1, 6, 11, 12);
+    QuarterRound(x, 2, 7, 8, 13);
+    QuarterRound(x, 3, 4, 9, 14);
+  }
+  for (size_t i = 0; i < 16; i++) {
+    state[i] += x[i];
+  }
+}
+
+#ifdef CHACHA20_X86
+
+// The four rows of the state, one register each. A column round is then one
+// quarter round on the rows; rotating rows b, c and d by one, two and three
+// words lines the diagonals up for the next.
+#define CHACHA20_QUARTER_ROUND(ROTATE) \
+  a = _mm_add_epi32(a, b);             \
+  d = ROTATE(_mm_xor_si128(d, a), 16); \
+  c = _mm_add_epi32(c, d);             \
+  b = ROTATE(_mm_xor_si128(b, c), 12); \
+  a = _mm_add_epi32(a, b);             \
+  d = ROTATE(_mm_xor_si128(d, a), 8);  \
+  c = _mm_add_epi32(c, d);             \
+  b = ROTATE(_mm_xor_si128(b, c), 7);
+
+#define CHACHA20_ROW_KERNEL(ROTATE)                  \
+  __m128i* rows = reinterpret_cast<__m128i*>(state); \
+  __m128i a = _mm_loadu_si128(rows);                 \
+  __m128i b = _mm_loadu_si128(rows + 1);             \
+  __m128i c = _mm_loadu_si128(rows + 2);             \
+  __m128i d = _mm_loadu_si128(rows + 3);             \
+  const __m128i a0 = a, b0 = b, c0 = c, d0 = d;      \
+  for (uint32_t i = 0; i < rounds; i += 2) {         \
+    CHACHA20_QUARTER_ROUND(ROTATE)                   \
+    b = _mm_shuffle_epi32(b, 0x39);                  \
+    c = _mm_shuffle_epi32(c, 0x4e);                  \
+    d = _mm_shuffle_epi32(d, 0x93);                  \
+    CHACHA20_QUARTER_ROUND(ROTATE)                   \
+    b = _mm_shuffle_epi32(b, 0x93);                  \
+    c = _mm_shuffle_epi32(c, 0x4e);                  \
+    d = _mm_shuffle_epi32(d, 0x39);                  \
+  }                                                  \
+  _mm_storeu_si128(rows, _mm_add_epi32(a, a0));      \
+  _mm_storeu_si128(rows + 1, _mm_add_epi32(b, b0));  \
+  _mm_storeu_si128(rows + 2, _mm_add_epi32(c, c0));  \
+  _mm_storeu_si128(rows + 3, _mm_add_epi32(d, d0));
+
+#define CHACHA20_ROTATE_SHIFT(T, n) \
+  _mm_or_si128(_mm_slli_epi32((T), (n)), _mm_srli_epi32((T), 32 - (n)))
+#define CHACHA20_ROTATE_PROLD(T, n) _mm_rol_epi32((T), (n))
+
+__attribute__((target("sse2"))) void chacha_core_sse2(uint32_t state[16],
+                                                      uint32_t rounds) {
+  CHACHA20_ROW_KERNEL(CHACHA20_ROTATE_SHIFT)
+}
+
+// Same code as SSE2, but VEX encoded.
+__attribute__((target("avx2"))) void chacha_core_avx2(uint32_t state[16],
+                                                      uint32_t rounds) {
+  CHACHA20_ROW_KERNEL(CHACHA20_ROTATE_SHIFT)
+}
+
+// AVX-512VL has a native 32-bit rotate.
+__attribute__((target("avx512f,avx512vl"))) void chacha_core_avx512(
+    uint32_t state[16], uint32_t rounds) {
+  CHACHA20_ROW_KERNEL(CHACHA20_ROTATE_PROLD)
+}
+
+#endif  // CHACHA20_X86
+
+typedef void (*ChaChaCoreFunction)(uint32_t state[16], uint32_t rounds);
+
+struct ChaChaKernel {
+  ChaCha20::Kernel kind;
+  ChaChaCoreFunction core;
+};
+
+const ChaChaKernel scalar_kernel{ChaCha20::Kernel::Scalar, chacha_core};
+#ifdef CHACHA20_X86
+const ChaChaKernel sse2_kernel{ChaCha20::Kernel::SSE2, chacha_core_sse2};
+const ChaChaKernel avx2_kernel{ChaCha20::Kernel::AVX2, chacha_core_avx2};
+const ChaChaKernel avx512_kernel{ChaCha20::Kernel::AVX512,
+                                 chacha_core_avx512};
+#endif
+
+const ChaChaKernel* kernelEntry(ChaCha20::Kernel k) {
+  switch (k) {
+#ifdef CHACHA20_X86
+    case ChaCha20::Kernel::SSE2:
+      return &sse2_kernel;
+    case ChaCha20::Kernel::AVX2:
+      return &avx2_kernel;
+    case ChaCha20::Kernel::AVX512:
+      return &avx512_kernel;
+#endif
+    case ChaCha20::Kernel::Scalar:
+      return &scalar_kernel;
+    default:
+      return nullptr;
+  }
+}
+
+bool kernelSupported(ChaCha20::Kernel k) {
+  switch (k) {
+    case ChaCha20::Kernel::Auto:
+    case ChaCha20::Kernel::Scalar:
+      return true;
+#ifdef CHACHA20_X86
+    case ChaCha20::Kernel::SSE2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse2");
+    case ChaCha20::Kernel::AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+    case ChaCha20::Kernel::AVX512:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx512f") &&
+             __builtin_cpu_supports("avx512vl");
+#endif
+    default:
+      return false;
+  }
+}
+
+// The best kernel the CPU supports.
+ChaCha20::Kernel bestKernel() {
+  for (auto k : {ChaCha20::Kernel::AVX512, ChaCha20::Kernel::AVX2,
+                 ChaCha20::Kernel::SSE2}) {
+    if (kernelSupported(k)) {
+      return k;
+    }
+  }
+  return ChaCha20::Kernel::Scalar;
+}
+
+// Selected once, at load time, from CPUID.
+std::atomic<const ChaChaKernel*> active_kernel{kernelEntry(bestKernel())};
+
+}  // namespace
+
+ChaCha20::ChaCha20(uint8_t r) {
+  assert((r % 2) == 0);
+  rounds = r;
+}
+
+void ChaCha20::hash(uint32_t state[16]) const {
+  active_kernel.load(std::memory_order_relaxed)->core(state, rounds);
+}
+
+bool ChaCha20::set_kernel(Kernel k) {
+  if (!kernelSupported(k)) {
+    return false;
+  }
+  if (k == Kernel::Auto) {
+    k = bestKernel();
+  }
+  active_kernel.store(kernelEntry(k));
+  return true;
+}
+
+ChaCha20::Kernel ChaCha20::kernel() { return active_kernel.load()->kind; }
+
+bool ChaCha20::kernel_supported(Kernel k) { return kernelSupported(k); }
+
+const char* ChaCha20::kernel_name(Kernel k) {
+  switch (k) {
+    case Kernel::Auto:
+      return "auto";
+    case Kernel::Scalar:
+      return "scalar";
+    case Kernel::SSE2:
+      return "sse2";
+    case Kernel::AVX2:
+      return "avx2";
+    case Kernel::AVX512:
+      return "avx512";
+  }
+  return "unknown";
+}
@@ -0,0 +1,110 @@
+// memory_budget.cc - Admission control for scrypt scratch memory.
+
+#include "memory_budget.h"
+
+#include <algorithm>
+
+MemoryBudget::MemoryBudget(size_t limit)
+    : next_ticket{0},
+      limit_bytes{limit},
+      in_use_bytes{0},
+      peak_bytes{0},
+      waiting{0},
+      rejections{0} {}
+
+MemoryBudget& MemoryBudget::global() {
+  static MemoryBudget budget;
+  return budget;
+}
+
+void MemoryBudget::set_limit(size_t bytes) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    limit_bytes = bytes;
+  }
+  released.notify_all();
+}
+
+bool MemoryBudget::fits(size_t bytes) const {
+  return bytes <= limit_bytes && in_use_bytes <= limit_bytes - bytes;
+}
+
+bool MemoryBudget::acquire(size_t bytes, Admission policy,
+                           std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  if (bytes > limit_bytes ||
+      (policy == Admission::FailFast && !(queue.empty() && fits(bytes)))) {
+    rejections++;
+    return false;
+  }
+
+  uint64_t ticket = next_ticket++;
+  queue.push_back(ticket);
+  waiting++;
+
+  // Only the oldest waiter may take memory, so a large request is not
+  // starved by a stream of small ones.
+  auto admissible = [&] {
+    return bytes > limit_bytes || (queue.front() == ticket && fits(bytes));
+  };
+  bool admitted;
+  if (policy == Admission::Timeout) {
+    admitted = released.wait_for(lock, timeout, admissible);
+  } else {
+    released.wait(lock, admissible);
+    admitted = true;
+  }
+  admitted = admitted && bytes <= limit_bytes;
+
+  waiting--;
+  queue.erase(std::find(queue.begin(), queue.end(), ticket));
+
+  if (admitted) {
+    in_use_bytes += bytes;
+    peak_bytes = std::max<size_t>(peak_bytes, in_use_bytes);
+  } else {
+    rejections++;
+  }
+
+  lock.unlock();
+  // The next waiter may fit too, or may now be at the front.
+  released.notify_all();
+  return admitted;
+}
+
+void MemoryBudget::release(size_t bytes) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    in_use_bytes -= bytes;
+  }
+  released.notify_all();
+}
+
+MemoryBudget::Reservation::Reservation(MemoryBudget& b, size_t n,
+                                       Admission policy,
+                                       std::chrono::milliseconds timeout)
+    : budget{nullptr}, bytes{n} {
+  if (b.acquire(n, policy, timeout)) {
+    budget = &b;
+  }
+}
+
+MemoryBudget::Reservation::~Reservation() {
+  if (budget) {
+    budget->release(bytes);
+  }
+}
+
+bool MemoryBudget::Reservation::transfer(const MemoryBudget& b, size_t n) {
+  if (budget != &b) {
+    return false;
+  }
+  size_t held = bytes;
+  do {
+    if (n > held) {
+      return false;
+    }
+  } while (!bytes.compare_exchange_weak(held, held - n));
+  return true;
+}
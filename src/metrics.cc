@@ -0,0 +1,186 @@
+// metrics.cc - Per-stage timers and counters of scrypt, and their hook and
+// histograms.
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace metrics {
+
+namespace internal {
+std::atomic<bool> listening{false};
+}
+
+namespace {
+
+std::mutex settings;
+std::shared_ptr<const Hook> installed_hook;
+std::atomic<bool> histograms_on{false};
+
+Histogram stage_histograms[stage_count];
+
+#if CPP_SCRYPT_METRICS
+thread_local Recorder* current = nullptr;
+#endif
+
+// Under settings.
+void UpdateListening() {
+  internal::listening = installed_hook != nullptr || histograms_on;
+}
+
+size_t BucketOf(uint64_t ns) {
+  return ns == 0 ? 0 : std::min<size_t>(64 - __builtin_clzll(ns), 63);
+}
+
+}  // namespace
+
+const char* stage_name(Stage stage) {
+  switch (stage) {
+    case Stage::MemoryWait:
+      return "memory_wait";
+    case Stage::PBKDF2:
+      return "pbkdf2";
+    case Stage::ThreadStart:
+      return "thread_start";
+    case Stage::ROMixFill:
+      return "romix_fill";
+    case Stage::ROMixMix:
+      return "romix_mix";
+    case Stage::Hash:
+      return "hash";
+  }
+  return "unknown";
+}
+
+void set_hook(Hook hook) {
+  std::lock_guard<std::mutex> lock(settings);
+  std::shared_ptr<const Hook> h;
+  if (hook) {
+    h = std::make_shared<const Hook>(std::move(hook));
+  }
+  std::atomic_store(&installed_hook, std::move(h));
+  UpdateListening();
+}
+
+Histogram::Histogram() : count{0}, sum{0} {
+  for (auto& c : counts) {
+    c = 0;
+  }
+}
+
+void Histogram::record(std::chrono::nanoseconds time) {
+  uint64_t ns = std::max<int64_t>(time.count(), 0);
+  counts[BucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(ns, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+  Snapshot s;
+  s.count = count.load(std::memory_order_relaxed);
+  s.sum = sum.load(std::memory_order_relaxed);
+  for (size_t b = 0; b < buckets; b++) {
+    s.bucket[b] = counts[b].load(std::memory_order_relaxed);
+  }
+  return s;
+}
+
+void Histogram::reset() {
+  for (auto& c : counts) {
+    c.store(0, std::memory_order_relaxed);
+  }
+  sum.store(0, std::memory_order_relaxed);
+  count.store(0, std::memory_order_relaxed);
+}
+
+void enable_histograms(bool enable) {
+  std::lock_guard<std::mutex> lock(settings);
+  histograms_on = enable;
+  UpdateListening();
+}
+
+Histogram& histogram(Stage stage) {
+  return stage_histograms[static_cast<size_t>(stage)];
+}
+
+#if CPP_SCRYPT_METRICS
+
+Recorder::Recorder() : on{enabled()}, bytes{0} {
+  for (auto& t : time) {
+    t = 0;
+  }
+  if (on) {
+    start = std::chrono::steady_clock::now();
+  }
+}
+
+Recorder::~Recorder() {
+  if (!on) {
+    return;
+  }
+  std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+  add(Stage::Hash, elapsed);
+  if (histograms_on.load(std::memory_order_relaxed)) {
+    histogram(Stage::Hash).record(elapsed);
+  }
+
+  std::shared_ptr<const Hook> hook = std::atomic_load(&installed_hook);
+  if (!hook) {
+    return;
+  }
+  HashMetrics m;
+  for (size_t s = 0; s < stage_count; s++) {
+    m.time[s] = std::chrono::nanoseconds(time[s].load());
+  }
+  m.bytes_allocated = bytes;
+  m.threads = std::max<size_t>(thread_ids.size(), 1);
+  (*hook)(m);
+}
+
+void Recorder::add(Stage stage, std::chrono::nanoseconds elapsed) {
+  if (on) {
+    time[static_cast<size_t>(stage)].fetch_add(elapsed.count(),
+                                               std::memory_order_relaxed);
+  }
+}
+
+void Recorder::allocated(size_t n) {
+  if (on) {
+    bytes.fetch_add(n, std::memory_order_relaxed);
+  }
+}
+
+void Recorder::joined() {
+  if (!on) {
+    return;
+  }
+  std::thread::id id = std::this_thread::get_id();
+  std::lock_guard<std::mutex> lock(mutex);
+  if (std::find(thread_ids.begin(), thread_ids.end(), id) ==
+      thread_ids.end()) {
+    thread_ids.push_back(id);
+  }
+}
+
+Scope::Scope(Recorder& recorder) : previous{current} {
+  current = &recorder;
+  recorder.joined();
+}
+
+Scope::~Scope() { current = previous; }
+
+void record(Stage stage, std::chrono::nanoseconds elapsed) {
+  if (current != nullptr) {
+    current->add(stage, elapsed);
+  }
+  if (histograms_on.load(std::memory_order_relaxed)) {
+    histogram(stage).record(elapsed);
+  }
+}
+
+#endif  // CPP_SCRYPT_METRICS
+
+}  // namespace metrics
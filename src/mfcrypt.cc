@@ -0,0 +1,37 @@
+// mfcrypt.cc - The PRF and mixing function policies of MFcrypt.
+
+#include "mfcrypt.h"
+
+#include "romix.h"
+
+namespace mfcrypt {
+
+const EVP_MD* HMACSHA256::digest() { return EVP_sha256(); }
+
+const EVP_MD* HMACSHA512::digest() { return EVP_sha512(); }
+
+size_t ROMixSalsa20_8::scratch_size(uint32_t block_size_factor_r,
+                                    uint64_t cost_factor_N) {
+  return romix::ROMixScratchSize(block_size_factor_r, cost_factor_N);
+}
+
+bool ROMixSalsa20_8::mix(uint32_t block_size_factor_r, uint32_t* B,
+                         uint64_t cost_factor_N, uint32_t* scratch,
+                         const std::atomic<bool>* cancelled) {
+  return romix::ROMix(block_size_factor_r, B, cost_factor_N, scratch,
+                      cancelled);
+}
+
+size_t ROMixChaCha20_8::scratch_size(uint32_t block_size_factor_r,
+                                     uint64_t cost_factor_N) {
+  return romix::ROMixScratchSize(block_size_factor_r, cost_factor_N);
+}
+
+bool ROMixChaCha20_8::mix(uint32_t block_size_factor_r, uint32_t* B,
+                          uint64_t cost_factor_N, uint32_t* scratch,
+                          const std::atomic<bool>* cancelled) {
+  return romix::ROMixChaCha(block_size_factor_r, B, cost_factor_N, scratch,
+                            cancelled);
+}
+
+}  // namespace mfcrypt
@@ -1,37 +1,28 @@
-// pbkdf2.cc - A wrapper around OpenSSL's PBKDF2 function.
+// pbkdf2.cc - A wrapper around OpenSSL's PBKDF2 function, and a PBKDF2 over
+// a precomputed HMAC key schedule.
 
 #include "pbkdf2.h"
 
+#include <openssl/crypto.h>
+
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
-#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <limits>
 
+#include "metrics.h"
+#include "sha256.h"
 #include "utilities.h"
 
 PBKDF2::PBKDF2(const EVP_MD* d) : digest{d} {}
 
-std::vector<std::byte> PBKDF2::hash(std::vector<std::byte> passphrase,
-                                    std::vector<std::byte> salt,
-                                    uint32_t iterations,
-                                    size_t desired_length) {
-  // Turn input into format expected by OpenSSL
-  auto passphrase_as_chars = new char[passphrase.size()];
-  for (size_t i = 0; i < passphrase.size(); ++i) {
-    passphrase_as_chars[i] = static_cast<char>(passphrase.at(i));
-  }
-  auto salt_as_uchars = new unsigned char[salt.size()];
-  for (size_t i = 0; i < salt.size(); ++i) {
-    salt_as_uchars[i] = static_cast<unsigned char>(salt.at(i));
-  }
-  auto output = new unsigned char[desired_length];
-
-  if (!output) {
-    std::cout << "Could not allocate output buffer.\n";
-    assert(false);
-  }
-
+void PBKDF2::hash(const std::byte* passphrase, size_t passphrase_length,
+                  const std::byte* salt, size_t salt_length,
+                  uint32_t iterations, std::byte* output,
+                  size_t desired_length) {
+  metrics::Timer timer(metrics::Stage::PBKDF2);
   if (iterations >= std::numeric_limits<int>::max()) {
     std::cout << "More iterations than INT_MAX.\n";
     assert(false);
@@ -42,35 +33,434 @@ std::vector<std::byte> PBKDF2::hash(std::vector<std::byte> passphrase,
     assert(false);
   }
 
-  if (passphrase.size() >= std::numeric_limits<int>::max()) {
-    std::cout << "passphrase.size() larger than INT_MAX.\n";
+  if (passphrase_length >= std::numeric_limits<int>::max()) {
+    std::cout << "passphrase_length larger than INT_MAX.\n";
     assert(false);
   }
 
-  if (salt.size() >= std::numeric_limits<int>::max()) {
-    std::cout << "salt.size() larger than INT_MAX.\n";
+  if (salt_length >= std::numeric_limits<int>::max()) {
+    std::cout << "salt_length larger than INT_MAX.\n";
     assert(false);
   }
 
   int res = PKCS5_PBKDF2_HMAC(
-      passphrase_as_chars, static_cast<int>(passphrase.size()), salt_as_uchars,
-      static_cast<int>(salt.size()), static_cast<int>(iterations), digest,
-      static_cast<int>(desired_length), output);
+      reinterpret_cast<const char*>(passphrase),
+      static_cast<int>(passphrase_length),
+      reinterpret_cast<const unsigned char*>(salt),
+      static_cast<int>(salt_length), static_cast<int>(iterations), digest,
+      static_cast<int>(desired_length),
+      reinterpret_cast<unsigned char*>(output));
 
   if (res == 0) {
     std::cout << "PKCS5_PBKDF2_HMAC failed.\n";
     assert(false);
   }
+}
 
-  std::vector<std::byte> output_vector = {};
+std::vector<std::byte> PBKDF2::hash(const std::vector<std::byte>& passphrase,
+                                    const std::vector<std::byte>& salt,
+                                    uint32_t iterations,
+                                    size_t desired_length) {
+  std::vector<std::byte> output_vector(desired_length);
+
+  hash(passphrase.data(), passphrase.size(), salt.data(), salt.size(),
+       iterations, output_vector.data(), desired_length);
+
+  return output_vector;
+}
+
+//
+// PBKDF2::Key
+//
 
-  for (size_t i = 0; i < desired_length; ++i) {
-    output_vector.push_back(static_cast<std::byte>(output[i]));
+// Stops on a failed OpenSSL call, like the rest of this file.
+void CheckOpenSSL(int result, const char* call) {
+  if (result != 1) {
+    std::cout << call << " failed.\n";
+    assert(false);
   }
+}
 
-  delete[] output;
-  delete[] salt_as_uchars;
-  delete[] passphrase_as_chars;
+PBKDF2::Key::Key(const EVP_MD* digest, const std::byte* passphrase,
+                 size_t passphrase_length)
+    : inner{nullptr},
+      outer{nullptr},
+      digest_size{static_cast<size_t>(EVP_MD_size(digest))},
+      sha256{EVP_MD_type(digest) == NID_sha256} {
+  metrics::Timer timer(metrics::Stage::PBKDF2);
+  size_t block_size = static_cast<size_t>(EVP_MD_block_size(digest));
+  unsigned char key[EVP_MAX_MD_SIZE * 2] = {};
+  assert(block_size <= sizeof(key));
 
-  return output_vector;
+  // Keys longer than a block are hashed first, shorter ones zero padded.
+  if (passphrase_length > block_size) {
+    CheckOpenSSL(EVP_Digest(passphrase, passphrase_length, key, nullptr,
+                            digest, nullptr),
+                 "EVP_Digest");
+  } else if (passphrase_length > 0) {
+    std::memcpy(key, passphrase, passphrase_length);
+  }
+
+  unsigned char pad[EVP_MAX_MD_SIZE * 2];
+  for (int round = 0; round < 2; round++) {
+    for (size_t i = 0; i < block_size; i++) {
+      pad[i] = key[i] ^ (round == 0 ? 0x36 : 0x5c);
+    }
+    if (sha256) {
+      uint32_t* state = (round == 0) ? inner_state : outer_state;
+      std::memcpy(state, SHA256::initial_state, sizeof(inner_state));
+      SHA256::compress(state, reinterpret_cast<std::byte*>(pad), 1);
+    } else {
+      EVP_MD_CTX*& ctx = (round == 0) ? inner : outer;
+      ctx = EVP_MD_CTX_new();
+      CheckOpenSSL(EVP_DigestInit_ex(ctx, digest, nullptr),
+                   "EVP_DigestInit_ex");
+      CheckOpenSSL(EVP_DigestUpdate(ctx, pad, block_size), "EVP_DigestUpdate");
+    }
+  }
+
+  OPENSSL_cleanse(key, sizeof(key));
+  OPENSSL_cleanse(pad, sizeof(pad));
+}
+
+PBKDF2::Key::~Key() {
+  EVP_MD_CTX_free(inner);
+  EVP_MD_CTX_free(outer);
+  OPENSSL_cleanse(inner_state, sizeof(inner_state));
+  OPENSSL_cleanse(outer_state, sizeof(outer_state));
+}
+
+PBKDF2::Key::Key(Key&& other) noexcept
+    : inner{other.inner},
+      outer{other.outer},
+      digest_size{other.digest_size},
+      sha256{other.sha256} {
+  std::memcpy(inner_state, other.inner_state, sizeof(inner_state));
+  std::memcpy(outer_state, other.outer_state, sizeof(outer_state));
+  OPENSSL_cleanse(other.inner_state, sizeof(other.inner_state));
+  OPENSSL_cleanse(other.outer_state, sizeof(other.outer_state));
+  other.inner = nullptr;
+  other.outer = nullptr;
+}
+
+PBKDF2::Key& PBKDF2::Key::operator=(Key&& other) noexcept {
+  if (this == &other) {
+    return *this;
+  }
+  EVP_MD_CTX_free(inner);
+  EVP_MD_CTX_free(outer);
+  inner = other.inner;
+  outer = other.outer;
+  digest_size = other.digest_size;
+  sha256 = other.sha256;
+  std::memcpy(inner_state, other.inner_state, sizeof(inner_state));
+  std::memcpy(outer_state, other.outer_state, sizeof(outer_state));
+  OPENSSL_cleanse(other.inner_state, sizeof(other.inner_state));
+  OPENSSL_cleanse(other.outer_state, sizeof(other.outer_state));
+  other.inner = nullptr;
+  other.outer = nullptr;
+  return *this;
+}
+
+// Finishes the inner hash in ctx, then runs the outer one over it, leaving
+// the HMAC in mac.
+void PBKDF2::Key::finish_hmac(EVP_MD_CTX* ctx, unsigned char* mac) const {
+  CheckOpenSSL(EVP_DigestFinal_ex(ctx, mac, nullptr), "EVP_DigestFinal_ex");
+  CheckOpenSSL(EVP_MD_CTX_copy_ex(ctx, outer), "EVP_MD_CTX_copy_ex");
+  CheckOpenSSL(EVP_DigestUpdate(ctx, mac, digest_size), "EVP_DigestUpdate");
+  CheckOpenSSL(EVP_DigestFinal_ex(ctx, mac, nullptr), "EVP_DigestFinal_ex");
+}
+
+void PBKDF2::Key::derive(const std::byte* salt, size_t salt_length,
+                         uint32_t iterations, size_t offset,
+                         std::byte* output, size_t length) const {
+  metrics::Timer timer(metrics::Stage::PBKDF2);
+  assert(iterations > 0);
+  if (length > 0 && (offset + length - 1) / digest_size >=
+                        std::numeric_limits<uint32_t>::max()) {
+    std::cout << "PBKDF2 output longer than (2^32 - 1) blocks.\n";
+    assert(false);
+  }
+  if (sha256) {
+    Request request{this, salt, salt_length, offset, output, length};
+    derive_sha256(&request, 1, iterations);
+    return;
+  }
+
+  size_t block = offset / digest_size;
+  size_t skip = offset % digest_size;
+
+  // The inner hash of every block starts with the salt.
+  EVP_MD_CTX* salted = EVP_MD_CTX_new();
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  CheckOpenSSL(EVP_MD_CTX_copy_ex(salted, inner), "EVP_MD_CTX_copy_ex");
+  CheckOpenSSL(EVP_DigestUpdate(salted, salt, salt_length),
+               "EVP_DigestUpdate");
+
+  unsigned char U[EVP_MAX_MD_SIZE];
+  unsigned char T[EVP_MAX_MD_SIZE];
+  while (length > 0) {
+    // T_i = U_1 xor ... xor U_c, with U_1 = HMAC(P, S || INT(i)).
+    uint32_t index = static_cast<uint32_t>(block + 1);
+    unsigned char be_index[4] = {
+        static_cast<unsigned char>(index >> 24),
+        static_cast<unsigned char>(index >> 16),
+        static_cast<unsigned char>(index >> 8),
+        static_cast<unsigned char>(index)};
+    CheckOpenSSL(EVP_MD_CTX_copy_ex(ctx, salted), "EVP_MD_CTX_copy_ex");
+    CheckOpenSSL(EVP_DigestUpdate(ctx, be_index, 4), "EVP_DigestUpdate");
+    finish_hmac(ctx, U);
+    std::memcpy(T, U, digest_size);
+
+    for (uint32_t j = 1; j < iterations; j++) {
+      CheckOpenSSL(EVP_MD_CTX_copy_ex(ctx, inner), "EVP_MD_CTX_copy_ex");
+      CheckOpenSSL(EVP_DigestUpdate(ctx, U, digest_size), "EVP_DigestUpdate");
+      finish_hmac(ctx, U);
+      for (size_t k = 0; k < digest_size; k++) {
+        T[k] ^= U[k];
+      }
+    }
+
+    size_t n = std::min(digest_size - skip, length);
+    std::memcpy(output, T + skip, n);
+    output += n;
+    length -= n;
+    skip = 0;
+    block++;
+  }
+
+  OPENSSL_cleanse(U, sizeof(U));
+  OPENSSL_cleanse(T, sizeof(T));
+  EVP_MD_CTX_free(salted);
+  EVP_MD_CTX_free(ctx);
+}
+
+// Big endian stores for the SHA-256 message blocks.
+void StoreBigEndian32(std::byte* p, uint32_t x) {
+  for (int b = 0; b < 4; b++) {
+    p[b] = static_cast<std::byte>(x >> (24 - 8 * b));
+  }
+}
+
+void StoreBigEndian64(std::byte* p, uint64_t x) {
+  StoreBigEndian32(p, static_cast<uint32_t>(x >> 32));
+  StoreBigEndian32(p + 4, static_cast<uint32_t>(x));
+}
+
+// Sets column l of width transposed states to lane_states[l].
+void GatherStates(uint32_t* states, const uint32_t* const* lane_states,
+                  size_t width) {
+  for (size_t k = 0; k < 8; k++) {
+    for (size_t l = 0; l < width; l++) {
+      states[k * width + l] = lane_states[l][k];
+    }
+  }
+}
+
+// Compresses width transposed states, each with its own block: one at a time
+// if width is 1, else all at once, with width == SHA256::lanes().
+void CompressWidth(uint32_t* states, const std::byte* const* blocks,
+                   size_t width) {
+  if (width == 1) {
+    SHA256::compress(states, blocks[0], 1);
+  } else {
+    SHA256::compress_lanes(states, blocks);
+  }
+}
+
+// The inner hash of every block of a derive starts with the salt. Its whole
+// blocks are hashed once; what is left, INT(i) at rest and the padding make
+// one or two more blocks that differ only in INT(i).
+struct SaltedInner {
+  uint32_t state[8];
+  std::byte tail[128];
+  size_t rest;
+  size_t tail_blocks;
+};
+
+void SaltInner(const uint32_t inner_state[8], const std::byte* salt,
+               size_t salt_length, SaltedInner* salted) {
+  std::memcpy(salted->state, inner_state, sizeof(salted->state));
+  SHA256::compress(salted->state, salt, salt_length / 64);
+  salted->rest = salt_length % 64;
+  salted->tail_blocks = (salted->rest + 4 + 9 <= 64) ? 1 : 2;
+  std::memset(salted->tail, 0, sizeof(salted->tail));
+  std::memcpy(salted->tail, salt + salt_length - salted->rest, salted->rest);
+  salted->tail[salted->rest + 4] = std::byte{0x80};
+  StoreBigEndian64(salted->tail + 64 * salted->tail_blocks - 8,
+                   (64 + static_cast<uint64_t>(salt_length) + 4) * 8);
+}
+
+void PBKDF2::Key::derive_batch(const Request* requests, size_t n,
+                               uint32_t iterations) {
+  metrics::Timer timer(metrics::Stage::PBKDF2);
+  // Other digests go through OpenSSL one request at a time.
+  for (size_t r = 0; r < n; r++) {
+    if (!requests[r].key->sha256) {
+      requests[r].key->derive(requests[r].salt, requests[r].salt_length,
+                              iterations, requests[r].offset,
+                              requests[r].output, requests[r].length);
+    }
+  }
+  derive_sha256(requests, n, iterations);
+}
+
+void PBKDF2::Key::derive_sha256(const Request* requests, size_t n,
+                                uint32_t iterations) {
+  const size_t max_lanes = 16;
+  const size_t lanes = SHA256::lanes();
+  assert(lanes <= max_lanes);
+  assert(iterations > 0);
+
+  size_t blocks_left = 0;
+  for (size_t r = 0; r < n; r++) {
+    const Request& request = requests[r];
+    if (!request.key->sha256 || request.length == 0) {
+      continue;
+    }
+    if ((request.offset + request.length - 1) / 32 >=
+        std::numeric_limits<uint32_t>::max()) {
+      std::cout << "PBKDF2 output longer than (2^32 - 1) blocks.\n";
+      assert(false);
+    }
+    blocks_left += (request.offset % 32 + request.length + 31) / 32;
+  }
+
+  // Each lane computes one block of the output of one request, so a group of
+  // lanes can span several requests, with different keys and salts.
+  struct Lane {
+    const Key* key;
+    std::byte* output;
+    size_t skip;
+    size_t n;
+  };
+  Lane lane[max_lanes];
+  SaltedInner salted[max_lanes];
+  const uint32_t* lane_states[max_lanes];
+
+  // Each U_j is hashed as one block: 32 bytes, the padding and the length of
+  // the padded key before it, so 96 bytes.
+  std::byte digests[max_lanes][64];
+  const std::byte* blocks[max_lanes];
+  for (size_t l = 0; l < max_lanes; l++) {
+    std::memset(digests[l], 0, 64);
+    digests[l][32] = std::byte{0x80};
+    StoreBigEndian64(digests[l] + 56, 96 * 8);
+  }
+
+  uint32_t U[8 * max_lanes];
+  uint32_t T[8 * max_lanes];
+  uint32_t saved[8 * max_lanes];
+
+  // Runs the outer hash on the inner digests in U, leaving the HMACs in U.
+  auto finish_hmacs = [&](size_t width) {
+    for (size_t l = 0; l < width; l++) {
+      for (size_t k = 0; k < 8; k++) {
+        StoreBigEndian32(digests[l] + 4 * k, U[k * width + l]);
+      }
+      blocks[l] = digests[l];
+      lane_states[l] = lane[l].key->outer_state;
+    }
+    GatherStates(U, lane_states, width);
+    CompressWidth(U, blocks, width);
+  };
+
+  // The next block to hand to a lane: block of request r, of which left
+  // bytes are still wanted, from skip, into output.
+  size_t r = 0;
+  size_t block = 0;
+  size_t skip = 0;
+  size_t left = 0;
+  std::byte* output = nullptr;
+  SaltedInner current;
+
+  while (blocks_left > 0) {
+    // Whole groups of blocks go through the multi-buffer kernel, the rest
+    // one by one.
+    size_t width = (blocks_left >= lanes) ? lanes : 1;
+    size_t tail_blocks = 1;
+    for (size_t l = 0; l < width; l++) {
+      while (left == 0) {
+        const Request& request = requests[r];
+        if (request.key->sha256 && request.length > 0) {
+          SaltInner(request.key->inner_state, request.salt,
+                    request.salt_length, &current);
+          block = request.offset / 32;
+          skip = request.offset % 32;
+          left = request.length;
+          output = request.output;
+        }
+        r++;
+      }
+      salted[l] = current;
+      StoreBigEndian32(salted[l].tail + current.rest,
+                       static_cast<uint32_t>(block + 1));
+      tail_blocks = std::max(tail_blocks, current.tail_blocks);
+      lane[l] = {requests[r - 1].key, output, skip,
+                 std::min<size_t>(32 - skip, left)};
+      output += lane[l].n;
+      left -= lane[l].n;
+      skip = 0;
+      block++;
+    }
+    blocks_left -= width;
+
+    // U_1 = HMAC(P, S || INT(i)). Lanes with a one-block tail hash a block
+    // of zeros along with the others and then get their state back.
+    for (size_t l = 0; l < width; l++) {
+      lane_states[l] = salted[l].state;
+    }
+    GatherStates(U, lane_states, width);
+    for (size_t b = 0; b < tail_blocks; b++) {
+      if (b == 1) {
+        std::memcpy(saved, U, 8 * width * sizeof(uint32_t));
+      }
+      for (size_t l = 0; l < width; l++) {
+        blocks[l] = salted[l].tail + 64 * b;
+      }
+      CompressWidth(U, blocks, width);
+    }
+    for (size_t l = 0; l < width; l++) {
+      if (salted[l].tail_blocks < tail_blocks) {
+        for (size_t k = 0; k < 8; k++) {
+          U[k * width + l] = saved[k * width + l];
+        }
+      }
+    }
+    finish_hmacs(width);
+    std::memcpy(T, U, 8 * width * sizeof(uint32_t));
+
+    // U_j = HMAC(P, U_(j-1)), T_i = U_1 xor ... xor U_c
+    for (uint32_t j = 1; j < iterations; j++) {
+      for (size_t l = 0; l < width; l++) {
+        for (size_t k = 0; k < 8; k++) {
+          StoreBigEndian32(digests[l] + 4 * k, U[k * width + l]);
+        }
+        blocks[l] = digests[l];
+        lane_states[l] = lane[l].key->inner_state;
+      }
+      GatherStates(U, lane_states, width);
+      CompressWidth(U, blocks, width);
+      finish_hmacs(width);
+      for (size_t w = 0; w < 8 * width; w++) {
+        T[w] ^= U[w];
+      }
+    }
+
+    for (size_t l = 0; l < width; l++) {
+      std::byte bytes[32];
+      for (size_t k = 0; k < 8; k++) {
+        StoreBigEndian32(bytes + 4 * k, T[k * width + l]);
+      }
+      std::memcpy(lane[l].output, bytes + lane[l].skip, lane[l].n);
+      OPENSSL_cleanse(bytes, sizeof(bytes));
+    }
+  }
+
+  OPENSSL_cleanse(&current, sizeof(current));
+  OPENSSL_cleanse(salted, sizeof(salted));
+  OPENSSL_cleanse(digests, sizeof(digests));
+  OPENSSL_cleanse(U, sizeof(U));
+  OPENSSL_cleanse(T, sizeof(T));
+  OPENSSL_cleanse(saved, sizeof(saved));
 }
@@ -0,0 +1,584 @@
+// romix.cc - scryptBlockMix and scryptROMix, the memory-hard core of scrypt.
+
+#include "romix.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "chacha20.h"
+#include "metrics.h"
+#include "salsa20.h"
+
+namespace romix {
+
+// Integerify(B) mod N. Integerify reads the last 64-byte block of B as a
+// little endian integer; N is a power of two, so only the low 64 bits, the
+// first two words of the block, matter. Word 0 leads the block in either
+// order a block is kept in; word1 tells where word 1 is.
+uint64_t IntegrifyModN(const uint32_t* last_block, uint64_t cost_factor_N,
+                       size_t word1 = 1) {
+  uint64_t integrified = static_cast<uint64_t>(last_block[0]) |
+                         (static_cast<uint64_t>(last_block[word1]) << 32);
+  return integrified & (cost_factor_N - 1);
+}
+
+bool ValidCostFactor(uint64_t cost_factor_N) {
+  return cost_factor_N > 1 && (cost_factor_N & (cost_factor_N - 1)) == 0;
+}
+
+// C = A xor B, over spans of words. C may alias A or B.
+void BlockXOR(const uint32_t* A, const uint32_t* B, uint32_t* C,
+              size_t words) {
+  for (size_t i = 0; i < words; ++i) {
+    C[i] = A[i] ^ B[i];
+  }
+}
+
+// One step of BlockMix: X xor block i of B (and of V) is hashed into X and
+// stored at its shuffled place in output. The hash is Salsa20/8 for scrypt,
+// or any core with the same hash(uint32_t[16]).
+template <typename Core>
+inline void BlockMixStep(const uint32_t* B, const uint32_t* V,
+                         uint32_t* output, uint32_t X[16], size_t i,
+                         size_t two_r, const Core& core) {
+  BlockXOR(X, B + i * 16, X, 16);
+  if (V != nullptr) {
+    BlockXOR(X, V + i * 16, X, 16);
+  }
+  core.hash(X);
+
+  size_t out = (i % 2 == 0) ? (i / 2) : (two_r / 2 + i / 2);
+  std::copy(X, X + 16, output + out * 16);
+}
+
+inline void BlockMixStart(const uint32_t* B, const uint32_t* V, uint32_t X[16],
+                          size_t two_r) {
+  const size_t last = (two_r - 1) * 16;
+  if (V != nullptr) {
+    BlockXOR(B + last, V + last, X, 16);
+  } else {
+    std::copy(B + last, B + last + 16, X);
+  }
+}
+
+// The steps of BlockMix<R>, one per 64-byte block, with every index a
+// constant.
+template <typename Core, size_t... I>
+inline void BlockMixUnrolled(const uint32_t* B, const uint32_t* V,
+                             uint32_t* output, const Core& core,
+                             std::index_sequence<I...>) {
+  constexpr size_t two_r = sizeof...(I);
+  uint32_t X[16];
+  BlockMixStart(B, V, X, two_r);
+  (BlockMixStep(B, V, output, X, I, two_r, core), ...);
+}
+
+template <typename Core>
+inline void BlockMixLoop(const uint32_t* B, const uint32_t* V,
+                         uint32_t* output, size_t two_r, const Core& core) {
+  uint32_t X[16];
+  BlockMixStart(B, V, X, two_r);
+  for (size_t i = 0; i < two_r; i++) {
+    BlockMixStep(B, V, output, X, i, two_r, core);
+  }
+}
+
+void BlockMix(const uint32_t* B, const uint32_t* V, uint32_t* output,
+              size_t two_r, const Salsa20& salsa20_8) {
+  BlockMixLoop(B, V, output, two_r, salsa20_8);
+}
+
+template <uint32_t R>
+void BlockMix(const uint32_t* B, const uint32_t* V, uint32_t* output,
+              const Salsa20& salsa20_8) {
+  BlockMixUnrolled(B, V, output, salsa20_8, std::make_index_sequence<2 * R>());
+}
+
+size_t ROMixScratchSize(uint32_t block_size_factor_r, uint64_t cost_factor_N) {
+  size_t block_size = 128 * static_cast<size_t>(block_size_factor_r);
+  if (cost_factor_N > (SIZE_MAX / block_size) - 1) {
+    return SIZE_MAX;
+  }
+  return (cost_factor_N + 1) * block_size;
+}
+
+// Salsa20/8 on blocks kept in the diagonal order of Salsa20::hash_diagonal.
+// The ROMix loops over Salsa20 put B in that order on entry and back on
+// exit, so the SIMD kernels never shuffle words in between; XOR, copies and
+// the BlockMix shuffle of 64-byte blocks do not care about the order.
+struct DiagonalSalsa20 {
+  const Salsa20& salsa20_8;
+  void hash(uint32_t X[16]) const { salsa20_8.hash_diagonal(X); }
+};
+
+// Where a core keeps word 1 of a 64-byte block, for Integerify.
+template <typename Core>
+struct BlockOrder {
+  static constexpr size_t word1 = 1;
+};
+
+template <>
+struct BlockOrder<DiagonalSalsa20> {
+  static constexpr size_t word1 = Salsa20::diagonal_position(1);
+};
+
+// Puts every 64-byte block of the words of B in the diagonal order, or
+// back.
+void ToDiagonal(uint32_t* B, size_t words) {
+  for (size_t w = 0; w < words; w += 16) {
+    Salsa20::to_diagonal(B + w);
+  }
+}
+
+void FromDiagonal(uint32_t* B, size_t words) {
+  for (size_t w = 0; w < words; w += 16) {
+    Salsa20::from_diagonal(B + w);
+  }
+}
+
+// BlockMix<R> and the generic BlockMix over core as function objects of the
+// block pointers alone.
+template <uint32_t R, typename Core>
+struct FixedBlockMix {
+  static constexpr size_t word1 = BlockOrder<Core>::word1;
+  const Core& core;
+  void operator()(const uint32_t* B, const uint32_t* V, uint32_t* out) const {
+    BlockMixUnrolled(B, V, out, core, std::make_index_sequence<2 * R>());
+  }
+};
+
+template <typename Core>
+struct GenericBlockMix {
+  static constexpr size_t word1 = BlockOrder<Core>::word1;
+  size_t two_r;
+  const Core& core;
+  void operator()(const uint32_t* B, const uint32_t* V, uint32_t* out) const {
+    BlockMixLoop(B, V, out, two_r, core);
+  }
+};
+
+// Calls run with the BlockMix over core for r, specialized if r is one of
+// specialized_r.
+template <typename Core, typename Run>
+bool WithBlockMix(uint32_t block_size_factor_r, const Core& core,
+                  const Run& run) {
+  switch (block_size_factor_r) {
+    case 1:
+      return run(FixedBlockMix<1, Core>{core});
+    case 2:
+      return run(FixedBlockMix<2, Core>{core});
+    case 4:
+      return run(FixedBlockMix<4, Core>{core});
+    case 8:
+      return run(FixedBlockMix<8, Core>{core});
+    case 16:
+      return run(FixedBlockMix<16, Core>{core});
+    case 32:
+      return run(FixedBlockMix<32, Core>{core});
+  }
+  return run(GenericBlockMix<Core>{
+      2 * static_cast<size_t>(block_size_factor_r), core});
+}
+
+bool Cancelled(const std::atomic<bool>* cancelled) {
+  return cancelled != nullptr && cancelled->load(std::memory_order_relaxed);
+}
+
+// The two loops of ROMix on B, with V the N blocks of scratch and Y one
+// more block. mix(B, V, output) is BlockMix for this r, and Mix::word1 the
+// place of word 1 in the order it keeps blocks in.
+template <typename Mix>
+bool ROMixLoops(uint32_t* B, uint64_t cost_factor_N, uint32_t* V, uint32_t* Y,
+                size_t words, const std::atomic<bool>* cancelled,
+                const Mix& mix) {
+  assert(ValidCostFactor(cost_factor_N));
+  uint32_t* X = B;
+
+  // Each BlockMix writes the next entry of V directly.
+  {
+    metrics::Timer timer(metrics::Stage::ROMixFill);
+    std::copy(B, B + words, V);
+    for (uint64_t i = 0; i + 1 < cost_factor_N; ++i) {
+      if (Cancelled(cancelled)) {
+        return false;
+      }
+      mix(V + i * words, nullptr, V + (i + 1) * words);
+    }
+    mix(V + (cost_factor_N - 1) * words, nullptr, X);
+  }
+
+  // N is even, so after the last swap X is B again.
+  metrics::Timer timer(metrics::Stage::ROMixMix);
+  for (uint64_t i = 0; i < cost_factor_N; ++i) {
+    if (Cancelled(cancelled)) {
+      return false;
+    }
+    uint64_t j = IntegrifyModN(X + words - 16, cost_factor_N, Mix::word1);
+    mix(X, V + j * words, Y);
+    std::swap(X, Y);
+  }
+  assert(X == B);
+  return true;
+}
+
+template <uint32_t R>
+bool ROMix(uint32_t* B, uint64_t cost_factor_N, uint32_t* scratch,
+           const std::atomic<bool>* cancelled) {
+  constexpr size_t words = 32 * R;
+  Salsa20 salsa20_8(8);
+  DiagonalSalsa20 core{salsa20_8};
+
+  // Y lives on the stack; its block of scratch is left alone.
+  alignas(64) uint32_t Y[words];
+  ToDiagonal(B, words);
+  bool mixed = ROMixLoops(B, cost_factor_N, scratch, Y, words, cancelled,
+                          FixedBlockMix<R, DiagonalSalsa20>{core});
+  FromDiagonal(B, words);
+  return mixed;
+}
+
+bool ROMix(uint32_t block_size_factor_r, uint32_t* B, uint64_t cost_factor_N,
+           uint32_t* scratch, const std::atomic<bool>* cancelled) {
+  switch (block_size_factor_r) {
+    case 1:
+      return ROMix<1>(B, cost_factor_N, scratch, cancelled);
+    case 2:
+      return ROMix<2>(B, cost_factor_N, scratch, cancelled);
+    case 4:
+      return ROMix<4>(B, cost_factor_N, scratch, cancelled);
+    case 8:
+      return ROMix<8>(B, cost_factor_N, scratch, cancelled);
+    case 16:
+      return ROMix<16>(B, cost_factor_N, scratch, cancelled);
+    case 32:
+      return ROMix<32>(B, cost_factor_N, scratch, cancelled);
+  }
+
+  size_t two_r = 2 * static_cast<size_t>(block_size_factor_r);
+  size_t words = 16 * two_r;
+  Salsa20 salsa20_8(8);
+  DiagonalSalsa20 core{salsa20_8};
+  ToDiagonal(B, words);
+  bool mixed = ROMixLoops(B, cost_factor_N, scratch,
+                          scratch + cost_factor_N * words, words, cancelled,
+                          GenericBlockMix<DiagonalSalsa20>{two_r, core});
+  FromDiagonal(B, words);
+  return mixed;
+}
+
+bool ROMixChaCha(uint32_t block_size_factor_r, uint32_t* B,
+                 uint64_t cost_factor_N, uint32_t* scratch,
+                 const std::atomic<bool>* cancelled) {
+  ChaCha20 chacha20_8(8);
+  size_t words = 32 * static_cast<size_t>(block_size_factor_r);
+  return WithBlockMix(block_size_factor_r, chacha20_8, [&](const auto& mix) {
+    return ROMixLoops(B, cost_factor_N, scratch,
+                      scratch + cost_factor_N * words, words, cancelled, mix);
+  });
+}
+
+// Asks for the cache lines of a block to be loaded ahead of their use.
+inline void PrefetchBlock(const uint32_t* block, size_t words) {
+  for (size_t w = 0; w < words; w += 16) {
+    __builtin_prefetch(block + w);
+  }
+}
+
+// The loops of ROMix on count lanes, each with a scratch of its own, taking
+// turns one BlockMix at a time. As soon as a lane's BlockMix tells which
+// block of V it reads next, that block is prefetched, and the turns of the
+// other lanes hide the latency of the load.
+template <typename Mix>
+bool ROMixInterleavedLoops(uint32_t* const* blocks, size_t count,
+                           uint64_t cost_factor_N, uint32_t* const* scratch,
+                           size_t words, const std::atomic<bool>* cancelled,
+                           const Mix& mix) {
+  assert(ValidCostFactor(cost_factor_N));
+  assert(count <= max_interleaved);
+
+  uint32_t* V[max_interleaved];
+  uint32_t* X[max_interleaved];
+  uint32_t* Y[max_interleaved];
+  for (size_t l = 0; l < count; l++) {
+    V[l] = scratch[l];
+    X[l] = blocks[l];
+    Y[l] = V[l] + cost_factor_N * words;
+  }
+
+  auto next_block = [&](size_t l) {
+    return V[l] +
+           IntegrifyModN(X[l] + words - 16, cost_factor_N, Mix::word1) * words;
+  };
+
+  {
+    metrics::Timer timer(metrics::Stage::ROMixFill);
+    for (size_t l = 0; l < count; l++) {
+      std::copy(X[l], X[l] + words, V[l]);
+    }
+    for (uint64_t i = 0; i + 1 < cost_factor_N; ++i) {
+      if (Cancelled(cancelled)) {
+        return false;
+      }
+      for (size_t l = 0; l < count; l++) {
+        mix(V[l] + i * words, nullptr, V[l] + (i + 1) * words);
+      }
+    }
+    for (size_t l = 0; l < count; l++) {
+      mix(V[l] + (cost_factor_N - 1) * words, nullptr, X[l]);
+      PrefetchBlock(next_block(l), words);
+    }
+  }
+
+  metrics::Timer timer(metrics::Stage::ROMixMix);
+  for (uint64_t i = 0; i < cost_factor_N; ++i) {
+    if (Cancelled(cancelled)) {
+      return false;
+    }
+    for (size_t l = 0; l < count; l++) {
+      mix(X[l], next_block(l), Y[l]);
+      std::swap(X[l], Y[l]);
+      PrefetchBlock(next_block(l), words);
+    }
+  }
+  for (size_t l = 0; l < count; l++) {
+    assert(X[l] == blocks[l]);
+  }
+  return true;
+}
+
+bool ROMixInterleaved(uint32_t block_size_factor_r, uint32_t* const* blocks,
+                      size_t count, uint64_t cost_factor_N,
+                      uint32_t* const* scratch,
+                      const std::atomic<bool>* cancelled) {
+  Salsa20 salsa20_8(8);
+  DiagonalSalsa20 core{salsa20_8};
+  size_t words = 32 * static_cast<size_t>(block_size_factor_r);
+  for (size_t l = 0; l < count; l++) {
+    ToDiagonal(blocks[l], words);
+  }
+  bool mixed = WithBlockMix(block_size_factor_r, core, [&](const auto& mix) {
+    return ROMixInterleavedLoops(blocks, count, cost_factor_N, scratch, words,
+                                 cancelled, mix);
+  });
+  for (size_t l = 0; l < count; l++) {
+    FromDiagonal(blocks[l], words);
+  }
+  return mixed;
+}
+
+size_t ROMixTMTOScratchSize(uint32_t block_size_factor_r,
+                            uint64_t cost_factor_N, uint64_t stride) {
+  assert(stride >= 1);
+  size_t block_size = 128 * static_cast<size_t>(block_size_factor_r);
+  uint64_t kept = (cost_factor_N + stride - 1) / stride;
+  if (kept > (SIZE_MAX / block_size) - 3) {
+    return SIZE_MAX;
+  }
+  return (kept + 3) * block_size;
+}
+
+uint64_t TMTOStride(uint32_t block_size_factor_r, uint64_t cost_factor_N,
+                    size_t bytes) {
+  size_t block_size = 128 * static_cast<size_t>(block_size_factor_r);
+  if (bytes / block_size < 4) {
+    return 0;
+  }
+  uint64_t kept = std::min<uint64_t>(bytes / block_size - 3, cost_factor_N);
+  return (cost_factor_N + kept - 1) / kept;
+}
+
+// The loops of ROMix keeping only V[0], V[stride], V[2 * stride],... The
+// scratch holds those entries, then Y and two blocks to recompute V[j] in
+// from the entry before it.
+template <typename Mix>
+bool ROMixTMTOLoops(uint32_t* B, uint64_t cost_factor_N, uint64_t stride,
+                    uint32_t* scratch, size_t words,
+                    const std::atomic<bool>* cancelled, const Mix& mix) {
+  assert(ValidCostFactor(cost_factor_N));
+  uint64_t kept = (cost_factor_N + stride - 1) / stride;
+
+  uint32_t* V = scratch;
+  uint32_t* X = B;
+  uint32_t* Y = V + kept * words;
+  uint32_t* T[2] = {Y + words, Y + 2 * words};
+
+  // The chain of V runs through the two T blocks; the last BlockMix lands
+  // in X.
+  {
+    metrics::Timer timer(metrics::Stage::ROMixFill);
+    uint32_t* current = T[0];
+    uint32_t* next = T[1];
+    std::copy(B, B + words, current);
+    for (uint64_t i = 0; i < cost_factor_N; ++i) {
+      if (Cancelled(cancelled)) {
+        return false;
+      }
+      if (i % stride == 0) {
+        std::copy(current, current + words, V + (i / stride) * words);
+      }
+      uint32_t* out = (i + 1 == cost_factor_N) ? X : next;
+      mix(current, nullptr, out);
+      next = current;
+      current = out;
+    }
+  }
+
+  metrics::Timer timer(metrics::Stage::ROMixMix);
+  for (uint64_t i = 0; i < cost_factor_N; ++i) {
+    if (Cancelled(cancelled)) {
+      return false;
+    }
+    uint64_t j = IntegrifyModN(X + words - 16, cost_factor_N, Mix::word1);
+
+    // V[j] is j % stride BlockMix steps past the entry kept before it.
+    const uint32_t* Vj = V + (j / stride) * words;
+    for (uint64_t step = 0; step < j % stride; step++) {
+      uint32_t* out = T[step % 2];
+      mix(Vj, nullptr, out);
+      Vj = out;
+    }
+    mix(X, Vj, Y);
+    std::swap(X, Y);
+  }
+  assert(X == B);
+  return true;
+}
+
+bool ROMixTMTO(uint32_t block_size_factor_r, uint32_t* B,
+               uint64_t cost_factor_N, uint64_t stride, uint32_t* scratch,
+               const std::atomic<bool>* cancelled) {
+  if (stride == 1) {
+    return ROMix(block_size_factor_r, B, cost_factor_N, scratch, cancelled);
+  }
+  Salsa20 salsa20_8(8);
+  DiagonalSalsa20 core{salsa20_8};
+  size_t words = 32 * static_cast<size_t>(block_size_factor_r);
+  ToDiagonal(B, words);
+  bool mixed = WithBlockMix(block_size_factor_r, core, [&](const auto& mix) {
+    return ROMixTMTOLoops(B, cost_factor_N, stride, scratch, words, cancelled,
+                          mix);
+  });
+  FromDiagonal(B, words);
+  return mixed;
+}
+
+void BlockMixLanes(const uint32_t* B, uint32_t* Y, size_t two_r,
+                   const Salsa20& salsa20_8) {
+  const size_t lanes = Salsa20::lanes();
+  const size_t block_words = 16 * lanes;
+  assert(lanes <= 16);
+
+  uint32_t X[16 * 16];
+  std::copy(B + (two_r - 1) * block_words, B + two_r * block_words, X);
+
+  for (size_t i = 0; i < two_r; i++) {
+    for (size_t w = 0; w < block_words; w++) {
+      X[w] ^= B[i * block_words + w];
+    }
+    salsa20_8.hash_lanes(X);
+
+    // Even blocks go to the first half of Y, odd ones to the second.
+    size_t out = (i % 2 == 0) ? (i / 2) : (two_r / 2 + i / 2);
+    std::copy(X, X + block_words, Y + out * block_words);
+  }
+}
+
+size_t ROMixLanesScratchSize(uint32_t block_size_factor_r,
+                             uint64_t cost_factor_N) {
+  size_t lanes_block_size =
+      Salsa20::lanes() * 128 * static_cast<size_t>(block_size_factor_r);
+  if (cost_factor_N > (SIZE_MAX / lanes_block_size) - 2) {
+    return SIZE_MAX;
+  }
+  return (cost_factor_N + 2) * lanes_block_size;
+}
+
+// X is kept transposed across lanes; V is kept per lane in natural order, so
+// the random reads of the second loop stay contiguous.
+bool ROMixLanes(uint32_t block_size_factor_r, uint32_t* const* blocks,
+                uint64_t cost_factor_N, uint32_t* scratch,
+                const std::atomic<bool>* cancelled) {
+  const size_t lanes = Salsa20::lanes();
+  const size_t two_r = 2 * static_cast<size_t>(block_size_factor_r);
+  const size_t words = 16 * two_r;
+
+  assert(ValidCostFactor(cost_factor_N));
+
+  Salsa20 salsa20_8(8);
+
+  uint32_t* V = scratch;
+  uint32_t* X = V + lanes * cost_factor_N * words;
+  uint32_t* Y = X + lanes * words;
+
+  for (size_t l = 0; l < lanes; l++) {
+    for (size_t w = 0; w < words; w++) {
+      X[w * lanes + l] = blocks[l][w];
+    }
+  }
+
+  metrics::Stamp filling;
+  for (uint64_t i = 0; i < cost_factor_N; ++i) {
+    if (Cancelled(cancelled)) {
+      return false;
+    }
+    for (size_t l = 0; l < lanes; l++) {
+      uint32_t* Vi = &V[(l * cost_factor_N + i) * words];
+      for (size_t w = 0; w < words; w++) {
+        Vi[w] = X[w * lanes + l];
+      }
+    }
+    BlockMixLanes(X, Y, two_r, salsa20_8);
+    std::swap(X, Y);
+  }
+
+  filling.record(metrics::Stage::ROMixFill);
+
+  // Integerify reads the first 8 bytes of the last 64-byte block.
+  metrics::Stamp mixing;
+  const size_t last = (two_r - 1) * 16;
+  for (uint64_t i = 0; i < cost_factor_N; ++i) {
+    if (Cancelled(cancelled)) {
+      return false;
+    }
+    for (size_t l = 0; l < lanes; l++) {
+      const uint32_t last_words[2] = {X[last * lanes + l],
+                                      X[(last + 1) * lanes + l]};
+      uint64_t j = IntegrifyModN(last_words, cost_factor_N);
+      const uint32_t* Vj = &V[(l * cost_factor_N + j) * words];
+      for (size_t w = 0; w < words; w++) {
+        X[w * lanes + l] ^= Vj[w];
+      }
+    }
+    BlockMixLanes(X, Y, two_r, salsa20_8);
+    std::swap(X, Y);
+  }
+  mixing.record(metrics::Stage::ROMixMix);
+
+  for (size_t l = 0; l < lanes; l++) {
+    for (size_t w = 0; w < words; w++) {
+      blocks[l][w] = X[w * lanes + l];
+    }
+  }
+  return true;
+}
+
+#define ROMIX_INSTANTIATE(R)                                             \
+  template void BlockMix<R>(const uint32_t*, const uint32_t*, uint32_t*, \
+                            const Salsa20&);                             \
+  template bool ROMix<R>(uint32_t*, uint64_t, uint32_t*,                 \
+                         const std::atomic<bool>*);
+
+ROMIX_INSTANTIATE(1)
+ROMIX_INSTANTIATE(2)
+ROMIX_INSTANTIATE(4)
+ROMIX_INSTANTIATE(8)
+ROMIX_INSTANTIATE(16)
+ROMIX_INSTANTIATE(32)
+
+#undef ROMIX_INSTANTIATE
+
+}  // namespace romix
@@ -3,11 +3,18 @@
 
 #include "salsa20.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
 #include <iomanip>
 #include <iostream>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SALSA20_X86 1
+#endif
+
 // This function is defined in Section 2 of the spec.
 // out_i = y_{i + (c mod 32)} (where y_i is the ith bit of y.)
 uint32_t leftRotation(uint32_t y, uint8_t c) {
@@ -126,44 +133,360 @@ std::vector<uint8_t> littleendianInverse(uint32_t x) {
   return b;
 }
 
-std::vector<uint8_t> salsa_hash(std::vector<uint8_t> input_x, uint32_t rounds) {
-  assert(input_x.size() == 64);
-  assert((rounds % 2) == 0);
-  uint32_t num_doublerounds = rounds / 2;
+// Loads 4 bytes as a little endian 32-bit uint, without building vectors.
+uint32_t load_littleendian(const uint8_t* b) {
+  return static_cast<uint32_t>(b[0]) | (static_cast<uint32_t>(b[1]) << 8) |
+         (static_cast<uint32_t>(b[2]) << 16) |
+         (static_cast<uint32_t>(b[3]) << 24);
+}
 
-  std::vector<uint32_t> x;
+// Stores a 32-bit uint as 4 little endian bytes.
+void store_littleendian(uint8_t* b, uint32_t x) {
+  b[0] = static_cast<uint8_t>(x);
+  b[1] = static_cast<uint8_t>(x >> 8);
+  b[2] = static_cast<uint8_t>(x >> 16);
+  b[3] = static_cast<uint8_t>(x >> 24);
+}
 
-  auto it = input_x.begin();
+// The Salsa20 core on a fixed 16-word state, computed in place: doubleround
+// above, with the quarterrounds of columnround and rowround written out on
+// named words, so nothing touches the heap. internal_test_primitives runs
+// the examples of the spec through the vector functions, and the gtest
+// SalsaTest.KernelsMatchReference checks this core and the SIMD kernels
+// against a reference written from the spec.
+void salsa_core(uint32_t state[16], uint32_t rounds) {
+  assert((rounds % 2) == 0);
 
-  for (int i = 0; i < 64; i += 4) {
-    std::vector<uint8_t> input_x_subvector(it, it + 4);
-    it += 4;
+  uint32_t x[16];
+  for (size_t i = 0; i < 16; ++i) {
+    x[i] = state[i];
+  }
 
-    x.push_back(littleendian(input_x_subvector));
+  for (uint32_t i = 0; i < rounds; i += 2) {
+    // columnround
+    x[4] ^= leftRotation(x[0] + x[12], 7);
+    x[8] ^= leftRotation(x[4] + x[0], 9);
+    x[12] ^= leftRotation(x[8] + x[4], 13);
+    x[0] ^= leftRotation(x[12] + x[8], 18);
+    x[9] ^= leftRotation(x[5] + x[1], 7);
+    x[13] ^= leftRotation(x[9] + x[5], 9);
+    x[1] ^= leftRotation(x[13] + x[9], 13);
+    x[5] ^= leftRotation(x[1] + x[13], 18);
+    x[14] ^= leftRotation(x[10] + x[6], 7);
+    x[2] ^= leftRotation(x[14] + x[10], 9);
+    x[6] ^= leftRotation(x[2] + x[14], 13);
+    x[10] ^= leftRotation(x[6] + x[2], 18);
+    x[3] ^= leftRotation(x[15] + x[11], 7);
+    x[7] ^= leftRotation(x[3] + x[15], 9);
+    x[11] ^= leftRotation(x[7] + x[3], 13);
+    x[15] ^= leftRotation(x[11] + x[7], 18);
+
+    // rowround
+    x[1] ^= leftRotation(x[0] + x[3], 7);
+    x[2] ^= leftRotation(x[1] + x[0], 9);
+    x[3] ^= leftRotation(x[2] + x[1], 13);
+    x[0] ^= leftRotation(x[3] + x[2], 18);
+    x[6] ^= leftRotation(x[5] + x[4], 7);
+    x[7] ^= leftRotation(x[6] + x[5], 9);
+    x[4] ^= leftRotation(x[7] + x[6], 13);
+    x[5] ^= leftRotation(x[4] + x[7], 18);
+    x[11] ^= leftRotation(x[10] + x[9], 7);
+    x[8] ^= leftRotation(x[11] + x[10], 9);
+    x[9] ^= leftRotation(x[8] + x[11], 13);
+    x[10] ^= leftRotation(x[9] + x[8], 18);
+    x[12] ^= leftRotation(x[15] + x[14], 7);
+    x[13] ^= leftRotation(x[12] + x[15], 9);
+    x[14] ^= leftRotation(x[13] + x[12], 13);
+    x[15] ^= leftRotation(x[14] + x[13], 18);
   }
 
-  std::vector<uint32_t> z(x);  // deep copy x into z.
+  for (size_t i = 0; i < 16; ++i) {
+    state[i] += x[i];
+  }
+}
 
-  for (uint32_t i = 0; i < num_doublerounds; ++i) {
-    z = doubleround(z);
+// The scalar core on a state in the diagonal order of the SIMD kernels.
+void salsa_diagonal(uint32_t state[16], uint32_t rounds) {
+  Salsa20::from_diagonal(state);
+  salsa_core(state, rounds);
+  Salsa20::to_diagonal(state);
+}
+
+//
+// SIMD kernels
+//
+// These use the diagonal layout of the reference scrypt SSE code: the 16 words
+// are held in four registers as
+//   X0 = (x0, x5, x10, x15), X1 = (x4, x9, x14, x3),
+//   X2 = (x8, x13, x2, x7),  X3 = (x12, x1, x6, x11),
+// so a columnround is four vector quarterround steps, and a rowround is the
+// same four steps after rotating X1, X2 and X3 by one, two and three lanes.
+// Salsa20::diagonal_position maps the natural order to this one.
+//
+
+#ifdef SALSA20_X86
+
+// The double round loop shared by the kernels, parameterized on the rotate so
+// the AVX-512 kernel can use VPROLD.
+#define SALSA20_DIAGONAL_ROUNDS(ROTATE)                        \
+  for (uint32_t i = 0; i < rounds; i += 2) {                   \
+    X1 = _mm_xor_si128(X1, ROTATE(_mm_add_epi32(X0, X3), 7));  \
+    X2 = _mm_xor_si128(X2, ROTATE(_mm_add_epi32(X1, X0), 9));  \
+    X3 = _mm_xor_si128(X3, ROTATE(_mm_add_epi32(X2, X1), 13)); \
+    X0 = _mm_xor_si128(X0, ROTATE(_mm_add_epi32(X3, X2), 18)); \
+    X1 = _mm_shuffle_epi32(X1, 0x93);                          \
+    X2 = _mm_shuffle_epi32(X2, 0x4e);                          \
+    X3 = _mm_shuffle_epi32(X3, 0x39);                          \
+    X3 = _mm_xor_si128(X3, ROTATE(_mm_add_epi32(X0, X1), 7));  \
+    X2 = _mm_xor_si128(X2, ROTATE(_mm_add_epi32(X3, X0), 9));  \
+    X1 = _mm_xor_si128(X1, ROTATE(_mm_add_epi32(X2, X3), 13)); \
+    X0 = _mm_xor_si128(X0, ROTATE(_mm_add_epi32(X1, X2), 18)); \
+    X1 = _mm_shuffle_epi32(X1, 0x39);                          \
+    X2 = _mm_shuffle_epi32(X2, 0x4e);                          \
+    X3 = _mm_shuffle_epi32(X3, 0x93);                          \
   }
 
-  std::vector<uint8_t> z_output;
+// Runs the rounds on a state held in the diagonal layout at d and adds the
+// input back in, in place.
+#define SALSA20_DIAGONAL_CORE(ROTATE, d)                                  \
+  __m128i* D = reinterpret_cast<__m128i*>(d);                             \
+  const __m128i Y0 = _mm_loadu_si128(D), Y1 = _mm_loadu_si128(D + 1);     \
+  const __m128i Y2 = _mm_loadu_si128(D + 2), Y3 = _mm_loadu_si128(D + 3); \
+  __m128i X0 = Y0, X1 = Y1, X2 = Y2, X3 = Y3;                             \
+  SALSA20_DIAGONAL_ROUNDS(ROTATE)                                         \
+  _mm_storeu_si128(D, _mm_add_epi32(X0, Y0));                             \
+  _mm_storeu_si128(D + 1, _mm_add_epi32(X1, Y1));                         \
+  _mm_storeu_si128(D + 2, _mm_add_epi32(X2, Y2));                         \
+  _mm_storeu_si128(D + 3, _mm_add_epi32(X3, Y3));
+
+// The same on a state in the natural order, gathered into the diagonal
+// layout and scattered back.
+#define SALSA20_DIAGONAL_KERNEL(ROTATE)          \
+  uint32_t d[16];                                \
+  for (int w = 0; w < 16; ++w) {                 \
+    d[Salsa20::diagonal_position(w)] = state[w]; \
+  }                                              \
+  {                                              \
+    SALSA20_DIAGONAL_CORE(ROTATE, d)             \
+  }                                              \
+  for (int w = 0; w < 16; ++w) {                 \
+    state[w] = d[Salsa20::diagonal_position(w)]; \
+  }
 
-  for (size_t i = 0; i < 16; ++i) {
-    std::vector<uint8_t> inv = littleendianInverse(x.at(i) + z.at(i));
-    for (auto inv_item : inv) {
-      z_output.push_back(inv_item);
+#define SALSA20_ROTATE_SHIFT(T, c) \
+  _mm_or_si128(_mm_slli_epi32((T), (c)), _mm_srli_epi32((T), 32 - (c)))
+#define SALSA20_ROTATE_PROLD(T, c) _mm_rol_epi32((T), (c))
+
+__attribute__((target("sse2"))) void salsa_core_sse2(uint32_t state[16],
+                                                     uint32_t rounds) {
+  SALSA20_DIAGONAL_KERNEL(SALSA20_ROTATE_SHIFT)
+}
+
+__attribute__((target("sse2"))) void salsa_diagonal_sse2(uint32_t state[16],
+                                                         uint32_t rounds) {
+  SALSA20_DIAGONAL_CORE(SALSA20_ROTATE_SHIFT, state)
+}
+
+// Same code as SSE2, but VEX encoded: three-operand forms avoid the register
+// copies the SSE2 shifts need.
+__attribute__((target("avx2"))) void salsa_core_avx2(uint32_t state[16],
+                                                     uint32_t rounds) {
+  SALSA20_DIAGONAL_KERNEL(SALSA20_ROTATE_SHIFT)
+}
+
+__attribute__((target("avx2"))) void salsa_diagonal_avx2(uint32_t state[16],
+                                                         uint32_t rounds) {
+  SALSA20_DIAGONAL_CORE(SALSA20_ROTATE_SHIFT, state)
+}
+
+// AVX-512VL has a native 32-bit rotate, so each rotation is one instruction.
+__attribute__((target("avx512f,avx512vl"))) void salsa_core_avx512(
+    uint32_t state[16], uint32_t rounds) {
+  SALSA20_DIAGONAL_KERNEL(SALSA20_ROTATE_PROLD)
+}
+
+__attribute__((target("avx512f,avx512vl"))) void salsa_diagonal_avx512(
+    uint32_t state[16], uint32_t rounds) {
+  SALSA20_DIAGONAL_CORE(SALSA20_ROTATE_PROLD, state)
+}
+
+#endif  // SALSA20_X86
+
+//
+// Multi-lane kernels
+//
+// These hash several independent states at once, one state per SIMD lane.
+// The states are transposed: word k of lane l is at state[k * lanes + l], so
+// every vector register holds the same word of each state and the double
+// round is the scalar one written on registers.
+//
+
+// One double round, as (target, addend, addend, rotation) steps.
+#define SALSA20_WIDE_DOUBLEROUND(STEP)                                        \
+  /* columnround */                                                           \
+  STEP(4, 0, 12, 7) STEP(8, 4, 0, 9) STEP(12, 8, 4, 13) STEP(0, 12, 8, 18)    \
+  STEP(9, 5, 1, 7) STEP(13, 9, 5, 9) STEP(1, 13, 9, 13) STEP(5, 1, 13, 18)    \
+  STEP(14, 10, 6, 7) STEP(2, 14, 10, 9) STEP(6, 2, 14, 13) STEP(10, 6, 2, 18) \
+  STEP(3, 15, 11, 7) STEP(7, 3, 15, 9) STEP(11, 7, 3, 13) STEP(15, 11, 7, 18) \
+  /* rowround */                                                              \
+  STEP(1, 0, 3, 7) STEP(2, 1, 0, 9) STEP(3, 2, 1, 13) STEP(0, 3, 2, 18)       \
+  STEP(6, 5, 4, 7) STEP(7, 6, 5, 9) STEP(4, 7, 6, 13) STEP(5, 4, 7, 18)       \
+  STEP(11, 10, 9, 7) STEP(8, 11, 10, 9) STEP(9, 8, 11, 13) STEP(10, 9, 8, 18) \
+  STEP(12, 15, 14, 7) STEP(13, 12, 15, 9)                                     \
+  STEP(14, 13, 12, 13) STEP(15, 14, 13, 18)
+
+// Scalar fallback: four lanes, one at a time.
+void salsa_wide_scalar(uint32_t* state, uint32_t rounds) {
+  const size_t lanes = 4;
+  for (size_t l = 0; l < lanes; ++l) {
+    uint32_t x[16];
+    for (size_t k = 0; k < 16; ++k) {
+      x[k] = state[k * lanes + l];
+    }
+    salsa_core(x, rounds);
+    for (size_t k = 0; k < 16; ++k) {
+      state[k * lanes + l] = x[k];
     }
   }
+}
+
+#ifdef SALSA20_X86
+
+// Loads the 16 word vectors, runs the rounds and adds the input back in.
+#define SALSA20_WIDE_KERNEL(VECTOR, LOAD, STORE, ADD, STEP)     \
+  VECTOR x[16], y[16];                                          \
+  for (int k = 0; k < 16; ++k) {                                \
+    y[k] = x[k] = LOAD(reinterpret_cast<VECTOR*>(               \
+        state + k * (sizeof(VECTOR) / sizeof(uint32_t))));      \
+  }                                                             \
+  for (uint32_t i = 0; i < rounds; i += 2) {                    \
+    SALSA20_WIDE_DOUBLEROUND(STEP)                              \
+  }                                                             \
+  for (int k = 0; k < 16; ++k) {                                \
+    STORE(reinterpret_cast<VECTOR*>(                            \
+              state + k * (sizeof(VECTOR) / sizeof(uint32_t))), \
+          ADD(x[k], y[k]));                                     \
+  }
+
+#define SALSA20_STEP_SSE2(a, b, c, n) \
+  x[a] = _mm_xor_si128(               \
+      x[a], SALSA20_ROTATE_SHIFT(_mm_add_epi32(x[b], x[c]), n));
+#define SALSA20_STEP_AVX2(a, b, c, n)                           \
+  {                                                             \
+    __m256i t = _mm256_add_epi32(x[b], x[c]);                   \
+    x[a] = _mm256_xor_si256(                                    \
+        x[a], _mm256_or_si256(_mm256_slli_epi32(t, n),          \
+                              _mm256_srli_epi32(t, 32 - (n)))); \
+  }
+// The masked rotate, with t itself as the pass-through under a full mask:
+// the plain one takes an undefined vector there, which GCC reports as used
+// uninitialized.
+#define SALSA20_STEP_AVX512(a, b, c, n)                                    \
+  {                                                                        \
+    __m512i t = _mm512_add_epi32(x[b], x[c]);                              \
+    x[a] = _mm512_xor_si512(x[a], _mm512_mask_rol_epi32(t, 0xffff, t, n)); \
+  }
+
+__attribute__((target("sse2"))) void salsa_wide_sse2(uint32_t* state,
+                                                     uint32_t rounds) {
+  SALSA20_WIDE_KERNEL(__m128i, _mm_loadu_si128, _mm_storeu_si128,
+                      _mm_add_epi32, SALSA20_STEP_SSE2)
+}
 
-  return z_output;
+__attribute__((target("avx2"))) void salsa_wide_avx2(uint32_t* state,
+                                                     uint32_t rounds) {
+  SALSA20_WIDE_KERNEL(__m256i, _mm256_loadu_si256, _mm256_storeu_si256,
+                      _mm256_add_epi32, SALSA20_STEP_AVX2)
+}
+
+__attribute__((target("avx512f"))) void salsa_wide_avx512(uint32_t* state,
+                                                          uint32_t rounds) {
+  SALSA20_WIDE_KERNEL(__m512i, _mm512_loadu_si512, _mm512_storeu_si512,
+                      _mm512_add_epi32, SALSA20_STEP_AVX512)
+}
+
+#endif  // SALSA20_X86
+
+typedef void (*SalsaCoreFunction)(uint32_t state[16], uint32_t rounds);
+
+// A kernel: its single-state cores, on the natural and the diagonal order,
+// its multi-lane core and lane count.
+struct SalsaKernel {
+  Salsa20::Kernel kind;
+  SalsaCoreFunction core;
+  SalsaCoreFunction diagonal;
+  SalsaCoreFunction wide;
+  size_t lanes;
+};
+
+const SalsaKernel scalar_kernel{Salsa20::Kernel::Scalar, salsa_core,
+                                salsa_diagonal, salsa_wide_scalar, 4};
+#ifdef SALSA20_X86
+const SalsaKernel sse2_kernel{Salsa20::Kernel::SSE2, salsa_core_sse2,
+                              salsa_diagonal_sse2, salsa_wide_sse2, 4};
+const SalsaKernel avx2_kernel{Salsa20::Kernel::AVX2, salsa_core_avx2,
+                              salsa_diagonal_avx2, salsa_wide_avx2, 8};
+const SalsaKernel avx512_kernel{Salsa20::Kernel::AVX512, salsa_core_avx512,
+                                salsa_diagonal_avx512, salsa_wide_avx512, 16};
+#endif
+
+const SalsaKernel* kernelEntry(Salsa20::Kernel k) {
+  switch (k) {
+#ifdef SALSA20_X86
+    case Salsa20::Kernel::SSE2:
+      return &sse2_kernel;
+    case Salsa20::Kernel::AVX2:
+      return &avx2_kernel;
+    case Salsa20::Kernel::AVX512:
+      return &avx512_kernel;
+#endif
+    case Salsa20::Kernel::Scalar:
+      return &scalar_kernel;
+    default:
+      return nullptr;
+  }
+}
+
+bool kernelSupported(Salsa20::Kernel k) {
+  switch (k) {
+    case Salsa20::Kernel::Auto:
+    case Salsa20::Kernel::Scalar:
+      return true;
+#ifdef SALSA20_X86
+    case Salsa20::Kernel::SSE2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse2");
+    case Salsa20::Kernel::AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+    case Salsa20::Kernel::AVX512:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx512f") &&
+             __builtin_cpu_supports("avx512vl");
+#endif
+    default:
+      return false;
+  }
 }
 
+// The best kernel the CPU supports.
+Salsa20::Kernel bestKernel() {
+  for (auto k : {Salsa20::Kernel::AVX512, Salsa20::Kernel::AVX2,
+                 Salsa20::Kernel::SSE2}) {
+    if (kernelSupported(k)) {
+      return k;
+    }
+  }
+  return Salsa20::Kernel::Scalar;
+}
+
+// Selected once, at load time, from CPUID.
+std::atomic<const SalsaKernel*> active_kernel{kernelEntry(bestKernel())};
+
 int internal_test_primitives() {
   // An example from Section 2
   uint32_t y = 0xc0a8787e;
-  uint32_t o = leftRotation(y, 5);
+  [[maybe_unused]] uint32_t o = leftRotation(y, 5);
   assert(o == 0x150f0fd8);
 
   // Examples from Section 3
@@ -255,6 +578,10 @@ int internal_test_primitives() {
   assert(littleendianInverse(0x091e4b56) == i2);
   std::vector<uint8_t> i3{255, 255, 255, 250};
   assert(littleendianInverse(0xfaffffff) == i3);
+  assert(load_littleendian(i2.data()) == 0x091e4b56);
+  uint8_t o3[4];
+  store_littleendian(o3, 0xfaffffff);
+  assert(std::vector<uint8_t>(o3, o3 + 4) == i3);
 
   return 0;
 }
@@ -270,21 +597,88 @@ Salsa20::Salsa20(uint8_t r) {
 
 int Salsa20::test_primitives() { return internal_test_primitives(); }
 
-std::vector<std::byte> Salsa20::hash(std::vector<std::byte> message) {
-  std::vector<uint8_t> message_uint_vector;
-  for (auto m : message) {
-    uint8_t n = static_cast<unsigned char>(m);
-    message_uint_vector.push_back(n);
+void Salsa20::hash(uint32_t state[16]) const {
+  active_kernel.load(std::memory_order_relaxed)->core(state, rounds);
+}
+
+void Salsa20::hash_diagonal(uint32_t state[16]) const {
+  active_kernel.load(std::memory_order_relaxed)->diagonal(state, rounds);
+}
+
+void Salsa20::to_diagonal(uint32_t state[16]) {
+  uint32_t natural[16];
+  std::copy(state, state + 16, natural);
+  for (size_t w = 0; w < 16; ++w) {
+    state[diagonal_position(w)] = natural[w];
+  }
+}
+
+void Salsa20::from_diagonal(uint32_t state[16]) {
+  uint32_t diagonal[16];
+  std::copy(state, state + 16, diagonal);
+  for (size_t w = 0; w < 16; ++w) {
+    state[w] = diagonal[diagonal_position(w)];
   }
+}
 
-  std::vector<uint8_t> hash_uint_vector =
-      salsa_hash(message_uint_vector, rounds);
+void Salsa20::hash_lanes(uint32_t* states) const {
+  active_kernel.load(std::memory_order_relaxed)->wide(states, rounds);
+}
+
+size_t Salsa20::lanes() {
+  return active_kernel.load(std::memory_order_relaxed)->lanes;
+}
 
-  std::vector<std::byte> output_vector;
-  for (auto h : hash_uint_vector) {
-    std::byte b = static_cast<std::byte>(h);
-    output_vector.push_back(b);
+bool Salsa20::set_kernel(Kernel k) {
+  if (!kernelSupported(k)) {
+    return false;
   }
+  if (k == Kernel::Auto) {
+    k = bestKernel();
+  }
+  active_kernel.store(kernelEntry(k));
+  return true;
+}
+
+Salsa20::Kernel Salsa20::kernel() { return active_kernel.load()->kind; }
+
+bool Salsa20::kernel_supported(Kernel k) { return kernelSupported(k); }
+
+const char* Salsa20::kernel_name(Kernel k) {
+  switch (k) {
+    case Kernel::Auto:
+      return "auto";
+    case Kernel::Scalar:
+      return "scalar";
+    case Kernel::SSE2:
+      return "sse2";
+    case Kernel::AVX2:
+      return "avx2";
+    case Kernel::AVX512:
+      return "avx512";
+  }
+  return "unknown";
+}
+
+void Salsa20::hash(const std::byte* message, std::byte* output) const {
+  uint32_t state[16];
+  for (size_t i = 0; i < 16; ++i) {
+    state[i] =
+        load_littleendian(reinterpret_cast<const uint8_t*>(message + 4 * i));
+  }
+
+  hash(state);
+
+  for (size_t i = 0; i < 16; ++i) {
+    store_littleendian(reinterpret_cast<uint8_t*>(output + 4 * i), state[i]);
+  }
+}
+
+std::vector<std::byte> Salsa20::hash(const std::vector<std::byte>& message) {
+  assert(message.size() == 64);
+
+  std::vector<std::byte> output_vector(64);
+  hash(message.data(), output_vector.data());
 
   return output_vector;
 }
@@ -0,0 +1,142 @@
+// scratchpad.cc - Aligned scratch memory for ROMix.
+
+#include "scratchpad.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <utility>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+namespace {
+const size_t huge_page_size = size_t{2} << 20;
+
+// From <numaif.h>, so we do not need libnuma.
+const int mpol_preferred = 1;
+
+// Maps bytes of anonymous memory, aligned to a huge page so that the kernel
+// can back it with huge pages. Returns nullptr on failure.
+void* mapAligned(size_t bytes, int flags) {
+  size_t padded = bytes + huge_page_size;
+  void* raw = mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  if (raw == MAP_FAILED) {
+    return nullptr;
+  }
+
+  // Trim the unaligned head and the tail.
+  auto start = reinterpret_cast<uintptr_t>(raw);
+  auto aligned = (start + huge_page_size - 1) & ~(huge_page_size - 1);
+  if (aligned > start) {
+    munmap(raw, aligned - start);
+  }
+  size_t tail = (start + padded) - (aligned + bytes);
+  if (tail > 0) {
+    munmap(reinterpret_cast<void*>(aligned + bytes), tail);
+  }
+  return reinterpret_cast<void*>(aligned);
+}
+
+// Prefers the NUMA node of the CPU this thread is running on. Best effort:
+// without NUMA support the kernel keeps its default policy.
+void bindToLocalNode(void* memory, size_t bytes) {
+  unsigned cpu = 0;
+  unsigned node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0 || node >= 64) {
+    return;
+  }
+  unsigned long nodemask = 1UL << node;
+  syscall(SYS_mbind, memory, bytes, mpol_preferred, &nodemask, 64, 0);
+}
+}  // namespace
+#endif
+
+Scratchpad::Scratchpad(size_t bytes, ScratchAllocation allocation)
+    : memory{nullptr},
+      length{bytes},
+      mapped{0},
+      backing{ScratchAllocation::Pages::Normal} {
+#ifdef __linux__
+  using Pages = ScratchAllocation::Pages;
+  if (allocation.pages != Pages::Normal || allocation.node_local) {
+    // Whole huge pages, so nothing else shares them.
+    size_t rounded =
+        (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+    void* p = nullptr;
+
+    if (allocation.pages == Pages::HugeTLB) {
+      p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (p == MAP_FAILED) {
+        // No huge pages reserved; let THP do what it can.
+        p = nullptr;
+        allocation.pages = Pages::Transparent;
+      } else {
+        backing = Pages::HugeTLB;
+      }
+    }
+    if (!p) {
+      p = mapAligned(rounded, 0);
+      if (p && allocation.pages == Pages::Transparent) {
+        madvise(p, rounded, MADV_HUGEPAGE);
+        backing = Pages::Transparent;
+      }
+    }
+
+    if (p) {
+      if (allocation.node_local) {
+        bindToLocalNode(p, rounded);
+      }
+      memory = static_cast<uint32_t*>(p);
+      mapped = rounded;
+      return;
+    }
+    // Fall through to the heap.
+  }
+#else
+  (void)allocation;
+#endif
+
+  // aligned_alloc wants a multiple of the alignment.
+  size_t rounded = (bytes + alignment - 1) / alignment * alignment;
+  memory = static_cast<uint32_t*>(std::aligned_alloc(alignment, rounded));
+
+  if (!memory) {
+    std::cout << "Could not allocate scratchpad.\n";
+    assert(false);
+  }
+}
+
+Scratchpad::~Scratchpad() {
+#ifdef __linux__
+  if (mapped) {
+    munmap(memory, mapped);
+    return;
+  }
+#endif
+  std::free(memory);
+}
+
+Scratchpad::Scratchpad(Scratchpad&& other) noexcept
+    : memory{other.memory},
+      length{other.length},
+      mapped{other.mapped},
+      backing{other.backing} {
+  other.memory = nullptr;
+  other.length = 0;
+  other.mapped = 0;
+}
+
+Scratchpad& Scratchpad::operator=(Scratchpad&& other) noexcept {
+  std::swap(memory, other.memory);
+  std::swap(length, other.length);
+  std::swap(mapped, other.mapped);
+  std::swap(backing, other.backing);
+  return *this;
+}
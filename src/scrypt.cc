@@ -5,91 +5,135 @@
 
 #include "scrypt.h"
 
-#include <gmpxx.h>
+#include <openssl/crypto.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cctype>
+#include <charconv>
 #include <cstddef>
-#include <iostream>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <future>
 #include <memory>
 #include <string>
-#include <thread>
+#include <type_traits>
+#include <utility>
 
+#include "metrics.h"
 #include "pbkdf2.h"
+#include "romix.h"
 #include "salsa20.h"
+#include "scratchpad.h"
+#include "scrypt_context.h"
+#include "sha256.h"
+#include "thread_pool.h"
 #include "utilities.h"
+#include "verify_cache.h"
 
 Scrypt::Scrypt() = default;
 
-// Adapted from https://stackoverflow.com/a/24018122/8327793
-mpz_class Integrify(std::vector<std::byte> uint_as_bytes) {
-  auto p = std::make_shared<mpz_class>();
-  mpz_import(p->get_mpz_t(), uint_as_bytes.size(), -1, 1, -1, 0,
-             &uint_as_bytes[0]);
+Scrypt::Scrypt(std::shared_ptr<ThreadPool> p) : pool{std::move(p)} {}
 
-  return *p;
+ThreadPool& Scrypt::thread_pool() const {
+  return pool ? *pool : *ThreadPool::shared();
 }
 
-uint64_t IntegrifyModN(std::vector<std::vector<std::byte>> B,
-                       unsigned long cost_factor_N) {
-  size_t two_r = B.size();
-  std::vector<std::byte> last_B = B.at(two_r - 1);
+MemoryBudget& Scrypt::budget() const {
+  return memory_budget ? *memory_budget : MemoryBudget::global();
+}
+
+void Scrypt::set_memory_budget(std::shared_ptr<MemoryBudget> b) {
+  memory_budget = std::move(b);
+}
 
-  assert(last_B.size() >= 8);
+void Scrypt::set_context(std::shared_ptr<ScryptContext> c) {
+  context = std::move(c);
+}
 
-  mpz_class integrified = Integrify(last_B);
+void Scrypt::set_verify_cache(std::shared_ptr<VerifyCache> c) {
+  verify_cache = std::move(c);
+}
 
-  integrified = integrified % mpz_class(cost_factor_N);
+void Scrypt::set_scratch_allocation(ScratchAllocation allocation) {
+  scratch_allocation = allocation;
+}
 
-  return integrified.get_ui();
+void Scrypt::set_interleaving(size_t lanes) {
+  interleaving = std::clamp<size_t>(lanes, 1, romix::max_interleaved);
 }
 
-std::vector<std::byte> BlockXOR(std::vector<std::byte> A,
-                                std::vector<std::byte> B) {
-  std::vector<std::byte> C;
-  assert(A.size() == B.size());
-  for (size_t i = 0; i < A.size(); ++i) {
-    C.push_back(A.at(i) ^ B.at(i));
-  }
-  return C;
+void Scrypt::set_tmto_stride(uint64_t stride) {
+  tmto_stride = std::max<uint64_t>(stride, 1);
 }
 
-std::vector<std::vector<std::byte>> BlockVectorXOR(
-    std::vector<std::vector<std::byte>> A,
-    std::vector<std::vector<std::byte>> B) {
-  std::vector<std::vector<std::byte>> C;
-  assert(A.size() == B.size());
-  for (size_t i = 0; i < A.size(); ++i) {
-    C.push_back(BlockXOR(A.at(i), B.at(i)));
+void Scrypt::set_lane_memory_limit(size_t bytes) { lane_memory_limit = bytes; }
+
+ScryptContext::Lease Scrypt::borrow_scratch(
+    size_t bytes, MemoryBudget::Reservation* reservation) const {
+  if (context) {
+    return context->acquire(bytes, scratch_allocation, reservation);
   }
-  return C;
+  return ScryptContext::Lease(Scratchpad(bytes, scratch_allocation));
 }
 
-std::vector<std::vector<std::byte>> BlockMix(
-    std::vector<std::vector<std::byte>> B) {
-  size_t two_r = B.size();
-  std::vector<std::byte> X = B.at(two_r - 1);
-  std::vector<std::vector<std::byte>> Y(two_r, {static_cast<std::byte>(0)});
+void Scrypt::set_admission(MemoryBudget::Admission policy,
+                           std::chrono::milliseconds timeout) {
+  admission = policy;
+  admission_timeout = timeout;
+}
 
-  Salsa20 salsa20_8(8);
+// Turns 4n little endian bytes into n 32-bit words.
+void BytesToWords(const std::byte* bytes, uint32_t* words, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    words[i] = static_cast<uint32_t>(bytes[4 * i]) |
+               (static_cast<uint32_t>(bytes[4 * i + 1]) << 8) |
+               (static_cast<uint32_t>(bytes[4 * i + 2]) << 16) |
+               (static_cast<uint32_t>(bytes[4 * i + 3]) << 24);
+  }
+}
 
-  for (size_t i = 0; i < two_r; i++) {
-    auto T = BlockXOR(X, B.at(i));
-    X = salsa20_8.hash(T);
-    Y.at(i) = X;
+// Turns n 32-bit words into 4n little endian bytes.
+void WordsToBytes(const uint32_t* words, std::byte* bytes, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t b = 0; b < 4; ++b) {
+      bytes[4 * i + b] = static_cast<std::byte>(words[i] >> (8 * b));
+    }
   }
+}
 
-  std::vector<std::vector<std::byte>> output_vector;
+// Converts words read as raw little endian bytes to host order, in place.
+void LittleEndianToHost(uint32_t* words, size_t n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // Already in host order.
+  (void)words;
+  (void)n;
+#else
+  BytesToWords(reinterpret_cast<const std::byte*>(words), words, n);
+#endif
+}
 
-  for (size_t i = 0; i < two_r; i += 2) {
-    // Even blocks first
-    output_vector.push_back(Y.at(i));
-  }
-  for (size_t i = 1; i < two_r; i += 2) {
-    // Then odd blocks
-    output_vector.push_back(Y.at(i));
+// Converts host order words to little endian bytes, in place.
+void HostToLittleEndian(uint32_t* words, size_t n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  (void)words;
+  (void)n;
+#else
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t x = words[i];
+    WordsToBytes(&x, reinterpret_cast<std::byte*>(words + i), 1);
   }
+#endif
+}
 
-  return output_vector;
+// The RFC requires r and p to be positive, with r * p < 2^30.
+bool ValidBlockFactors(uint32_t block_size_factor_r,
+                       uint32_t parallelization_factor_p) {
+  return block_size_factor_r > 0 && parallelization_factor_p > 0 &&
+         uint64_t{block_size_factor_r} * parallelization_factor_p <
+             (uint64_t{1} << 30);
 }
 
 std::vector<std::byte> ROMix(uint32_t block_size_factor_r,
@@ -101,103 +145,684 @@ std::vector<std::byte> ROMix(uint32_t block_size_factor_r,
 
   assert((2 * block_size_factor_r) == two_r);
 
-  std::vector<std::vector<std::byte>> B;
-  for (size_t i = 0; i < two_r; i++) {
-    auto it = block.begin();
-    std::vector<std::byte> Bi(it + (i * 64), it + ((i + 1) * 64));
-    B.push_back(Bi);
-  }
+  std::vector<uint32_t> B(16 * two_r);
+  BytesToWords(block.data(), B.data(), B.size());
+
+  Scratchpad scratch(
+      romix::ROMixScratchSize(block_size_factor_r, cost_factor_N));
+  romix::ROMix(block_size_factor_r, B.data(), cost_factor_N, scratch.data());
+
+  std::vector<std::byte> B_out(block.size());
+  WordsToBytes(B.data(), B_out.data(), B.size());
+
+  return B_out;
+}
 
-  std::vector<std::vector<std::byte>> X(B);
-  std::vector<std::vector<std::vector<std::byte>>> V;
+bool Scrypt::hash(const std::byte* passphrase, size_t passphrase_length,
+                  const std::byte* salt, size_t salt_length,
+                  uint64_t cost_factor_N, uint32_t block_size_factor_r,
+                  uint32_t parallelization_factor_p, std::byte* output,
+                  size_t desired_key_length) {
+  return hash<mfcrypt::HMACSHA256, mfcrypt::ROMixSalsa20_8>(
+      passphrase, passphrase_length, salt, salt_length, cost_factor_N,
+      block_size_factor_r, parallelization_factor_p, output,
+      desired_key_length, nullptr);
+}
 
-  for (uint64_t i = 0; i < cost_factor_N; ++i) {
-    V.push_back(X);
-    X = BlockMix(X);
+template <typename PRF, typename MF>
+bool Scrypt::hash(const std::byte* passphrase, size_t passphrase_length,
+                  const std::byte* salt, size_t salt_length,
+                  uint64_t cost_factor_N, uint32_t block_size_factor_r,
+                  uint32_t parallelization_factor_p, std::byte* output,
+                  size_t desired_key_length) {
+  return hash<PRF, MF>(passphrase, passphrase_length, salt, salt_length,
+                       cost_factor_N, block_size_factor_r,
+                       parallelization_factor_p, output, desired_key_length,
+                       nullptr);
+}
+
+template <typename PRF, typename MF>
+bool Scrypt::hash(const std::byte* passphrase, size_t passphrase_length,
+                  const std::byte* salt, size_t salt_length,
+                  uint64_t cost_factor_N, uint32_t block_size_factor_r,
+                  uint32_t parallelization_factor_p, std::byte* output,
+                  size_t desired_key_length,
+                  const std::atomic<bool>* cancelled) {
+  if (!romix::ValidCostFactor(cost_factor_N) ||
+      !ValidBlockFactors(block_size_factor_r, parallelization_factor_p)) {
+    return false;
   }
 
-  for (uint64_t i = 0; i < cost_factor_N; ++i) {
-    uint64_t j = IntegrifyModN(X, cost_factor_N);
-    auto T = BlockVectorXOR(X, V.at(j));
-    X = BlockMix(T);
+  // Collects the stage times of every lane, and reports them on return.
+  metrics::Recorder recorder;
+  metrics::Scope scope(recorder);
+
+  // Only scrypt's own ROMix interleaves lanes and trades memory for time.
+  constexpr bool scrypt_mix = std::is_same_v<MF, mfcrypt::ROMixSalsa20_8>;
+
+  // Every lane needs its own scratchpad, of the whole of V unless some of it
+  // is traded for time.
+  uint64_t stride = scrypt_mix ? std::min(tmto_stride, cost_factor_N) : 1;
+  if (MF::scratch_size(block_size_factor_r, cost_factor_N) >
+      lane_memory_limit) {
+    uint64_t fitting =
+        scrypt_mix ? romix::TMTOStride(block_size_factor_r, cost_factor_N,
+                                       lane_memory_limit)
+                   : 0;
+    if (fitting == 0) {
+      return false;
+    }
+    stride = std::max(stride, fitting);
+  }
+  // A hash cancelled before it starts does not wait for memory.
+  if (romix::Cancelled(cancelled)) {
+    return false;
+  }
+  size_t scratch_size =
+      stride == 1
+          ? MF::scratch_size(block_size_factor_r, cost_factor_N)
+          : romix::ROMixTMTOScratchSize(block_size_factor_r, cost_factor_N,
+                                        stride);
+  if (scratch_size == SIZE_MAX ||
+      scratch_size > SIZE_MAX / parallelization_factor_p) {
+    return false;
+  }
+  // Cached scratchpads come with their charge to the budget, so only the
+  // other lanes need reserving.
+  std::vector<ScryptContext::Lease> cached;
+  if (context) {
+    cached = context->take(budget(), scratch_size, parallelization_factor_p);
   }
+  size_t reserved = (parallelization_factor_p - cached.size()) * scratch_size;
+  if (context) {
+    context->make_room(budget(), reserved);
+  }
+  metrics::Stamp waiting;
+  MemoryBudget::Reservation reservation(budget(), reserved, admission,
+                                        admission_timeout);
+  waiting.record(metrics::Stage::MemoryWait);
+  if (!reservation.admitted()) {
+    return false;
+  }
+  recorder.allocated(parallelization_factor_p * scratch_size);
 
-  std::vector<std::byte> B_out = {};
+  //
+  // 1. Generate an expensive salt using PBKDF2, and mix it
+  //
+
+  uint32_t block_size = 128 * block_size_factor_r;
+
+  // Both PBKDF2 runs share the HMAC key schedule of the passphrase.
+  PBKDF2::Key key(PRF::digest(), passphrase, passphrase_length);
+
+  // We view B as B0, B1,...,B(p-1), each of 32r words. Each lane derives its
+  // own Bi straight into B, so it can start mixing without waiting for the
+  // others, and leaves it as little endian bytes again.
+  size_t words = block_size / 4;
+  std::vector<uint32_t> B(words * parallelization_factor_p);
+  auto B_bytes = reinterpret_cast<std::byte*>(B.data());
+
+  // A lane that sees cancelled set stops, and so will the others. Each task
+  // mixes a run of up to interleaving lanes on one thread.
+  std::atomic<bool> gave_up{false};
+  std::atomic<size_t> next_cached{0};
+  size_t run_length = std::min<size_t>(
+      scrypt_mix && stride == 1 ? interleaving : 1, parallelization_factor_p);
+  auto mix_lanes = [&](size_t first) {
+    metrics::Scope lane_scope(recorder);
+    size_t count = std::min<size_t>(run_length,
+                                    parallelization_factor_p - first);
+    uint32_t* blocks[romix::max_interleaved];
+    uint32_t* scratches[romix::max_interleaved];
+    std::vector<ScryptContext::Lease> leases;
+    leases.reserve(count);
+    if (romix::Cancelled(cancelled)) {
+      gave_up = true;
+      return;
+    }
+    // The blocks of the run are derived together, to fill more SHA-256
+    // lanes when r is small.
+    key.derive(salt, salt_length, 1, first * block_size,
+               B_bytes + first * block_size, count * block_size);
+    for (size_t l = 0; l < count; l++) {
+      size_t i = first + l;
+      blocks[l] = B.data() + i * words;
+      LittleEndianToHost(blocks[l], words);
+      size_t c = next_cached++;
+      leases.push_back(c < cached.size()
+                           ? std::move(cached.at(c))
+                           : borrow_scratch(scratch_size, &reservation));
+      scratches[l] = leases.back().data();
+    }
+    bool mixed;
+    if constexpr (scrypt_mix) {
+      mixed = count == 1
+                  ? romix::ROMixTMTO(block_size_factor_r, blocks[0],
+                                     cost_factor_N, stride, scratches[0],
+                                     cancelled)
+                  : romix::ROMixInterleaved(block_size_factor_r, blocks, count,
+                                            cost_factor_N, scratches,
+                                            cancelled);
+    } else {
+      mixed = MF::mix(block_size_factor_r, blocks[0], cost_factor_N,
+                      scratches[0], cancelled);
+    }
+    if (!mixed) {
+      gave_up = true;
+    }
+    for (size_t l = 0; l < count; l++) {
+      HostToLittleEndian(blocks[l], words);
+    }
+  };
 
-  for (size_t i = 0; i < two_r; i++) {
-    auto it = B_out.begin() + (i * block_size);
-    B_out.insert(it, X.at(i).begin(), X.at(i).end());
-    assert(X.at(i).size() == block_size);
+  if (run_length == parallelization_factor_p) {
+    // Sequential mode: no thread is involved.
+    mix_lanes(0);
+  } else {
+    ThreadPool::TaskGroup lanes(thread_pool());
+    metrics::Stamp submitted;
+    for (size_t first = run_length; first < parallelization_factor_p;
+         first += run_length) {
+      lanes.run([&mix_lanes, &submitted, first] {
+        submitted.record(metrics::Stage::ThreadStart);
+        mix_lanes(first);
+      });
+    }
+    // This thread mixes the first run while the pool takes the rest.
+    mix_lanes(0);
+    lanes.wait();
+  }
+  if (gave_up || romix::Cancelled(cancelled)) {
+    return false;
   }
 
-  return B_out;
+  //
+  // 2. Use PBKDF2 and the expensive salt to generate the hash
+  //
+
+  key.derive(B_bytes, block_size * parallelization_factor_p, 1, 0, output,
+             desired_key_length);
+
+  return true;
 }
 
-std::vector<std::byte> Scrypt::hash(std::vector<std::byte> passphrase,
-                                    std::vector<std::byte> salt,
+// The policies of include/mfcrypt.h are the only ones hash takes.
+#define SCRYPT_INSTANTIATE(PRF, MF)                                         \
+  template bool Scrypt::hash<PRF, MF>(const std::byte*, size_t,             \
+                                      const std::byte*, size_t, uint64_t,   \
+                                      uint32_t, uint32_t, std::byte*, size_t);
+
+SCRYPT_INSTANTIATE(mfcrypt::HMACSHA256, mfcrypt::ROMixSalsa20_8)
+SCRYPT_INSTANTIATE(mfcrypt::HMACSHA256, mfcrypt::ROMixChaCha20_8)
+SCRYPT_INSTANTIATE(mfcrypt::HMACSHA512, mfcrypt::ROMixSalsa20_8)
+SCRYPT_INSTANTIATE(mfcrypt::HMACSHA512, mfcrypt::ROMixChaCha20_8)
+
+#undef SCRYPT_INSTANTIATE
+
+std::vector<std::byte> Scrypt::hash(const std::vector<std::byte>& passphrase,
+                                    const std::vector<std::byte>& salt,
                                     uint64_t cost_factor_N,
                                     uint32_t block_size_factor_r,
                                     uint32_t parallelization_factor_p,
                                     size_t desired_key_length) {
-  //
-  // 1. Generate an expensive salt using PBKDF2
-  //
+  std::vector<std::byte> output_buffer(desired_key_length);
 
-  uint32_t block_size = 128 * block_size_factor_r;
+  if (!hash(passphrase.data(), passphrase.size(), salt.data(), salt.size(),
+            cost_factor_N, block_size_factor_r, parallelization_factor_p,
+            output_buffer.data(), desired_key_length)) {
+    return {};
+  }
+
+  return output_buffer;
+}
 
-  PBKDF2 PBKDF2_SHA256(EVP_sha256());
+void Scrypt::hash_async(std::vector<std::byte> passphrase,
+                        std::vector<std::byte> salt, uint64_t cost_factor_N,
+                        uint32_t block_size_factor_r,
+                        uint32_t parallelization_factor_p,
+                        size_t desired_key_length, Callback done,
+                        Cancellation cancelled) {
+  // The task keeps its own copy of the settings.
+  Scrypt self = *this;
+  ThreadPool& pool = thread_pool();
+  pool.post([self, passphrase = std::move(passphrase),
+             salt = std::move(salt), cost_factor_N, block_size_factor_r,
+             parallelization_factor_p, desired_key_length,
+             done = std::move(done),
+             cancelled = std::move(cancelled)]() mutable {
+    std::vector<std::byte> output(desired_key_length);
+    if (!self.hash<mfcrypt::HMACSHA256, mfcrypt::ROMixSalsa20_8>(
+            passphrase.data(), passphrase.size(), salt.data(), salt.size(),
+            cost_factor_N, block_size_factor_r, parallelization_factor_p,
+            output.data(), desired_key_length, cancelled.get())) {
+      output.clear();
+    }
+    done(std::move(output));
+  });
+}
 
-  std::vector<std::byte> expensive_salt = PBKDF2_SHA256.hash(
-      passphrase, salt, 1, block_size * parallelization_factor_p);
+std::future<std::vector<std::byte>> Scrypt::hash_async(
+    std::vector<std::byte> passphrase, std::vector<std::byte> salt,
+    uint64_t cost_factor_N, uint32_t block_size_factor_r,
+    uint32_t parallelization_factor_p, size_t desired_key_length,
+    Cancellation cancelled) {
+  // std::function needs a copyable callback, so share the promise.
+  auto promise = std::make_shared<std::promise<std::vector<std::byte>>>();
+  std::future<std::vector<std::byte>> result = promise->get_future();
+  hash_async(std::move(passphrase), std::move(salt), cost_factor_N,
+             block_size_factor_r, parallelization_factor_p,
+             desired_key_length,
+             [promise](std::vector<std::byte> key) {
+               promise->set_value(std::move(key));
+             },
+             std::move(cancelled));
+  return result;
+}
 
-  // Let us split expensive salt into B0, B1,...,B(p-1) each with block_size
-  // bytes.
-  std::vector<std::vector<std::byte>> B(parallelization_factor_p);
-  for (size_t i = 0; i < parallelization_factor_p; i++) {
-    auto it = expensive_salt.begin();
-    std::vector<std::byte> Bi(it + (i * block_size),
-                              it + ((i + 1) * block_size));
-    B.at(i) = Bi;
+std::vector<std::vector<std::byte>> Scrypt::hash_batch(
+    const std::vector<Job>& jobs, Cancellation cancellation) {
+  const std::atomic<bool>* cancelled = cancellation.get();
+
+  // One job with parameters hash would refuse fails the whole batch, before
+  // anything is sized from them.
+  for (const Job& job : jobs) {
+    if (!romix::ValidCostFactor(job.cost_factor_N) ||
+        !ValidBlockFactors(job.block_size_factor_r,
+                           job.parallelization_factor_p)) {
+      return {};
+    }
   }
 
-  // lambda expression to make parallelization easier
-  auto rommix_parallel = [](auto B, auto block_size_factor_r,
-                            auto cost_factor_N, auto mixed_B_iter, int index) {
-    *(mixed_B_iter + index) =
-        ROMix(block_size_factor_r, B.at(index), cost_factor_N);
-    return;
+  // Blocks with the same N and r can share SIMD lanes, whatever job they
+  // come from. Job n's blocks start at word offsets[n] of B.
+  struct Class {
+    uint64_t cost_factor_N;
+    uint32_t block_size_factor_r;
+    std::vector<uint32_t*> blocks;
   };
+  std::vector<Class> classes;
+  std::vector<size_t> offsets(jobs.size() + 1, 0);
+  for (size_t n = 0; n < jobs.size(); n++) {
+    const Job& job = jobs.at(n);
+    size_t words = 32 * static_cast<size_t>(job.block_size_factor_r);
+    if (job.parallelization_factor_p > (SIZE_MAX - offsets.at(n)) / words) {
+      return {};
+    }
+    offsets.at(n + 1) = offsets.at(n) + job.parallelization_factor_p * words;
+  }
+  std::vector<uint32_t> B(offsets.back());
+
+  for (size_t n = 0; n < jobs.size(); n++) {
+    const Job& job = jobs.at(n);
+    auto it = std::find_if(classes.begin(), classes.end(), [&](Class& c) {
+      return c.cost_factor_N == job.cost_factor_N &&
+             c.block_size_factor_r == job.block_size_factor_r;
+    });
+    if (it == classes.end()) {
+      it = classes.insert(classes.end(),
+                          {job.cost_factor_N, job.block_size_factor_r, {}});
+    }
+    size_t words = 32 * static_cast<size_t>(job.block_size_factor_r);
+    for (size_t i = 0; i < job.parallelization_factor_p; i++) {
+      it->blocks.push_back(B.data() + offsets.at(n) + i * words);
+    }
+  }
 
-  // Let us mix these blocks (in parallel)
-  // Inspired by https://stackoverflow.com/a/10796261
-  std::vector<std::vector<std::byte>> mixed_B(parallelization_factor_p);
-  auto mixed_B_iter = std::begin(mixed_B);
-  std::vector<std::thread> threads(parallelization_factor_p);
-  int index = 0;
-  for (auto it = std::begin(threads); it != std::end(threads); it++) {
-    *it = std::thread(rommix_parallel, B, block_size_factor_r, cost_factor_N,
-                      mixed_B_iter, index);
-    index++;
+  // Longest lanes first, so the short ones fill in the gaps at the end.
+  std::sort(classes.begin(), classes.end(), [](const Class& a,
+                                               const Class& b) {
+    return a.cost_factor_N * a.block_size_factor_r >
+           b.cost_factor_N * b.block_size_factor_r;
+  });
+
+  // Full groups of lanes share a scratchpad, the rest get one each.
+  const size_t lanes = Salsa20::lanes();
+  size_t scratch_total = 0;
+  for (const Class& c : classes) {
+    size_t full = c.blocks.size() / lanes;
+    size_t rest = c.blocks.size() % lanes;
+    size_t group_scratch_size =
+        romix::ROMixLanesScratchSize(c.block_size_factor_r, c.cost_factor_N);
+    size_t scratch_size =
+        romix::ROMixScratchSize(c.block_size_factor_r, c.cost_factor_N);
+    if (group_scratch_size == SIZE_MAX || scratch_size == SIZE_MAX ||
+        (full != 0 && group_scratch_size > SIZE_MAX / full) ||
+        (rest != 0 && scratch_size > SIZE_MAX / rest) ||
+        full * group_scratch_size > SIZE_MAX - rest * scratch_size) {
+      return {};
+    }
+    size_t class_total = full * group_scratch_size + rest * scratch_size;
+    if (class_total > SIZE_MAX - scratch_total) {
+      return {};
+    }
+    scratch_total += class_total;
   }
-  for (auto&& t : threads) {
-    t.join();
+  if (romix::Cancelled(cancelled)) {
+    return {};
+  }
+  if (context) {
+    context->make_room(budget(), scratch_total);
+  }
+  MemoryBudget::Reservation reservation(budget(), scratch_total, admission,
+                                        admission_timeout);
+  if (!reservation.admitted()) {
+    return {};
   }
 
-  std::vector<std::byte> mixed_expensive_salt = {};
-  for (size_t i = 0; i < parallelization_factor_p; i++) {
-    auto it = mixed_expensive_salt.begin() + (i * block_size);
-    mixed_expensive_salt.insert(it, mixed_B.at(i).begin(), mixed_B.at(i).end());
-    assert(mixed_B.at(i).size() == block_size);
+  // Both PBKDF2 runs of a job share the HMAC key schedule of its passphrase.
+  std::vector<PBKDF2::Key> keys;
+  keys.reserve(jobs.size());
+  for (const Job& job : jobs) {
+    keys.emplace_back(EVP_sha256(), job.passphrase.data(),
+                      job.passphrase.size());
   }
 
+  auto B_bytes = reinterpret_cast<std::byte*>(B.data());
+  ThreadPool::TaskGroup tasks(thread_pool());
+
+  // A task that sees cancelled set skips its work, and the batch gives up
+  // after the stage it is in.
+  std::atomic<bool> gave_up{false};
+  auto give_up = [&] {
+    if (romix::Cancelled(cancelled)) {
+      gave_up = true;
+    }
+    return gave_up.load();
+  };
+
+  // The PBKDF2 blocks of all the jobs share the SHA-256 lanes, so jobs with
+  // small r and p fill them together. Consecutive requests are grouped into
+  // runs of about equal length, one task each.
+  const size_t sha256_lanes = SHA256::lanes();
+  auto derive_all = [&](const std::vector<PBKDF2::Key::Request>& requests) {
+    size_t total = 0;
+    for (const auto& request : requests) {
+      total += (request.length + 31) / 32;
+    }
+    size_t run_blocks = total / (thread_pool().size() + 1);
+    run_blocks = std::max(sha256_lanes, run_blocks - run_blocks % sha256_lanes);
+    size_t first = 0;
+    size_t blocks = 0;
+    for (size_t n = 0; n < requests.size(); n++) {
+      blocks += (requests.at(n).length + 31) / 32;
+      if (blocks < run_blocks && n + 1 < requests.size()) {
+        continue;
+      }
+      tasks.run([&, first, count = n + 1 - first] {
+        if (give_up()) {
+          return;
+        }
+        PBKDF2::Key::derive_batch(requests.data() + first, count, 1);
+      });
+      first = n + 1;
+      blocks = 0;
+    }
+    tasks.wait();
+  };
+
   //
-  // 2. Use PBKDF2 and the expensive salt to generate the hash
+  // 1. Generate an expensive salt for every job
   //
 
-  std::vector<std::byte> output_buffer = PBKDF2_SHA256.hash(
-      passphrase, mixed_expensive_salt, 1, desired_key_length);
+  std::vector<PBKDF2::Key::Request> requests;
+  requests.reserve(jobs.size());
+  for (size_t n = 0; n < jobs.size(); n++) {
+    requests.push_back({&keys.at(n), jobs.at(n).salt.data(),
+                        jobs.at(n).salt.size(), 0, B_bytes + offsets.at(n) * 4,
+                        (offsets.at(n + 1) - offsets.at(n)) * 4});
+  }
+  derive_all(requests);
+  if (gave_up) {
+    return {};
+  }
+  LittleEndianToHost(B.data(), B.size());
 
-  return output_buffer;
+  //
+  // 2. Mix the blocks of every job in place, Salsa20::lanes() at a time
+  //
+
+  for (const Class& c : classes) {
+    size_t full = c.blocks.size() - (c.blocks.size() % lanes);
+    size_t group_scratch_size =
+        romix::ROMixLanesScratchSize(c.block_size_factor_r, c.cost_factor_N);
+    size_t scratch_size =
+        romix::ROMixScratchSize(c.block_size_factor_r, c.cost_factor_N);
+    for (size_t first = 0; first < full; first += lanes) {
+      tasks.run([&, first, group_scratch_size] {
+        if (give_up()) {
+          return;
+        }
+        ScryptContext::Lease scratch =
+            borrow_scratch(group_scratch_size, &reservation);
+        if (!romix::ROMixLanes(c.block_size_factor_r, c.blocks.data() + first,
+                               c.cost_factor_N, scratch.data(), cancelled)) {
+          gave_up = true;
+        }
+      });
+    }
+    // Too few blocks are left to fill the lanes, so mix them one by one.
+    for (size_t k = full; k < c.blocks.size(); k++) {
+      tasks.run([&, k, scratch_size] {
+        if (give_up()) {
+          return;
+        }
+        ScryptContext::Lease scratch =
+            borrow_scratch(scratch_size, &reservation);
+        if (!romix::ROMix(c.block_size_factor_r, c.blocks.at(k),
+                          c.cost_factor_N, scratch.data(), cancelled)) {
+          gave_up = true;
+        }
+      });
+    }
+  }
+  tasks.wait();
+  if (give_up()) {
+    return {};
+  }
+
+  //
+  // 3. Use PBKDF2 and the expensive salts to generate the hashes
+  //
+
+  HostToLittleEndian(B.data(), B.size());
+
+  std::vector<std::vector<std::byte>> output(jobs.size());
+  for (size_t n = 0; n < jobs.size(); n++) {
+    output.at(n).resize(jobs.at(n).desired_key_length);
+    requests.at(n) = {&keys.at(n), B_bytes + offsets.at(n) * 4,
+                      (offsets.at(n + 1) - offsets.at(n)) * 4, 0,
+                      output.at(n).data(), jobs.at(n).desired_key_length};
+  }
+  derive_all(requests);
+  if (gave_up) {
+    return {};
+  }
+
+  return output;
+}
+
+std::vector<std::vector<std::byte>> Scrypt::hash_multi(
+    const std::vector<std::pair<std::vector<std::byte>,
+                                std::vector<std::byte>>>& inputs,
+    uint64_t cost_factor_N, uint32_t block_size_factor_r,
+    uint32_t parallelization_factor_p, size_t desired_key_length,
+    Cancellation cancelled) {
+  std::vector<Job> jobs;
+  jobs.reserve(inputs.size());
+  for (auto& input : inputs) {
+    jobs.push_back({input.first, input.second, cost_factor_N,
+                    block_size_factor_r, parallelization_factor_p,
+                    desired_key_length});
+  }
+  return hash_batch(jobs, std::move(cancelled));
+}
+
+//
+// PHC strings
+//
+
+// A parsed PHC string.
+struct PHCHash {
+  uint64_t cost_factor_N;
+  uint32_t block_size_factor_r;
+  uint32_t parallelization_factor_p;
+  std::byte salt[Scrypt::max_phc_bytes];
+  size_t salt_length;
+  std::byte key[Scrypt::max_phc_bytes];
+  size_t key_length;
+};
+
+// Consumes literal from the front of [s, end).
+bool ParseLiteral(const char*& s, const char* end, const char* literal) {
+  size_t n = std::strlen(literal);
+  if (static_cast<size_t>(end - s) < n || std::memcmp(s, literal, n) != 0) {
+    return false;
+  }
+  s += n;
+  return true;
+}
+
+// Consumes a decimal number, without sign or leading zeros, from the front of
+// [s, end).
+bool ParseNumber(const char*& s, const char* end, uint32_t* value) {
+  if (s == end || (*s == '0' && s + 1 != end && std::isdigit(s[1]))) {
+    return false;
+  }
+  auto result = std::from_chars(s, end, *value);
+  if (result.ec != std::errc() || result.ptr == s) {
+    return false;
+  }
+  s = result.ptr;
+  return true;
+}
+
+bool ParsePHC(const char* encoded, size_t encoded_length, PHCHash* hash) {
+  const char* s = encoded;
+  const char* end = encoded + encoded_length;
+  uint32_t log2_N;
+  if (!ParseLiteral(s, end, "$scrypt$ln=") || !ParseNumber(s, end, &log2_N) ||
+      !ParseLiteral(s, end, ",r=") ||
+      !ParseNumber(s, end, &hash->block_size_factor_r) ||
+      !ParseLiteral(s, end, ",p=") ||
+      !ParseNumber(s, end, &hash->parallelization_factor_p) ||
+      !ParseLiteral(s, end, "$")) {
+    return false;
+  }
+
+  // The scratch must fit in memory too.
+  if (log2_N < 1 || log2_N > 63 ||
+      !ValidBlockFactors(hash->block_size_factor_r,
+                         hash->parallelization_factor_p)) {
+    return false;
+  }
+  hash->cost_factor_N = uint64_t{1} << log2_N;
+  size_t block_size = 128 * static_cast<size_t>(hash->block_size_factor_r);
+  if (hash->cost_factor_N > SIZE_MAX / block_size - 1 ||
+      (hash->cost_factor_N + 1) * block_size >
+          SIZE_MAX / hash->parallelization_factor_p) {
+    return false;
+  }
+
+  const char* salt_end = std::find(s, end, '$');
+  if (salt_end == end) {
+    return false;
+  }
+  utilities::Decoded salt = utilities::decodeBase64(
+      s, salt_end - s, hash->salt, sizeof(hash->salt));
+  s = salt_end + 1;
+  utilities::Decoded key =
+      utilities::decodeBase64(s, end - s, hash->key, sizeof(hash->key));
+  hash->salt_length = salt.length;
+  hash->key_length = key.length;
+  return salt.ok() && key.ok() && key.length > 0;
+}
+
+size_t Scrypt::encode(const std::byte* salt, size_t salt_length,
+                      uint64_t cost_factor_N, uint32_t block_size_factor_r,
+                      uint32_t parallelization_factor_p, const std::byte* key,
+                      size_t key_length, char* encoded, size_t capacity) {
+  if (!romix::ValidCostFactor(cost_factor_N) || salt_length > max_phc_bytes ||
+      key_length > max_phc_bytes) {
+    return 0;
+  }
+
+  uint32_t log2_N = 0;
+  while ((uint64_t{1} << log2_N) != cost_factor_N) {
+    log2_N++;
+  }
+
+  // "$scrypt$ln=" and the three numbers take at most 51 characters.
+  char header[64];
+  int written =
+      std::snprintf(header, sizeof(header), "$scrypt$ln=%u,r=%u,p=%u$",
+                    log2_N, block_size_factor_r, parallelization_factor_p);
+  assert(written > 0 && static_cast<size_t>(written) < sizeof(header));
+
+  size_t header_length = static_cast<size_t>(written);
+  size_t length = header_length + utilities::base64Length(salt_length) + 1 +
+                  utilities::base64Length(key_length);
+  if (length > capacity) {
+    return 0;
+  }
+  std::memcpy(encoded, header, header_length);
+  char* out = encoded + header_length;
+  out += utilities::encodeBase64(salt, salt_length, out);
+  *out++ = '$';
+  out += utilities::encodeBase64(key, key_length, out);
+  return length;
+}
+
+std::string Scrypt::encode(const std::vector<std::byte>& passphrase,
+                           const std::vector<std::byte>& salt,
+                           uint64_t cost_factor_N,
+                           uint32_t block_size_factor_r,
+                           uint32_t parallelization_factor_p,
+                           size_t desired_key_length) {
+  std::vector<std::byte> key =
+      hash(passphrase, salt, cost_factor_N, block_size_factor_r,
+           parallelization_factor_p, desired_key_length);
+  if (key.empty()) {
+    return {};
+  }
+
+  char encoded[max_phc_length];
+  size_t length = encode(salt.data(), salt.size(), cost_factor_N,
+                         block_size_factor_r, parallelization_factor_p,
+                         key.data(), key.size(), encoded, sizeof(encoded));
+  return std::string(encoded, length);
+}
+
+bool Scrypt::verify(const std::byte* passphrase, size_t passphrase_length,
+                    const char* encoded, size_t encoded_length) {
+  PHCHash expected;
+  if (!ParsePHC(encoded, encoded_length, &expected)) {
+    return false;
+  }
+  if (verify_cache && verify_cache->contains(passphrase, passphrase_length,
+                                             encoded, encoded_length)) {
+    return true;
+  }
+
+  std::byte key[max_phc_bytes];
+  if (!hash(passphrase, passphrase_length, expected.salt,
+            expected.salt_length, expected.cost_factor_N,
+            expected.block_size_factor_r, expected.parallelization_factor_p,
+            key, expected.key_length)) {
+    return false;
+  }
+  bool match = CRYPTO_memcmp(key, expected.key, expected.key_length) == 0;
+  OPENSSL_cleanse(key, sizeof(key));
+  if (match && verify_cache) {
+    verify_cache->insert(passphrase, passphrase_length, encoded,
+                         encoded_length);
+  }
+  return match;
+}
+
+bool Scrypt::verify(const std::vector<std::byte>& passphrase,
+                    const std::string& encoded) {
+  return verify(passphrase.data(), passphrase.size(), encoded.data(),
+                encoded.size());
 }
 
 int Scrypt::test_primitives() {
@@ -213,10 +838,15 @@ int Scrypt::test_primitives() {
       "67 d2 7c 51 ce 4a d5 fe d8 29 c9 0b 50 5a 57 1b "
       "7f 4d 1c ad 6a 52 3c da 77 0e 67 bc ea af 7e 89 ";
 
-  std::vector<std::vector<std::byte>> blockmix_in_0{
-      utilities::hexToBytes(blockmix_in_0_0),
-      utilities::hexToBytes(blockmix_in_0_1)};
-  std::vector<std::vector<std::byte>> blockmix_out_0 = BlockMix(blockmix_in_0);
+  std::vector<std::byte> blockmix_in_0 =
+      utilities::hexToBytes(blockmix_in_0_0 + blockmix_in_0_1);
+  std::vector<uint32_t> blockmix_in_0_words(32);
+  BytesToWords(blockmix_in_0.data(), blockmix_in_0_words.data(), 32);
+  std::vector<uint32_t> blockmix_out_0_words(32);
+  romix::BlockMix(blockmix_in_0_words.data(), nullptr,
+                  blockmix_out_0_words.data(), 2, Salsa20(8));
+  std::vector<std::byte> blockmix_out_0(128);
+  WordsToBytes(blockmix_out_0_words.data(), blockmix_out_0.data(), 32);
   std::string blockmix_out_0_0 =
       "a4 1f 85 9c 66 08 cc 99 3b 81 ca cb 02 0c ef 05 "
       "04 4b 21 81 a2 fd 33 7d fd 7b 1c 63 96 68 2f 29 "
@@ -227,10 +857,8 @@ int Scrypt::test_primitives() {
       "21 07 7c fe 5f 8d 5f e2 b1 a4 16 8f 95 36 78 b7 "
       "7d 3b 3d 80 3b 60 e4 ab 92 09 96 e5 9b 4d 53 b6 "
       "5d 2a 22 58 77 d5 ed f5 84 2c b9 f1 4e ef e4 25 ";
-  std::vector<std::vector<std::byte>> expected_blockmix_out_0{
-      utilities::hexToBytes(blockmix_out_0_0),
-      utilities::hexToBytes(blockmix_out_0_1)};
-  assert(blockmix_out_0 == expected_blockmix_out_0);
+  assert(blockmix_out_0 ==
+         utilities::hexToBytes(blockmix_out_0_0 + blockmix_out_0_1));
 
   // From Section 10 of the RFC
   std::string romix_in_0 =
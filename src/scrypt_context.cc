@@ -0,0 +1,189 @@
+// scrypt_context.cc - A cache of ROMix scratchpads for repeated hashes.
+
+#include "scrypt_context.h"
+
+#include <openssl/crypto.h>
+
+#include <cstring>
+#include <utility>
+
+ScryptContext::ScryptContext(size_t max_cached_bytes,
+                             std::chrono::milliseconds idle,
+                             bool wipe_on_release,
+                             std::shared_ptr<MemoryBudget> budget)
+    : max_cached{max_cached_bytes},
+      idle_timeout{idle},
+      wipe{wipe_on_release},
+      own_budget{std::move(budget)},
+      charged{own_budget ? *own_budget : MemoryBudget::global()},
+      cached{0},
+      hit_count{0},
+      miss_count{0} {}
+
+ScryptContext::~ScryptContext() { clear(); }
+
+ScryptContext::Lease ScryptContext::acquire(
+    size_t bytes, ScratchAllocation allocation,
+    MemoryBudget::Reservation* reservation) {
+  auto now = std::chrono::steady_clock::now();
+  auto self = std::this_thread::get_id();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    evict_idle(now);
+
+    // A scratchpad of the size asked for, preferring this thread's own.
+    auto best = cache.end();
+    for (auto it = cache.begin(); it != cache.end(); ++it) {
+      if (it->pad.size() != bytes) {
+        continue;
+      }
+      if (best == cache.end() || it->last_user == self) {
+        best = it;
+      }
+      if (best->last_user == self) {
+        break;
+      }
+    }
+    if (best != cache.end()) {
+      Scratchpad pad = std::move(best->pad);
+      cached -= pad.size();
+      charged.release(pad.size());
+      cache.erase(best);
+      hit_count++;
+      return Lease(std::move(pad), this, reservation);
+    }
+    miss_count++;
+  }
+
+  // Fault every page in now, on the thread that is going to use them.
+  Scratchpad pad(bytes, allocation);
+  std::memset(pad.data(), 0, pad.size());
+  return Lease(std::move(pad), this, reservation);
+}
+
+std::vector<ScryptContext::Lease> ScryptContext::take(
+    const MemoryBudget& budget, size_t bytes, size_t count) {
+  std::vector<Lease> leases;
+  if (&budget != &charged) {
+    return leases;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  evict_idle(std::chrono::steady_clock::now());
+  for (auto it = cache.begin(); it != cache.end() && leases.size() < count;) {
+    if (it->pad.size() != bytes) {
+      ++it;
+      continue;
+    }
+    cached -= bytes;
+    hit_count++;
+    leases.emplace_back(std::move(it->pad), this, nullptr, true);
+    it = cache.erase(it);
+  }
+  return leases;
+}
+
+void ScryptContext::release(Scratchpad pad,
+                            MemoryBudget::Reservation* reservation,
+                            bool charged_already) {
+  if (wipe) {
+    OPENSSL_cleanse(pad.data(), pad.size());
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(mutex);
+  evict_idle(now);
+
+  // Make room by dropping the least recently returned scratchpads.
+  while (!cache.empty() && cached + pad.size() > max_cached) {
+    evict_oldest();
+  }
+  // The charge comes with the lease, from the reservation of its borrower,
+  // or from what the budget has free.
+  bool kept =
+      pad.size() <= max_cached &&
+      (charged_already ||
+       (reservation && reservation->transfer(charged, pad.size())) ||
+       charged.acquire(pad.size(), MemoryBudget::Admission::FailFast));
+  if (!kept) {
+    if (charged_already) {
+      charged.release(pad.size());
+    }
+    return;
+  }
+
+  cached += pad.size();
+  cache.push_front({std::move(pad), std::this_thread::get_id(), now});
+}
+
+void ScryptContext::evict_idle(std::chrono::steady_clock::time_point now) {
+  while (!cache.empty() && now - cache.back().returned > idle_timeout) {
+    evict_oldest();
+  }
+}
+
+void ScryptContext::evict_oldest() {
+  size_t size = cache.back().pad.size();
+  cache.pop_back();
+  cached -= size;
+  charged.release(size);
+}
+
+void ScryptContext::trim() {
+  std::lock_guard<std::mutex> lock(mutex);
+  evict_idle(std::chrono::steady_clock::now());
+}
+
+void ScryptContext::make_room(const MemoryBudget& budget, size_t bytes) {
+  if (&budget != &charged) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  while (!cache.empty() && (budget.in_use() > budget.limit() ||
+                            bytes > budget.limit() - budget.in_use())) {
+    evict_oldest();
+  }
+}
+
+void ScryptContext::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  while (!cache.empty()) {
+    evict_oldest();
+  }
+}
+
+size_t ScryptContext::cached_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return cached;
+}
+
+uint64_t ScryptContext::hits() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return hit_count;
+}
+
+uint64_t ScryptContext::misses() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return miss_count;
+}
+
+//
+// Lease
+//
+
+ScryptContext::Lease::Lease(Scratchpad p, ScryptContext* o,
+                            MemoryBudget::Reservation* r, bool c)
+    : owner{o}, pad{std::move(p)}, reservation{r}, charged{c} {}
+
+ScryptContext::Lease::Lease(Lease&& other) noexcept
+    : owner{other.owner},
+      pad{std::move(other.pad)},
+      reservation{other.reservation},
+      charged{other.charged} {
+  other.owner = nullptr;
+}
+
+ScryptContext::Lease::~Lease() {
+  if (owner) {
+    owner->release(std::move(pad), reservation, charged);
+  }
+}
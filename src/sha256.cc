@@ -0,0 +1,447 @@
+// sha256.cc - The SHA-256 compression function, scalar, with SHA-NI, and
+// multi-buffer on SSE2, AVX2 and AVX-512.
+
+#include "sha256.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86 1
+#endif
+
+const uint32_t SHA256::initial_state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                           0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                           0x1f83d9ab, 0x5be0cd19};
+
+namespace {
+
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+uint32_t LoadBigEndian(const std::byte* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+         (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+void StoreBigEndian(std::byte* p, uint32_t x) {
+  for (int b = 0; b < 4; ++b) {
+    p[b] = static_cast<std::byte>(x >> (24 - 8 * b));
+  }
+}
+
+uint32_t RotateRight(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+//
+// One state at a time
+//
+
+void compress_scalar(uint32_t state[8], const std::byte* blocks, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    const std::byte* block = blocks + 64 * i;
+    uint32_t W[64];
+    for (int t = 0; t < 16; ++t) {
+      W[t] = LoadBigEndian(block + 4 * t);
+    }
+    for (int t = 16; t < 64; ++t) {
+      uint32_t s0 = RotateRight(W[t - 15], 7) ^ RotateRight(W[t - 15], 18) ^
+                    (W[t - 15] >> 3);
+      uint32_t s1 = RotateRight(W[t - 2], 17) ^ RotateRight(W[t - 2], 19) ^
+                    (W[t - 2] >> 10);
+      W[t] = W[t - 16] + s0 + W[t - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int t = 0; t < 64; ++t) {
+      uint32_t S1 = RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t T1 = h + S1 + ch + K[t] + W[t];
+      uint32_t S0 = RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t T2 = S0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + T1;
+      d = c;
+      c = b;
+      b = a;
+      a = T1 + T2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+#ifdef SHA256_X86
+
+// The SHA extensions keep the state as ABEF and CDGH, and run four rounds on
+// each group of four message words, two at a time.
+__attribute__((target("sha,sse4.1,ssse3"))) void compress_shani(
+    uint32_t state[8], const std::byte* blocks, size_t n) {
+  const __m128i byteswap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state));
+  __m128i state1 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4));
+  tmp = _mm_shuffle_epi32(tmp, 0xb1);        // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1b);  // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);       // CDGH
+
+  for (size_t i = 0; i < n; ++i) {
+    const __m128i* block = reinterpret_cast<const __m128i*>(blocks + 64 * i);
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+    __m128i msg[4];
+
+#pragma GCC unroll 16
+    for (int g = 0; g < 16; ++g) {
+      if (g < 4) {
+        msg[g] = _mm_shuffle_epi8(_mm_loadu_si128(block + g), byteswap);
+      }
+      __m128i m = _mm_add_epi32(
+          msg[g % 4],
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(K + 4 * g)));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+      if (g >= 3 && g <= 14) {
+        // The next four words of the schedule.
+        __m128i next = _mm_add_epi32(
+            msg[(g + 1) % 4], _mm_alignr_epi8(msg[g % 4], msg[(g + 3) % 4], 4));
+        msg[(g + 1) % 4] = _mm_sha256msg2_epu32(next, msg[g % 4]);
+      }
+      m = _mm_shuffle_epi32(m, 0x0e);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+      if (g >= 1 && g <= 12) {
+        msg[(g + 3) % 4] = _mm_sha256msg1_epu32(msg[(g + 3) % 4], msg[g % 4]);
+      }
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b);        // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xb1);     // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xf0);  // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);     // HGFE
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), state1);
+}
+
+#endif  // SHA256_X86
+
+//
+// These compress several independent states at once, one state per SIMD
+// lane. The states are transposed: word k of lane l is at states[k * lanes +
+// l], so every vector register holds the same word of each state and the
+// rounds are the scalar ones written on registers.
+//
+
+// Scalar fallback: four lanes, one at a time.
+void compress_wide_scalar(uint32_t* states, const std::byte* const* blocks) {
+  const size_t lanes = 4;
+  for (size_t l = 0; l < lanes; ++l) {
+    uint32_t x[8];
+    for (size_t k = 0; k < 8; ++k) {
+      x[k] = states[k * lanes + l];
+    }
+    compress_scalar(x, blocks[l], 1);
+    for (size_t k = 0; k < 8; ++k) {
+      states[k * lanes + l] = x[k];
+    }
+  }
+}
+
+#ifdef SHA256_X86
+
+// Transposes the message words into W, runs the 64 rounds and adds the input
+// state back in. CH, MAJ and XOR3 are the three-input boolean functions.
+#define SHA256_WIDE_KERNEL(VECTOR, LOAD, STORE, SET1, ADD, XOR3, CH, MAJ,    \
+                           ROTR, SHR)                                        \
+  const size_t lanes = sizeof(VECTOR) / sizeof(uint32_t);                    \
+  alignas(64) uint32_t words[16 * lanes];                                    \
+  for (size_t t = 0; t < 16; ++t) {                                          \
+    for (size_t l = 0; l < lanes; ++l) {                                     \
+      words[t * lanes + l] = LoadBigEndian(blocks[l] + 4 * t);               \
+    }                                                                        \
+  }                                                                          \
+  VECTOR W[16], s[8];                                                        \
+  for (int t = 0; t < 16; ++t) {                                             \
+    W[t] = LOAD(reinterpret_cast<const VECTOR*>(words + t * lanes));         \
+  }                                                                          \
+  for (int k = 0; k < 8; ++k) {                                              \
+    s[k] = LOAD(reinterpret_cast<const VECTOR*>(states + k * lanes));        \
+  }                                                                          \
+  VECTOR a = s[0], b = s[1], c = s[2], d = s[3];                             \
+  VECTOR e = s[4], f = s[5], g = s[6], h = s[7];                             \
+  _Pragma("GCC unroll 64") for (int t = 0; t < 64; ++t) {                    \
+    if (t >= 16) {                                                           \
+      VECTOR w15 = W[(t - 15) & 15], w2 = W[(t - 2) & 15];                   \
+      VECTOR s0 = XOR3(ROTR(w15, 7), ROTR(w15, 18), SHR(w15, 3));            \
+      VECTOR s1 = XOR3(ROTR(w2, 17), ROTR(w2, 19), SHR(w2, 10));             \
+      W[t & 15] = ADD(ADD(W[t & 15], s0), ADD(W[(t - 7) & 15], s1));         \
+    }                                                                        \
+    VECTOR S1 = XOR3(ROTR(e, 6), ROTR(e, 11), ROTR(e, 25));                  \
+    VECTOR T1 = ADD(ADD(h, S1), ADD(CH(e, f, g),                             \
+                                    ADD(SET1(static_cast<int>(K[t])),        \
+                                        W[t & 15])));                        \
+    VECTOR S0 = XOR3(ROTR(a, 2), ROTR(a, 13), ROTR(a, 22));                  \
+    VECTOR T2 = ADD(S0, MAJ(a, b, c));                                       \
+    h = g;                                                                   \
+    g = f;                                                                   \
+    f = e;                                                                   \
+    e = ADD(d, T1);                                                          \
+    d = c;                                                                   \
+    c = b;                                                                   \
+    b = a;                                                                   \
+    a = ADD(T1, T2);                                                         \
+  }                                                                          \
+  VECTOR out[8] = {a, b, c, d, e, f, g, h};                                  \
+  for (int k = 0; k < 8; ++k) {                                              \
+    STORE(reinterpret_cast<VECTOR*>(states + k * lanes), ADD(s[k], out[k])); \
+  }
+
+#define SHA256_XOR3_SSE2(x, y, z) _mm_xor_si128(_mm_xor_si128(x, y), z)
+#define SHA256_CH_SSE2(x, y, z) \
+  _mm_xor_si128(_mm_and_si128(x, y), _mm_andnot_si128(x, z))
+#define SHA256_MAJ_SSE2(x, y, z) \
+  _mm_or_si128(_mm_and_si128(x, y), _mm_and_si128(z, _mm_or_si128(x, y)))
+#define SHA256_ROTR_SSE2(x, n) \
+  _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - (n)))
+
+#define SHA256_XOR3_AVX2(x, y, z) \
+  _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+#define SHA256_CH_AVX2(x, y, z) \
+  _mm256_xor_si256(_mm256_and_si256(x, y), _mm256_andnot_si256(x, z))
+#define SHA256_MAJ_AVX2(x, y, z)          \
+  _mm256_or_si256(_mm256_and_si256(x, y), \
+                  _mm256_and_si256(z, _mm256_or_si256(x, y)))
+#define SHA256_ROTR_AVX2(x, n) \
+  _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+#define SHA256_XOR3_AVX512(x, y, z) _mm512_ternarylogic_epi32(x, y, z, 0x96)
+#define SHA256_CH_AVX512(x, y, z) _mm512_ternarylogic_epi32(x, y, z, 0xca)
+#define SHA256_MAJ_AVX512(x, y, z) _mm512_ternarylogic_epi32(x, y, z, 0xe8)
+// The masked forms, with x itself as the pass-through under a full mask: the
+// plain ones take an undefined vector there, which GCC reports as used
+// uninitialized.
+#define SHA256_ROTR_AVX512(x, n) _mm512_mask_ror_epi32(x, 0xffff, x, n)
+#define SHA256_SHR_AVX512(x, n) _mm512_mask_srli_epi32(x, 0xffff, x, n)
+
+__attribute__((target("sse2"))) void compress_wide_sse2(
+    uint32_t* states, const std::byte* const* blocks) {
+  SHA256_WIDE_KERNEL(__m128i, _mm_loadu_si128, _mm_storeu_si128,
+                     _mm_set1_epi32, _mm_add_epi32, SHA256_XOR3_SSE2,
+                     SHA256_CH_SSE2, SHA256_MAJ_SSE2, SHA256_ROTR_SSE2,
+                     _mm_srli_epi32)
+}
+
+__attribute__((target("avx2"))) void compress_wide_avx2(
+    uint32_t* states, const std::byte* const* blocks) {
+  SHA256_WIDE_KERNEL(__m256i, _mm256_loadu_si256, _mm256_storeu_si256,
+                     _mm256_set1_epi32, _mm256_add_epi32, SHA256_XOR3_AVX2,
+                     SHA256_CH_AVX2, SHA256_MAJ_AVX2, SHA256_ROTR_AVX2,
+                     _mm256_srli_epi32)
+}
+
+__attribute__((target("avx512f"))) void compress_wide_avx512(
+    uint32_t* states, const std::byte* const* blocks) {
+  SHA256_WIDE_KERNEL(__m512i, _mm512_loadu_si512, _mm512_storeu_si512,
+                     _mm512_set1_epi32, _mm512_add_epi32, SHA256_XOR3_AVX512,
+                     SHA256_CH_AVX512, SHA256_MAJ_AVX512, SHA256_ROTR_AVX512,
+                     SHA256_SHR_AVX512)
+}
+
+#endif  // SHA256_X86
+
+typedef void (*CompressFunction)(uint32_t state[8], const std::byte* blocks,
+                                 size_t n);
+typedef void (*WideCompressFunction)(uint32_t* states,
+                                     const std::byte* const* blocks);
+
+// A kernel: its one-state compression, its multi-lane one and lane count.
+struct SHA256Kernel {
+  SHA256::Kernel kind;
+  CompressFunction compress;
+  WideCompressFunction wide;
+  size_t lanes;
+};
+
+bool HasSHANI() {
+#ifdef SHA256_X86
+  __builtin_cpu_init();
+  unsigned int eax, ebx, ecx, edx;
+  return __builtin_cpu_supports("sse4.1") &&
+         __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+         (ebx & bit_SHA) != 0;
+#else
+  return false;
+#endif
+}
+
+// SHA-NI goes with every SIMD kernel where the CPU has it.
+CompressFunction BestCompress() {
+#ifdef SHA256_X86
+  if (HasSHANI()) {
+    return compress_shani;
+  }
+#endif
+  return compress_scalar;
+}
+
+const SHA256Kernel* kernelEntry(SHA256::Kernel k) {
+  static const SHA256Kernel scalar_kernel{SHA256::Kernel::Scalar,
+                                          compress_scalar,
+                                          compress_wide_scalar, 4};
+#ifdef SHA256_X86
+  static const SHA256Kernel sse2_kernel{SHA256::Kernel::SSE2, BestCompress(),
+                                        compress_wide_sse2, 4};
+  static const SHA256Kernel avx2_kernel{SHA256::Kernel::AVX2, BestCompress(),
+                                        compress_wide_avx2, 8};
+  static const SHA256Kernel avx512_kernel{
+      SHA256::Kernel::AVX512, BestCompress(), compress_wide_avx512, 16};
+#endif
+  switch (k) {
+#ifdef SHA256_X86
+    case SHA256::Kernel::SSE2:
+      return &sse2_kernel;
+    case SHA256::Kernel::AVX2:
+      return &avx2_kernel;
+    case SHA256::Kernel::AVX512:
+      return &avx512_kernel;
+#endif
+    case SHA256::Kernel::Scalar:
+      return &scalar_kernel;
+    default:
+      return nullptr;
+  }
+}
+
+bool kernelSupported(SHA256::Kernel k) {
+  switch (k) {
+    case SHA256::Kernel::Auto:
+    case SHA256::Kernel::Scalar:
+      return true;
+#ifdef SHA256_X86
+    case SHA256::Kernel::SSE2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse2");
+    case SHA256::Kernel::AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+    case SHA256::Kernel::AVX512:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+      return false;
+  }
+}
+
+// The best kernel the CPU supports.
+SHA256::Kernel bestKernel() {
+  for (auto k : {SHA256::Kernel::AVX512, SHA256::Kernel::AVX2,
+                 SHA256::Kernel::SSE2}) {
+    if (kernelSupported(k)) {
+      return k;
+    }
+  }
+  return SHA256::Kernel::Scalar;
+}
+
+// Selected once, at load time, from CPUID.
+std::atomic<const SHA256Kernel*> active_kernel{kernelEntry(bestKernel())};
+
+}  // namespace
+
+void SHA256::compress(uint32_t state[8], const std::byte* blocks, size_t n) {
+  active_kernel.load(std::memory_order_relaxed)->compress(state, blocks, n);
+}
+
+void SHA256::compress_lanes(uint32_t* states,
+                            const std::byte* const* blocks) {
+  active_kernel.load(std::memory_order_relaxed)->wide(states, blocks);
+}
+
+size_t SHA256::lanes() {
+  return active_kernel.load(std::memory_order_relaxed)->lanes;
+}
+
+void SHA256::hash(const std::byte* message, size_t length,
+                  std::byte* digest) {
+  uint32_t state[8];
+  std::memcpy(state, initial_state, sizeof(state));
+  compress(state, message, length / 64);
+
+  // The rest of the message, 0x80, zeros and the length in bits.
+  std::byte last[128] = {};
+  size_t rest = length % 64;
+  std::memcpy(last, message + length - rest, rest);
+  last[rest] = std::byte{0x80};
+  size_t last_length = (rest + 9 <= 64) ? 64 : 128;
+  uint64_t bits = static_cast<uint64_t>(length) * 8;
+  StoreBigEndian(last + last_length - 8, static_cast<uint32_t>(bits >> 32));
+  StoreBigEndian(last + last_length - 4, static_cast<uint32_t>(bits));
+  compress(state, last, last_length / 64);
+
+  for (int k = 0; k < 8; ++k) {
+    StoreBigEndian(digest + 4 * k, state[k]);
+  }
+}
+
+bool SHA256::set_kernel(Kernel k) {
+  if (!kernelSupported(k)) {
+    return false;
+  }
+  if (k == Kernel::Auto) {
+    k = bestKernel();
+  }
+  active_kernel.store(kernelEntry(k));
+  return true;
+}
+
+SHA256::Kernel SHA256::kernel() { return active_kernel.load()->kind; }
+
+bool SHA256::kernel_supported(Kernel k) { return kernelSupported(k); }
+
+const char* SHA256::kernel_name(Kernel k) {
+  switch (k) {
+    case Kernel::Auto:
+      return "auto";
+    case Kernel::Scalar:
+      return "scalar";
+    case Kernel::SSE2:
+      return "sse2";
+    case Kernel::AVX2:
+      return "avx2";
+    case Kernel::AVX512:
+      return "avx512";
+  }
+  return "unknown";
+}
@@ -0,0 +1,226 @@
+// thread_pool.cc - A work-stealing thread pool for the ROMix lanes.
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+namespace {
+const size_t not_a_worker = std::numeric_limits<size_t>::max();
+
+// The pool the current thread works for, if any, and its index in it.
+thread_local ThreadPool* current_pool = nullptr;
+thread_local size_t current_worker = not_a_worker;
+}  // namespace
+
+ThreadPool::ThreadPool(size_t workers) : local_tasks{0}, stopping{false} {
+  workers = std::max<size_t>(workers, 1);
+  posted = std::make_unique<TaskGroup>(*this);
+  for (size_t i = 0; i < workers; ++i) {
+    queues.push_back(std::make_unique<WorkerQueue>());
+  }
+  for (size_t i = 0; i < workers; ++i) {
+    threads.emplace_back([this, i] { work(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  posted->wait();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+std::shared_ptr<ThreadPool> ThreadPool::shared() {
+  static std::shared_ptr<ThreadPool> pool = std::make_shared<ThreadPool>();
+  return pool;
+}
+
+void ThreadPool::post(std::function<void()> task) {
+  posted->run(std::move(task));
+}
+
+void ThreadPool::submit(TaskGroup* group, std::function<void()> function) {
+  if (current_pool == this) {
+    // From a worker: keep it local, idle workers will steal it.
+    {
+      std::lock_guard<std::mutex> lock(queues[current_worker]->mutex);
+      queues[current_worker]->tasks.push_back({std::move(function), group});
+    }
+    local_tasks++;
+    std::lock_guard<std::mutex> lock(mutex);
+    wake.notify_one();
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    group->pending.push_back(std::move(function));
+    if (!group->scheduled) {
+      group->scheduled = true;
+      ready.push_back(group);
+    }
+  }
+  wake.notify_one();
+}
+
+bool ThreadPool::pop_local(size_t worker, Task& task) {
+  WorkerQueue& queue = *queues[worker];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tasks.empty()) {
+    return false;
+  }
+  task = std::move(queue.tasks.back());
+  queue.tasks.pop_back();
+  local_tasks--;
+  return true;
+}
+
+bool ThreadPool::pop_ready(Task& task) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (ready.empty()) {
+    return false;
+  }
+
+  // Take one task from the group at the front, then send the group to the
+  // back of the line so the next task comes from another caller.
+  TaskGroup* group = ready.front();
+  ready.pop_front();
+  task = {std::move(group->pending.front()), group};
+  group->pending.pop_front();
+  if (group->pending.empty()) {
+    group->scheduled = false;
+  } else {
+    ready.push_back(group);
+  }
+  return true;
+}
+
+bool ThreadPool::steal(size_t thief, Task& task) {
+  for (size_t i = 1; i <= queues.size(); ++i) {
+    size_t victim =
+        (thief == not_a_worker) ? i - 1 : (thief + i) % queues.size();
+    if (victim == thief) {
+      continue;
+    }
+    WorkerQueue& queue = *queues[victim];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      local_tasks--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::run(Task& task) {
+  task.function();
+  task.group->finish();
+}
+
+bool ThreadPool::try_run_one(size_t worker) {
+  Task task;
+  if ((worker != not_a_worker && pop_local(worker, task)) ||
+      pop_ready(task) || steal(worker, task)) {
+    run(task);
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::work(size_t worker) {
+  current_pool = this;
+  current_worker = worker;
+
+  while (true) {
+    if (try_run_one(worker)) {
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    wake.wait(lock,
+              [this] { return stopping || !ready.empty() || local_tasks > 0; });
+    if (stopping && ready.empty() && local_tasks == 0) {
+      return;
+    }
+  }
+}
+
+//
+// TaskGroup
+//
+
+ThreadPool::TaskGroup::TaskGroup(ThreadPool& p)
+    : pool{p}, scheduled{false}, outstanding{0} {}
+
+ThreadPool::TaskGroup::~TaskGroup() { wait(); }
+
+void ThreadPool::TaskGroup::run(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(done_mutex);
+    outstanding++;
+  }
+  pool.submit(this, std::move(task));
+}
+
+void ThreadPool::TaskGroup::finish() {
+  std::lock_guard<std::mutex> lock(done_mutex);
+  if (--outstanding == 0) {
+    done.notify_all();
+  }
+}
+
+void ThreadPool::TaskGroup::wait() {
+  bool on_worker = (current_pool == &pool);
+
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(done_mutex);
+      if (outstanding == 0) {
+        return;
+      }
+    }
+
+    // Run our own queued tasks rather than wait for a worker to get to them.
+    std::function<void()> task;
+    {
+      std::lock_guard<std::mutex> lock(pool.mutex);
+      if (!pending.empty()) {
+        task = std::move(pending.front());
+        pending.pop_front();
+        if (pending.empty() && scheduled) {
+          scheduled = false;
+          pool.ready.erase(
+              std::find(pool.ready.begin(), pool.ready.end(), this));
+        }
+      }
+    }
+    if (task) {
+      task();
+      finish();
+      continue;
+    }
+
+    // A worker waiting on a group must keep working, or groups nested inside
+    // tasks could leave every worker blocked.
+    if (on_worker && pool.try_run_one(current_worker)) {
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(done_mutex);
+    if (on_worker) {
+      done.wait_for(lock, std::chrono::milliseconds(1),
+                    [this] { return outstanding == 0; });
+    } else {
+      done.wait(lock, [this] { return outstanding == 0; });
+    }
+  }
+}
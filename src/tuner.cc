@@ -0,0 +1,169 @@
+// tuner.cc - Picks scrypt parameters by timing hashes on this machine.
+
+#include "tuner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "romix.h"
+
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+Tuner::Tuner(Scrypt s, size_t c) : scrypt{std::move(s)}, cores{c} {}
+
+Tuner::Measurement Tuner::measure(uint64_t cost_factor_N,
+                                  uint32_t block_size_factor_r,
+                                  uint32_t parallelization_factor_p,
+                                  unsigned concurrency, unsigned samples) {
+  concurrency = std::max(concurrency, 1u);
+  samples = std::max(samples, 1u);
+
+  const std::vector<std::byte> passphrase(16, std::byte{'p'});
+  const std::vector<std::byte> salt(16, std::byte{'s'});
+
+  std::vector<std::vector<nanoseconds>> times(concurrency);
+  std::vector<char> refused(concurrency, false);
+  auto run = [&](unsigned t) {
+    // Each thread hashes with a Scrypt of its own, sharing the pool and the
+    // memory budget.
+    Scrypt s = scrypt;
+    std::byte key[32];
+    for (unsigned i = 0; i < samples; i++) {
+      auto start = steady_clock::now();
+      if (!s.hash(passphrase.data(), passphrase.size(), salt.data(),
+                  salt.size(), cost_factor_N, block_size_factor_r,
+                  parallelization_factor_p, key, sizeof(key))) {
+        refused[t] = true;
+      }
+      times[t].push_back(steady_clock::now() - start);
+    }
+  };
+
+  auto start = steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < concurrency; t++) {
+    threads.emplace_back(run, t);
+  }
+  run(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> elapsed = steady_clock::now() - start;
+
+  Measurement m{cost_factor_N, block_size_factor_r, parallelization_factor_p,
+                concurrency, nanoseconds::max(), 0};
+
+  // A hash the memory budget refused did not run, so its time means
+  // nothing; the parameters count as too expensive.
+  if (std::find(refused.begin(), refused.end(), true) != refused.end()) {
+    return m;
+  }
+
+  std::vector<nanoseconds> all;
+  for (auto& t : times) {
+    all.insert(all.end(), t.begin(), t.end());
+  }
+  std::nth_element(all.begin(), all.begin() + all.size() / 2, all.end());
+  m.latency = all[all.size() / 2];
+  m.hashes_per_second = all.size() / elapsed.count();
+  return m;
+}
+
+Tuner::Result Tuner::tune(const Target& target) {
+  unsigned concurrency = std::max(target.concurrency, 1u);
+  uint32_t r = target.block_size_factor_r;
+  nanoseconds latency = target.latency;
+
+  // The concurrent hashes split the memory and the cores evenly.
+  size_t memory = target.memory / concurrency;
+  size_t lanes = std::max<size_t>(cores / concurrency, 1);
+
+  Result result{};
+  result.block_size_factor_r = r;
+  auto time = [&](uint64_t N, uint32_t p) {
+    Measurement m = measure(N, r, p, concurrency, target.samples);
+    result.measurements.push_back(m);
+    return m;
+  };
+
+  // Whether p lanes with cost N fit in the memory of one hash. RFC 7914 also
+  // wants N < 2^(128 * r / 8).
+  auto fits = [&](uint64_t N, uint64_t p) {
+    if (16 * uint64_t{r} < 64 && N >= uint64_t{1} << (16 * r)) {
+      return false;
+    }
+    if (N >= SIZE_MAX / (128 * size_t{r})) {
+      return false;
+    }
+    return romix::ROMixScratchSize(r, N) <= memory / p;
+  };
+
+  //
+  // 1. Time one lane, doubling N until a hash takes long enough to
+  //    extrapolate from
+  //
+
+  uint64_t N = 2;
+  while (N < 1024 && fits(2 * N, 1)) {
+    N *= 2;
+  }
+  Measurement m = time(N, 1);
+  while (m.latency < latency / 8 && fits(2 * N, 1)) {
+    N *= 2;
+    m = time(N, 1);
+  }
+
+  //
+  // 2. Predict the largest N within the target, since the time of a hash is
+  //    linear in N, and give every core a lane if the memory allows it
+  //
+
+  auto predicted = [&](uint64_t n) {
+    return m.latency.count() * (static_cast<double>(n) / m.cost_factor_N);
+  };
+  while (fits(2 * N, 1) && predicted(2 * N) <= latency.count()) {
+    N *= 2;
+  }
+  uint32_t p = 1;
+  while (p < lanes && p < UINT32_MAX && fits(N, p + 1)) {
+    p++;
+  }
+
+  //
+  // 3. Check the prediction, backing off until it meets the target or
+  //    growing N while it still does
+  //
+
+  m = time(N, p);
+  bool shrunk = false;
+  while (m.latency > latency && (p > 1 || N > 2)) {
+    // Lanes that did not run in parallel go first.
+    if (p > 1) {
+      p /= 2;
+    } else {
+      N /= 2;
+    }
+    m = time(N, p);
+    shrunk = true;
+  }
+  while (!shrunk && m.latency <= latency && fits(2 * N, p)) {
+    Measurement next = time(2 * N, p);
+    if (next.latency > latency) {
+      break;
+    }
+    N *= 2;
+    m = next;
+  }
+
+  result.cost_factor_N = N;
+  result.parallelization_factor_p = p;
+  result.met = m.latency <= latency && fits(N, p);
+  result.chosen = m;
+  return result;
+}
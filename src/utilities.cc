@@ -3,39 +3,298 @@
 #include "utilities.h"
 
 #include <cstddef>
-#include <iomanip>
-#include <iostream>
+#include <cstdint>
 #include <sstream>
 #include <string>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
+namespace {
+
+constexpr char hex_digits[] = "0123456789abcdef";
+constexpr char base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// The digits of every byte, and the value of every character, or -1.
+struct CodecTables {
+  char hex_pairs[256][2];
+  int8_t hex_values[256];
+  int8_t base64_values[256];
+};
+
+constexpr CodecTables MakeCodecTables() {
+  CodecTables t{};
+  for (int b = 0; b < 256; b++) {
+    t.hex_pairs[b][0] = hex_digits[b >> 4];
+    t.hex_pairs[b][1] = hex_digits[b & 15];
+    t.hex_values[b] = -1;
+    t.base64_values[b] = -1;
+  }
+  for (int d = 0; d < 10; d++) {
+    t.hex_values['0' + d] = static_cast<int8_t>(d);
+  }
+  for (int d = 0; d < 6; d++) {
+    t.hex_values['a' + d] = static_cast<int8_t>(10 + d);
+    t.hex_values['A' + d] = static_cast<int8_t>(10 + d);
+  }
+  for (int d = 0; d < 64; d++) {
+    t.base64_values[static_cast<unsigned char>(base64_alphabet[d])] =
+        static_cast<int8_t>(d);
+  }
+  return t;
+}
+
+constexpr CodecTables tables = MakeCodecTables();
+
+int HexValue(char c) { return tables.hex_values[static_cast<uint8_t>(c)]; }
+
+int Base64Value(char c) {
+  return tables.base64_values[static_cast<uint8_t>(c)];
+}
+
+bool IsSpace(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+utilities::Decoded Failed(utilities::CodecError error, size_t position,
+                          size_t length) {
+  return {length, error, position};
+}
+
+// Compact hex of the 16-byte chunks of in, 32 digits at a time; returns
+// how many bytes it encoded.
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3"))) size_t EncodeHexSSSE3(const std::byte* in,
+                                                       size_t n, char* out) {
+  const __m128i digits = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(hex_digits));
+  const __m128i low_nibbles = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), low_nibbles);
+    __m128i lo = _mm_and_si128(x, low_nibbles);
+    hi = _mm_shuffle_epi8(digits, hi);
+    lo = _mm_shuffle_epi8(digits, lo);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i),
+                     _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i + 16),
+                     _mm_unpackhi_epi8(hi, lo));
+  }
+  return i;
+}
+
+bool HasSSSE3() {
+  static const bool supported = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+  }();
+  return supported;
+}
+#else
+size_t EncodeHexSSSE3(const std::byte*, size_t, char*) { return 0; }
+bool HasSSSE3() { return false; }
+#endif
+
+}  // namespace
+
 utilities::utilities() {}
 
-// Given a vector of bytes, returns a hex string of the bytes
-string utilities::bytesToHex(vector<byte> data) {
-  stringstream ss;
-  ss << std::hex;
+size_t utilities::hexLength(size_t n, HexFormat format) {
+  return format == HexFormat::Compact ? 2 * n : 3 * n + n / 16 + 1;
+}
 
-  int col = 0;
-  for (byte data_item : data) {
-    int data_int = static_cast<int>(data_item);
-    ss << setw(1) << ((data_int & 0xf0) >> 4);
-    ss << setw(1) << (data_int & 0x0f);
-    ss << " ";
-    col++;
-    if ((col % 16) == 0) {
-      ss << endl;
+size_t utilities::encodeHex(const std::byte* in, size_t n, char* out,
+                            HexFormat format) {
+  if (format == HexFormat::Compact) {
+    size_t i = HasSSSE3() ? EncodeHexSSSE3(in, n, out) : 0;
+    for (; i < n; i++) {
+      const char* pair = tables.hex_pairs[static_cast<uint8_t>(in[i])];
+      out[2 * i] = pair[0];
+      out[2 * i + 1] = pair[1];
     }
+    return 2 * n;
   }
-  ss << endl;
 
-  return ss.str();
+  char* o = out;
+  for (size_t i = 0; i < n; i++) {
+    const char* pair = tables.hex_pairs[static_cast<uint8_t>(in[i])];
+    *o++ = pair[0];
+    *o++ = pair[1];
+    *o++ = ' ';
+    if (i % 16 == 15) {
+      *o++ = '\n';
+    }
+  }
+  *o++ = '\n';
+  return o - out;
+}
+
+utilities::Decoded utilities::decodeHex(const char* in, size_t n,
+                                        std::byte* out, size_t capacity,
+                                        HexFormat format) {
+  if (format == HexFormat::Compact) {
+    if (n % 2 != 0) {
+      return Failed(CodecError::InvalidLength, n, 0);
+    }
+    if (n / 2 > capacity) {
+      return Failed(CodecError::Overflow, 0, 0);
+    }
+    for (size_t i = 0; i < n; i += 2) {
+      int hi = HexValue(in[i]);
+      int lo = HexValue(in[i + 1]);
+      if ((hi | lo) < 0) {
+        return Failed(CodecError::InvalidCharacter, hi < 0 ? i : i + 1,
+                      i / 2);
+      }
+      out[i / 2] = static_cast<std::byte>((hi << 4) | lo);
+    }
+    return {n / 2, CodecError::None, 0};
+  }
+
+  size_t o = 0;
+  size_t i = 0;
+  while (true) {
+    while (i < n && IsSpace(in[i])) {
+      i++;
+    }
+    if (i == n) {
+      return {o, CodecError::None, 0};
+    }
+    if (i + 1 == n) {
+      return Failed(HexValue(in[i]) < 0 ? CodecError::InvalidCharacter
+                                        : CodecError::InvalidLength,
+                    i, o);
+    }
+    int hi = HexValue(in[i]);
+    int lo = HexValue(in[i + 1]);
+    if ((hi | lo) < 0) {
+      return Failed(CodecError::InvalidCharacter, hi < 0 ? i : i + 1, o);
+    }
+    // Bytes are separated by whitespace or by nothing, never split.
+    if (o == capacity) {
+      return Failed(CodecError::Overflow, i, o);
+    }
+    out[o++] = static_cast<std::byte>((hi << 4) | lo);
+    i += 2;
+  }
+}
+
+size_t utilities::base64Length(size_t n, Base64Format format) {
+  return format == Base64Format::Unpadded ? (4 * n + 2) / 3
+                                          : (n + 2) / 3 * 4;
+}
+
+size_t utilities::encodeBase64(const std::byte* in, size_t n, char* out,
+                               Base64Format format) {
+  char* o = out;
+  size_t i = 0;
+  for (; i + 3 <= n; i += 3) {
+    uint32_t v = (static_cast<uint32_t>(in[i]) << 16) |
+                 (static_cast<uint32_t>(in[i + 1]) << 8) |
+                 static_cast<uint32_t>(in[i + 2]);
+    *o++ = base64_alphabet[v >> 18];
+    *o++ = base64_alphabet[(v >> 12) & 63];
+    *o++ = base64_alphabet[(v >> 6) & 63];
+    *o++ = base64_alphabet[v & 63];
+  }
+  if (i < n) {
+    uint32_t v = static_cast<uint32_t>(in[i]) << 16;
+    if (i + 1 < n) {
+      v |= static_cast<uint32_t>(in[i + 1]) << 8;
+    }
+    *o++ = base64_alphabet[v >> 18];
+    *o++ = base64_alphabet[(v >> 12) & 63];
+    if (i + 1 < n) {
+      *o++ = base64_alphabet[(v >> 6) & 63];
+    } else if (format == Base64Format::Padded) {
+      *o++ = '=';
+    }
+    if (format == Base64Format::Padded) {
+      *o++ = '=';
+    }
+  }
+  return o - out;
+}
+
+utilities::Decoded utilities::decodeBase64(const char* in, size_t n,
+                                           std::byte* out, size_t capacity,
+                                           Base64Format format) {
+  // Up to two '=' end a padded string; anywhere else they are invalid.
+  size_t chars = n;
+  if (format == Base64Format::Padded) {
+    if (n % 4 != 0) {
+      return Failed(CodecError::InvalidLength, n, 0);
+    }
+    while (chars > 0 && n - chars < 2 && in[chars - 1] == '=') {
+      chars--;
+    }
+  }
+  if (chars % 4 == 1) {
+    return Failed(CodecError::InvalidLength, chars, 0);
+  }
+  size_t length = chars / 4 * 3 + (chars % 4 == 0 ? 0 : chars % 4 - 1);
+  if (length > capacity) {
+    return Failed(CodecError::Overflow, 0, 0);
+  }
+
+  auto invalid_at = [in](size_t from) {
+    while (Base64Value(in[from]) >= 0) {
+      from++;
+    }
+    return from;
+  };
+
+  size_t o = 0;
+  size_t i = 0;
+  for (; i + 4 <= chars; i += 4) {
+    int a = Base64Value(in[i]);
+    int b = Base64Value(in[i + 1]);
+    int c = Base64Value(in[i + 2]);
+    int d = Base64Value(in[i + 3]);
+    if ((a | b | c | d) < 0) {
+      return Failed(CodecError::InvalidCharacter, invalid_at(i), o);
+    }
+    uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+    out[o++] = static_cast<std::byte>(v >> 16);
+    out[o++] = static_cast<std::byte>(v >> 8);
+    out[o++] = static_cast<std::byte>(v);
+  }
+
+  size_t rest = chars - i;
+  if (rest > 0) {
+    int a = Base64Value(in[i]);
+    int b = Base64Value(in[i + 1]);
+    int c = rest == 3 ? Base64Value(in[i + 2]) : 0;
+    if ((a | b | c) < 0) {
+      return Failed(CodecError::InvalidCharacter, invalid_at(i), o);
+    }
+    uint32_t v = (a << 18) | (b << 12) | (c << 6);
+    // Only the canonical encoding is accepted.
+    if ((rest == 2 && (v & 0xffff) != 0) || (rest == 3 && (v & 0xff) != 0)) {
+      return Failed(CodecError::NonCanonical, i + rest - 1, o);
+    }
+    out[o++] = static_cast<std::byte>(v >> 16);
+    if (rest == 3) {
+      out[o++] = static_cast<std::byte>(v >> 8);
+    }
+  }
+  return {o, CodecError::None, 0};
+}
+
+// Given a vector of bytes, returns a hex string of the bytes
+string utilities::bytesToHex(const vector<byte>& data) {
+  string hex(hexLength(data.size(), HexFormat::Spaced), '\0');
+  encodeHex(data.data(), data.size(), hex.data(), HexFormat::Spaced);
+  return hex;
 }
 
 // Given a hex string, return a vector of bytes.
-// Adapted from https://stackoverflow.com/a/3221193
-std::vector<std::byte> utilities::hexToBytes(std::string hex_string) {
+std::vector<std::byte> utilities::hexToBytes(const std::string& hex_string) {
   std::istringstream hex_string_stream(hex_string);
   std::vector<std::byte> data;
 
@@ -47,6 +306,16 @@ std::vector<std::byte> utilities::hexToBytes(std::string hex_string) {
   return data;
 }
 
+// Given spaced hex, return its bytes up to the first error.
+std::vector<std::byte> utilities::hexToBytesStrict(
+    const std::string& hex_string) {
+  std::vector<std::byte> data(hex_string.size() / 2);
+  Decoded decoded = decodeHex(hex_string.data(), hex_string.size(),
+                              data.data(), data.size(), HexFormat::Spaced);
+  data.resize(decoded.length);
+  return data;
+}
+
 // Given a string, return the corresponding vector of bytes.
 std::vector<std::byte> utilities::stringToBytes(std::string s) {
   std::vector<std::byte> data;
@@ -0,0 +1,274 @@
+// verify_cache.cc - A cache of successful password checks.
+
+#include "verify_cache.h"
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+
+#include "sha256.h"
+
+namespace {
+
+void StoreBigEndian(std::byte* out, uint32_t x) {
+  for (int b = 0; b < 4; ++b) {
+    out[b] = static_cast<std::byte>(x >> (24 - 8 * b));
+  }
+}
+
+// SHA-256 over a message fed in pieces, from a state that has already
+// compressed prefix_length bytes.
+class Hasher {
+  uint32_t state[8];
+  std::byte buffer[64];
+  size_t buffered;
+  uint64_t length;
+
+ public:
+  Hasher(const uint32_t start[8], uint64_t prefix_length)
+      : buffered{0}, length{prefix_length} {
+    std::memcpy(state, start, sizeof(state));
+  }
+
+  void update(const void* data, size_t n) {
+    if (n == 0) {
+      return;
+    }
+    auto in = static_cast<const std::byte*>(data);
+    length += n;
+    if (buffered > 0) {
+      size_t take = std::min(64 - buffered, n);
+      std::memcpy(buffer + buffered, in, take);
+      buffered += take;
+      in += take;
+      n -= take;
+      if (buffered < 64) {
+        return;
+      }
+      SHA256::compress(state, buffer, 1);
+      buffered = 0;
+    }
+    SHA256::compress(state, in, n / 64);
+    in += n / 64 * 64;
+    n %= 64;
+    std::memcpy(buffer, in, n);
+    buffered = n;
+  }
+
+  // 0x80, zeros and the length in bits, then the digest.
+  void finish(std::byte digest[32]) {
+    uint64_t bits = length * 8;
+    buffer[buffered++] = std::byte{0x80};
+    if (buffered > 56) {
+      std::memset(buffer + buffered, 0, 64 - buffered);
+      SHA256::compress(state, buffer, 1);
+      buffered = 0;
+    }
+    std::memset(buffer + buffered, 0, 56 - buffered);
+    StoreBigEndian(buffer + 56, static_cast<uint32_t>(bits >> 32));
+    StoreBigEndian(buffer + 60, static_cast<uint32_t>(bits));
+    SHA256::compress(state, buffer, 1);
+    for (int k = 0; k < 8; ++k) {
+      StoreBigEndian(digest + 4 * k, state[k]);
+    }
+  }
+};
+
+int64_t Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+VerifyCache::VerifyCache(size_t capacity, std::chrono::milliseconds t,
+                         size_t shards)
+    : ttl{t},
+      buckets_per_shard{std::max<size_t>(
+          (capacity + std::max<size_t>(shards, 1) * ways - 1) /
+              (std::max<size_t>(shards, 1) * ways),
+          1)},
+      shard_list(std::max<size_t>(shards, 1)) {
+  for (Shard& shard : shard_list) {
+    shard.slots = std::make_unique<Slot[]>(buckets_per_shard * ways);
+  }
+
+  // HMAC keys the size of the secret are used as they are, padded with
+  // zeros to a block.
+  std::byte block[64] = {};
+  if (RAND_bytes(reinterpret_cast<unsigned char*>(block), 32) != 1) {
+    std::cout << "RAND_bytes failed.\n";
+    assert(false);
+  }
+  for (int round = 0; round < 2; ++round) {
+    auto pad = static_cast<std::byte>(round == 0 ? 0x36 : 0x5c);
+    std::byte padded[64];
+    for (int i = 0; i < 64; ++i) {
+      padded[i] = block[i] ^ pad;
+    }
+    uint32_t* state = round == 0 ? inner_state : outer_state;
+    std::memcpy(state, SHA256::initial_state, sizeof(inner_state));
+    SHA256::compress(state, padded, 1);
+    OPENSSL_cleanse(padded, sizeof(padded));
+  }
+  OPENSSL_cleanse(block, sizeof(block));
+}
+
+VerifyCache::~VerifyCache() {
+  OPENSSL_cleanse(inner_state, sizeof(inner_state));
+  OPENSSL_cleanse(outer_state, sizeof(outer_state));
+}
+
+// HMAC of the domain byte, the passphrase length as 8 little endian bytes,
+// the passphrase and the PHC string. Checks are domain 0, and the stored
+// hashes alone, for invalidate, domain 1.
+VerifyCache::Tag VerifyCache::mac(uint8_t domain, const std::byte* passphrase,
+                                  size_t passphrase_length,
+                                  const char* encoded,
+                                  size_t encoded_length) const {
+  uint8_t header[9] = {domain};
+  for (int b = 0; b < 8; ++b) {
+    header[1 + b] =
+        static_cast<uint8_t>(static_cast<uint64_t>(passphrase_length) >>
+                             (8 * b));
+  }
+  std::byte digest[32];
+  Hasher inner(inner_state, 64);
+  inner.update(header, sizeof(header));
+  inner.update(passphrase, passphrase_length);
+  inner.update(encoded, encoded_length);
+  inner.finish(digest);
+  Hasher outer(outer_state, 64);
+  outer.update(digest, sizeof(digest));
+  outer.finish(digest);
+
+  Tag tag;
+  std::memcpy(tag.words, digest, sizeof(tag.words));
+  return tag;
+}
+
+VerifyCache::Shard& VerifyCache::shard_of(const Tag& check) {
+  return shard_list[check.words[0] % shard_list.size()];
+}
+
+VerifyCache::Slot* VerifyCache::bucket_of(Shard& shard,
+                                          const Tag& check) const {
+  return shard.slots.get() + check.words[1] % buckets_per_shard * ways;
+}
+
+// A read of the slot that raced a write is discarded as a miss.
+bool VerifyCache::matches(const Slot& slot, const Tag& check, int64_t now) {
+  uint32_t before = slot.sequence.load(std::memory_order_acquire);
+  if (before & 1) {
+    return false;
+  }
+  bool match = slot.expiry.load(std::memory_order_relaxed) > now;
+  for (int k = 0; k < 4; ++k) {
+    match &= slot.check[k].load(std::memory_order_relaxed) == check.words[k];
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return match && slot.sequence.load(std::memory_order_relaxed) == before;
+}
+
+// Under the lock of the slot's shard.
+void VerifyCache::write(Slot& slot, const Tag& check, uint64_t stored,
+                        int64_t expiry) {
+  uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+  slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (int k = 0; k < 4; ++k) {
+    slot.check[k].store(check.words[k], std::memory_order_relaxed);
+  }
+  slot.stored.store(stored, std::memory_order_relaxed);
+  slot.expiry.store(expiry, std::memory_order_relaxed);
+  slot.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool VerifyCache::contains(const std::byte* passphrase,
+                           size_t passphrase_length, const char* encoded,
+                           size_t encoded_length) {
+  Tag check = mac(0, passphrase, passphrase_length, encoded, encoded_length);
+  int64_t now = Now();
+  Slot* bucket = bucket_of(shard_of(check), check);
+  for (size_t w = 0; w < ways; ++w) {
+    if (matches(bucket[w], check, now)) {
+      hit_count.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  miss_count.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+void VerifyCache::insert(const std::byte* passphrase,
+                         size_t passphrase_length, const char* encoded,
+                         size_t encoded_length) {
+  Tag check = mac(0, passphrase, passphrase_length, encoded, encoded_length);
+  uint64_t stored = mac(1, nullptr, 0, encoded, encoded_length).words[0];
+  int64_t now = Now();
+  int64_t expiry =
+      now + std::chrono::duration_cast<std::chrono::nanoseconds>(ttl).count();
+
+  Shard& shard = shard_of(check);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  Slot* bucket = bucket_of(shard, check);
+
+  // The entry of this check if there is one, else a free slot, else the
+  // one closest to expiring.
+  Slot* victim = bucket;
+  for (size_t w = 0; w < ways; ++w) {
+    Slot& slot = bucket[w];
+    int64_t slot_expiry = slot.expiry.load(std::memory_order_relaxed);
+    bool same = slot_expiry != 0;
+    for (int k = 0; k < 4; ++k) {
+      same &= slot.check[k].load(std::memory_order_relaxed) == check.words[k];
+    }
+    if (same) {
+      victim = &slot;
+      break;
+    }
+    if (slot_expiry < victim->expiry.load(std::memory_order_relaxed)) {
+      victim = &slot;
+    }
+  }
+  write(*victim, check, stored, expiry);
+}
+
+void VerifyCache::invalidate(const char* encoded, size_t encoded_length) {
+  uint64_t stored = mac(1, nullptr, 0, encoded, encoded_length).words[0];
+  for (Shard& shard : shard_list) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (size_t s = 0; s < buckets_per_shard * ways; ++s) {
+      Slot& slot = shard.slots[s];
+      if (slot.expiry.load(std::memory_order_relaxed) != 0 &&
+          slot.stored.load(std::memory_order_relaxed) == stored) {
+        write(slot, Tag{}, 0, 0);
+      }
+    }
+  }
+}
+
+void VerifyCache::clear() {
+  for (Shard& shard : shard_list) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (size_t s = 0; s < buckets_per_shard * ways; ++s) {
+      Slot& slot = shard.slots[s];
+      if (slot.expiry.load(std::memory_order_relaxed) != 0) {
+        write(slot, Tag{}, 0, 0);
+      }
+    }
+  }
+}
+
+uint64_t VerifyCache::hits() const {
+  return hit_count.load(std::memory_order_relaxed);
+}
+
+uint64_t VerifyCache::misses() const {
+  return miss_count.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,97 @@
+// chacha20_test.cc - Some tests for ChaCha20
+
+#include <chacha20.h>
+#include <gtest/gtest.h>
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace {
+
+const ChaCha20::Kernel kernels[] = {
+    ChaCha20::Kernel::Scalar, ChaCha20::Kernel::SSE2, ChaCha20::Kernel::AVX2,
+    ChaCha20::Kernel::AVX512};
+
+// One 64-byte block of the ChaCha20 keystream from OpenSSL, whose 16-byte IV
+// is the little endian block counter, then the 96-bit nonce (RFC 8439).
+std::vector<uint8_t> OpenSSLBlock(const uint8_t key[32], const uint8_t iv[16]) {
+  std::vector<uint8_t> zeros(64), out(64);
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+  int length = 0;
+  EXPECT_EQ(EVP_EncryptInit_ex(ctx, EVP_chacha20(), nullptr, key, iv), 1);
+  EXPECT_EQ(EVP_EncryptUpdate(ctx, out.data(), &length, zeros.data(), 64), 1);
+  EVP_CIPHER_CTX_free(ctx);
+  return out;
+}
+
+uint32_t LittleEndianWord(const uint8_t* b) {
+  return static_cast<uint32_t>(b[0]) | (static_cast<uint32_t>(b[1]) << 8) |
+         (static_cast<uint32_t>(b[2]) << 16) |
+         (static_cast<uint32_t>(b[3]) << 24);
+}
+
+// The keystream block is the hash of the constants, key, counter and nonce.
+TEST(ChaCha20Test, MatchesOpenSSLKeystream) {
+  uint8_t key[32], iv[16];
+  for (int i = 0; i < 32; i++) {
+    key[i] = static_cast<uint8_t>(7 * i + 1);
+  }
+  for (int i = 0; i < 16; i++) {
+    iv[i] = static_cast<uint8_t>(i < 4 ? (i == 0 ? 5 : 0) : 31 * i);
+  }
+  std::vector<uint8_t> expected = OpenSSLBlock(key, iv);
+
+  ChaCha20 chacha20(20);
+  for (auto k : kernels) {
+    if (!ChaCha20::set_kernel(k)) {
+      continue;
+    }
+    EXPECT_EQ(ChaCha20::kernel(), k);
+    uint32_t state[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+    for (int i = 0; i < 8; i++) {
+      state[4 + i] = LittleEndianWord(key + 4 * i);
+    }
+    for (int i = 0; i < 4; i++) {
+      state[12 + i] = LittleEndianWord(iv + 4 * i);
+    }
+    chacha20.hash(state);
+    for (int i = 0; i < 16; i++) {
+      EXPECT_EQ(state[i], LittleEndianWord(expected.data() + 4 * i))
+          << ChaCha20::kernel_name(k) << ", word " << i;
+    }
+  }
+  EXPECT_TRUE(ChaCha20::set_kernel(ChaCha20::Kernel::Auto));
+}
+
+// ChaCha20/8, the core of the ChaCha BlockMix, agrees on every kernel
+TEST(ChaCha20Test, EightRoundsAllKernels) {
+  uint32_t input[16];
+  uint32_t seed = 1;
+  for (auto& w : input) {
+    seed = seed * 1664525 + 1013904223;
+    w = seed;
+  }
+
+  ChaCha20 chacha20_8(8);
+  ASSERT_TRUE(ChaCha20::set_kernel(ChaCha20::Kernel::Scalar));
+  uint32_t expected[16];
+  std::copy(input, input + 16, expected);
+  chacha20_8.hash(expected);
+
+  for (auto k : kernels) {
+    if (!ChaCha20::set_kernel(k)) {
+      continue;
+    }
+    uint32_t got[16];
+    std::copy(input, input + 16, got);
+    chacha20_8.hash(got);
+    EXPECT_EQ(std::vector<uint32_t>(got, got + 16),
+              std::vector<uint32_t>(expected, expected + 16))
+        << ChaCha20::kernel_name(k);
+  }
+  EXPECT_TRUE(ChaCha20::set_kernel(ChaCha20::Kernel::Auto));
+}
+
+}  // namespace
@@ -0,0 +1,91 @@
+// memory_budget_test.cc - Some tests for the scratch memory budget
+
+#include <gtest/gtest.h>
+#include <memory_budget.h>
+#include <scrypt.h>
+#include <utilities.h>
+
+#include <chrono>
+#include <thread>
+
+namespace {
+
+using Admission = MemoryBudget::Admission;
+
+TEST(MemoryBudgetTest, Counters) {
+  MemoryBudget budget(1000);
+  EXPECT_TRUE(budget.acquire(600));
+  EXPECT_TRUE(budget.acquire(300));
+  EXPECT_EQ(budget.in_use(), 900);
+  budget.release(600);
+  EXPECT_EQ(budget.in_use(), 300);
+  EXPECT_EQ(budget.peak(), 900);
+  budget.release(300);
+  EXPECT_EQ(budget.in_use(), 0);
+}
+
+// Transferred bytes stay charged after the reservation ends, for the
+// caller to release.
+TEST(MemoryBudgetTest, ReservationTransfer) {
+  MemoryBudget budget(1000);
+  MemoryBudget other(1000);
+  {
+    MemoryBudget::Reservation held(budget, 800, Admission::Block, {});
+    EXPECT_TRUE(held.transfer(budget, 500));
+    EXPECT_FALSE(held.transfer(budget, 500));
+    EXPECT_FALSE(held.transfer(other, 100));
+  }
+  EXPECT_EQ(budget.in_use(), 500);
+  budget.release(500);
+  EXPECT_EQ(budget.in_use(), 0);
+}
+
+TEST(MemoryBudgetTest, FailFastAndTimeout) {
+  MemoryBudget budget(1000);
+  MemoryBudget::Reservation held(budget, 800, Admission::Block, {});
+  ASSERT_TRUE(held.admitted());
+
+  EXPECT_FALSE(budget.acquire(300, Admission::FailFast));
+  EXPECT_FALSE(
+      budget.acquire(300, Admission::Timeout, std::chrono::milliseconds(10)));
+  // Never satisfiable, even when blocking
+  EXPECT_FALSE(budget.acquire(2000, Admission::Block));
+  EXPECT_EQ(budget.rejected(), 3);
+  EXPECT_EQ(budget.waiters(), 0);
+}
+
+TEST(MemoryBudgetTest, BlockedUntilReleased) {
+  MemoryBudget budget(1000);
+  ASSERT_TRUE(budget.acquire(800));
+
+  std::thread waiter([&budget] {
+    EXPECT_TRUE(budget.acquire(500, Admission::Block));
+    budget.release(500);
+  });
+  while (budget.waiters() == 0) {
+    std::this_thread::yield();
+  }
+  budget.release(800);
+  waiter.join();
+  EXPECT_EQ(budget.in_use(), 0);
+  EXPECT_EQ(budget.peak(), 800);
+}
+
+TEST(MemoryBudgetTest, ScryptFailsFastOverBudget) {
+  Scrypt Scrypt;
+  // N = 16, r = 1 needs (16 + 1) * 128 bytes of scratch per lane.
+  auto budget = std::make_shared<MemoryBudget>(17 * 128);
+  Scrypt.set_memory_budget(budget);
+  Scrypt.set_admission(Admission::FailFast);
+
+  EXPECT_FALSE(Scrypt.hash(utilities::stringToBytes(""),
+                           utilities::stringToBytes(""), 16, 1, 1, 64)
+                   .empty());
+  EXPECT_TRUE(Scrypt.hash(utilities::stringToBytes(""),
+                          utilities::stringToBytes(""), 16, 1, 2, 64)
+                  .empty());
+  EXPECT_EQ(budget->peak(), 17 * 128);
+  EXPECT_EQ(budget->in_use(), 0);
+}
+
+}  // namespace
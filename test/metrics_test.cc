@@ -0,0 +1,99 @@
+// metrics_test.cc - Some tests for the hot-path metrics
+
+#include <gtest/gtest.h>
+#include <metrics.h>
+#include <romix.h>
+#include <scrypt.h>
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+namespace {
+
+using metrics::Stage;
+
+std::vector<std::byte> Bytes(const char* s) {
+  std::vector<std::byte> v;
+  for (; *s != '\0'; s++) {
+    v.push_back(static_cast<std::byte>(*s));
+  }
+  return v;
+}
+
+std::chrono::nanoseconds Time(const metrics::HashMetrics& m, Stage stage) {
+  return m.time[static_cast<size_t>(stage)];
+}
+
+TEST(MetricsTest, HookGetsEveryStage) {
+  if (!CPP_SCRYPT_METRICS) {
+    GTEST_SKIP();
+  }
+  std::vector<metrics::HashMetrics> seen;
+  metrics::set_hook([&](const metrics::HashMetrics& m) { seen.push_back(m); });
+
+  Scrypt scrypt;
+  EXPECT_EQ(scrypt.hash(Bytes("password"), Bytes("NaCl"), 1024, 8, 2, 64)
+                .size(),
+            64);
+  metrics::set_hook(nullptr);
+
+  ASSERT_EQ(seen.size(), 1);
+  const metrics::HashMetrics& m = seen[0];
+  EXPECT_GT(Time(m, Stage::PBKDF2).count(), 0);
+  EXPECT_GT(Time(m, Stage::ROMixFill).count(), 0);
+  EXPECT_GT(Time(m, Stage::ROMixMix).count(), 0);
+  EXPECT_GE(Time(m, Stage::Hash),
+            Time(m, Stage::MemoryWait) + Time(m, Stage::PBKDF2));
+  EXPECT_EQ(m.bytes_allocated, 2 * romix::ROMixScratchSize(8, 1024));
+  EXPECT_GE(m.threads, 1);
+  EXPECT_LE(m.threads, 2);
+
+  // Without a hook nothing is reported.
+  scrypt.hash(Bytes("password"), Bytes("NaCl"), 16, 1, 1, 64);
+  EXPECT_EQ(seen.size(), 1);
+}
+
+TEST(MetricsTest, Histograms) {
+  if (!CPP_SCRYPT_METRICS) {
+    GTEST_SKIP();
+  }
+  metrics::enable_histograms(true);
+  for (size_t s = 0; s < metrics::stage_count; s++) {
+    metrics::histogram(static_cast<Stage>(s)).reset();
+  }
+
+  Scrypt scrypt;
+  scrypt.hash(Bytes("password"), Bytes("NaCl"), 1024, 8, 1, 64);
+  scrypt.hash(Bytes("password"), Bytes("NaCl"), 1024, 8, 1, 64);
+  metrics::enable_histograms(false);
+  scrypt.hash(Bytes("password"), Bytes("NaCl"), 1024, 8, 1, 64);
+
+  for (Stage stage : {Stage::Hash, Stage::ROMixFill, Stage::ROMixMix}) {
+    metrics::Histogram::Snapshot s = metrics::histogram(stage).snapshot();
+    EXPECT_EQ(s.count, 2) << metrics::stage_name(stage);
+    uint64_t in_buckets = 0;
+    for (uint64_t b : s.bucket) {
+      in_buckets += b;
+    }
+    EXPECT_EQ(in_buckets, 2);
+    EXPECT_GT(s.sum, 0);
+  }
+  // Two derives per hash, and the key schedule.
+  EXPECT_EQ(metrics::histogram(Stage::PBKDF2).snapshot().count, 6);
+}
+
+TEST(MetricsTest, Buckets) {
+  metrics::Histogram h;
+  h.record(std::chrono::nanoseconds(0));
+  h.record(std::chrono::nanoseconds(1));
+  h.record(std::chrono::nanoseconds(1000));
+  metrics::Histogram::Snapshot s = h.snapshot();
+  EXPECT_EQ(s.count, 3);
+  EXPECT_EQ(s.sum, 1001);
+  EXPECT_EQ(s.bucket[0], 1);
+  EXPECT_EQ(s.bucket[1], 1);
+  EXPECT_EQ(s.bucket[10], 1);
+}
+
+}  // namespace
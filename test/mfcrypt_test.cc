@@ -0,0 +1,133 @@
+// mfcrypt_test.cc - Some tests for the MFcrypt policies of Scrypt
+
+#include <gtest/gtest.h>
+#include <mfcrypt.h>
+#include <pbkdf2.h>
+#include <romix.h>
+#include <scrypt.h>
+#include <utilities.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace {
+
+// MFcrypt as Section 5 of [SCRYPT] writes it, one step at a time.
+template <typename PRF, typename MF>
+std::vector<std::byte> ReferenceMFcrypt(const std::vector<std::byte>& P,
+                                        const std::vector<std::byte>& S,
+                                        uint64_t N, uint32_t r, uint32_t p,
+                                        size_t length) {
+  size_t block_size = 128 * static_cast<size_t>(r);
+  PBKDF2 prf(PRF::digest());
+  std::vector<std::byte> B = prf.hash(P, S, 1, p * block_size);
+
+  std::vector<uint32_t> X(block_size / 4);
+  std::vector<uint32_t> scratch(MF::scratch_size(r, N) / 4);
+  for (uint32_t i = 0; i < p; i++) {
+    std::byte* Bi = B.data() + i * block_size;
+    for (size_t w = 0; w < X.size(); w++) {
+      X[w] = static_cast<uint32_t>(Bi[4 * w]) |
+             (static_cast<uint32_t>(Bi[4 * w + 1]) << 8) |
+             (static_cast<uint32_t>(Bi[4 * w + 2]) << 16) |
+             (static_cast<uint32_t>(Bi[4 * w + 3]) << 24);
+    }
+    EXPECT_TRUE(MF::mix(r, X.data(), N, scratch.data(), nullptr));
+    for (size_t w = 0; w < X.size(); w++) {
+      for (size_t b = 0; b < 4; b++) {
+        Bi[4 * w + b] = static_cast<std::byte>(X[w] >> (8 * b));
+      }
+    }
+  }
+  return prf.hash(P, B, 1, length);
+}
+
+template <typename PRF, typename MF>
+std::vector<std::byte> Hash(Scrypt& scrypt, const std::vector<std::byte>& P,
+                            const std::vector<std::byte>& S, uint64_t N,
+                            uint32_t r, uint32_t p, size_t length) {
+  std::vector<std::byte> out(length);
+  EXPECT_TRUE((scrypt.hash<PRF, MF>(P.data(), P.size(), S.data(), S.size(), N,
+                                    r, p, out.data(), out.size())));
+  return out;
+}
+
+// The default policies are scrypt: Section 12 of the RFC
+TEST(MFcryptTest, ScryptPoliciesRFCSanity1) {
+  Scrypt Scrypt;
+  std::string expected =
+      "fd ba be 1c 9d 34 72 00 78 56 e7 19 0d 01 e9 fe "
+      "7c 6a d7 cb c8 23 78 30 e7 73 76 63 4b 37 31 62 "
+      "2e af 30 d9 2e 22 a3 88 6f f1 09 27 9d 98 30 da "
+      "c7 27 af b9 4a 83 ee 6d 83 60 cb df a2 cc 06 40 ";
+
+  std::vector<std::byte> got =
+      Hash<mfcrypt::HMACSHA256, mfcrypt::ROMixSalsa20_8>(
+          Scrypt, utilities::stringToBytes("password"),
+          utilities::stringToBytes("NaCl"), 1024, 8, 16, 64);
+  EXPECT_EQ(got, utilities::hexToBytes(expected));
+}
+
+template <typename PRF, typename MF>
+void ExpectMatchesReference(uint32_t r) {
+  Scrypt Scrypt;
+  std::vector<std::byte> P = utilities::stringToBytes("password");
+  std::vector<std::byte> S = utilities::stringToBytes("NaCl");
+  EXPECT_EQ((Hash<PRF, MF>(Scrypt, P, S, 64, r, 3, 72)),
+            (ReferenceMFcrypt<PRF, MF>(P, S, 64, r, 3, 72)))
+      << "r = " << r;
+}
+
+TEST(MFcryptTest, MatchesReference) {
+  for (uint32_t r : {1, 3, 8}) {
+    ExpectMatchesReference<mfcrypt::HMACSHA256, mfcrypt::ROMixSalsa20_8>(r);
+    ExpectMatchesReference<mfcrypt::HMACSHA256, mfcrypt::ROMixChaCha20_8>(r);
+    ExpectMatchesReference<mfcrypt::HMACSHA512, mfcrypt::ROMixSalsa20_8>(r);
+    ExpectMatchesReference<mfcrypt::HMACSHA512, mfcrypt::ROMixChaCha20_8>(r);
+  }
+}
+
+// Every pair of policies derives its own keys
+TEST(MFcryptTest, PoliciesDiffer) {
+  Scrypt Scrypt;
+  std::vector<std::byte> P = utilities::stringToBytes("password");
+  std::vector<std::byte> S = utilities::stringToBytes("NaCl");
+  std::vector<std::vector<std::byte>> keys = {
+      Hash<mfcrypt::HMACSHA256, mfcrypt::ROMixSalsa20_8>(Scrypt, P, S, 16, 1,
+                                                         1, 64),
+      Hash<mfcrypt::HMACSHA256, mfcrypt::ROMixChaCha20_8>(Scrypt, P, S, 16, 1,
+                                                          1, 64),
+      Hash<mfcrypt::HMACSHA512, mfcrypt::ROMixSalsa20_8>(Scrypt, P, S, 16, 1,
+                                                         1, 64),
+      Hash<mfcrypt::HMACSHA512, mfcrypt::ROMixChaCha20_8>(Scrypt, P, S, 16, 1,
+                                                          1, 64)};
+  for (size_t i = 0; i < keys.size(); i++) {
+    for (size_t j = i + 1; j < keys.size(); j++) {
+      EXPECT_NE(keys[i], keys[j]) << i << " and " << j;
+    }
+  }
+}
+
+// Only scrypt's ROMix trades memory for time; ChaCha lanes must fit
+TEST(MFcryptTest, ChaChaLaneMemoryLimit) {
+  Scrypt Scrypt;
+  std::vector<std::byte> P = utilities::stringToBytes("password");
+  std::vector<std::byte> S = utilities::stringToBytes("NaCl");
+  std::vector<std::byte> expected =
+      Hash<mfcrypt::HMACSHA256, mfcrypt::ROMixChaCha20_8>(Scrypt, P, S, 1024,
+                                                          1, 2, 64);
+
+  Scrypt.set_lane_memory_limit(romix::ROMixScratchSize(1, 1024));
+  EXPECT_EQ((Hash<mfcrypt::HMACSHA256, mfcrypt::ROMixChaCha20_8>(
+                Scrypt, P, S, 1024, 1, 2, 64)),
+            expected);
+
+  Scrypt.set_lane_memory_limit(romix::ROMixScratchSize(1, 1024) / 2);
+  std::byte out[64];
+  EXPECT_FALSE((Scrypt.hash<mfcrypt::HMACSHA256, mfcrypt::ROMixChaCha20_8>(
+      P.data(), P.size(), S.data(), S.size(), 1024, 1, 2, out, sizeof(out))));
+  EXPECT_TRUE((Scrypt.hash<mfcrypt::HMACSHA256, mfcrypt::ROMixSalsa20_8>(
+      P.data(), P.size(), S.data(), S.size(), 1024, 1, 2, out, sizeof(out))));
+}
+
+}  // namespace
@@ -2,6 +2,7 @@
 
 #include <gtest/gtest.h>
 #include <pbkdf2.h>
+#include <sha256.h>
 
 #include "utilities.h"
 
@@ -33,4 +34,145 @@ TEST(PBKDF2Test, ScryptRFCSanity1) {
   EXPECT_EQ(pbkdf_out_1, utilities::hexToBytes(expected_pbkdf_out_1));
 }
 
+// The pointer API writes into the caller's buffer
+TEST(PBKDF2Test, ScryptRFCSanity0Pointers) {
+  PBKDF2 PBKDF(EVP_sha256());
+  std::vector<std::byte> passphrase = utilities::stringToBytes("passwd");
+  std::vector<std::byte> salt = utilities::stringToBytes("salt");
+  std::byte out[64];
+  PBKDF.hash(passphrase.data(), passphrase.size(), salt.data(), salt.size(),
+             1, out, sizeof(out));
+  std::string expected_pbkdf_out_0 =
+      "55 ac 04 6e 56 e3 08 9f ec 16 91 c2 25 44 b6 05 "
+      "f9 41 85 21 6d de 04 65 e6 8b 9d 57 c2 0d ac bc "
+      "49 ca 9c cc f1 79 b6 45 99 16 64 b3 9d 77 ef 31 "
+      "7c 71 b8 45 b1 e3 0b d5 09 11 20 41 d3 a1 97 83 ";
+  EXPECT_EQ(std::vector<std::byte>(out, out + 64),
+            utilities::hexToBytes(expected_pbkdf_out_0));
+}
+
+// From Section 11 of the Scrypt RFC, through a precomputed key schedule
+TEST(PBKDF2Test, ScryptRFCSanity1Key) {
+  std::vector<std::byte> passphrase = utilities::stringToBytes("Password");
+  std::vector<std::byte> salt = utilities::stringToBytes("NaCl");
+  PBKDF2::Key key(EVP_sha256(), passphrase.data(), passphrase.size());
+  std::vector<std::byte> out(64);
+  key.derive(salt.data(), salt.size(), 80000, 0, out.data(), out.size());
+  std::string expected_pbkdf_out_1 =
+      "4d dc d8 f6 0b 98 be 21 83 0c ee 5e f2 27 01 f9 "
+      "64 1a 44 18 d0 4c 04 14 ae ff 08 87 6b 34 ab 56 "
+      "a1 d4 25 a1 22 58 33 54 9a db 84 1b 51 c9 b3 17 "
+      "6a 27 2b de bb a1 d0 78 47 8f 62 b3 97 f3 3c 8d ";
+  EXPECT_EQ(out, utilities::hexToBytes(expected_pbkdf_out_1));
+}
+
+// Any range of the output, for short, empty and over-long passphrases and
+// salts, must match OpenSSL's PBKDF2 on every SHA-256 kernel, and through
+// OpenSSL for other digests.
+TEST(PBKDF2Test, KeyRangesMatchHash) {
+  const SHA256::Kernel kernels[] = {SHA256::Kernel::Scalar,
+                                    SHA256::Kernel::SSE2, SHA256::Kernel::AVX2,
+                                    SHA256::Kernel::AVX512};
+  for (const EVP_MD* digest : {EVP_sha256(), EVP_sha1()}) {
+    PBKDF2 PBKDF(digest);
+    for (size_t passphrase_length : {0, 6, 65}) {
+      std::vector<std::byte> passphrase(passphrase_length, std::byte{'p'});
+      PBKDF2::Key key(digest, passphrase.data(), passphrase.size());
+      for (size_t salt_length : {4, 51, 52, 130}) {
+        std::vector<std::byte> salt(salt_length, std::byte{'s'});
+        for (uint32_t iterations : {1, 3}) {
+          std::vector<std::byte> expected =
+              PBKDF.hash(passphrase, salt, iterations, 700);
+          for (auto k : kernels) {
+            if (!SHA256::set_kernel(k)) {
+              continue;
+            }
+            for (size_t offset : {0, 1, 33, 100}) {
+              for (size_t length : {0, 1, 67, 600}) {
+                std::vector<std::byte> got(length);
+                key.derive(salt.data(), salt.size(), iterations, offset,
+                           got.data(), length);
+                EXPECT_EQ(got, std::vector<std::byte>(
+                                   expected.begin() + offset,
+                                   expected.begin() + offset + length))
+                    << SHA256::kernel_name(k);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  EXPECT_TRUE(SHA256::set_kernel(SHA256::Kernel::Auto));
+}
+
+// A batch of derives, with different keys, salt lengths, ranges and
+// digests, must give what each derive gives on its own, on every SHA-256
+// kernel.
+TEST(PBKDF2Test, DeriveBatchMatchesDerive) {
+  std::vector<PBKDF2::Key> keys;
+  for (size_t passphrase_length : {0, 6, 65}) {
+    std::vector<std::byte> passphrase(passphrase_length, std::byte{'p'});
+    keys.emplace_back(EVP_sha256(), passphrase.data(), passphrase.size());
+  }
+  std::vector<std::byte> sha1_passphrase = utilities::stringToBytes("pw");
+  keys.emplace_back(EVP_sha1(), sha1_passphrase.data(),
+                    sha1_passphrase.size());
+
+  std::vector<std::vector<std::byte>> salts;
+  for (size_t salt_length : {4, 51, 52, 130}) {
+    salts.emplace_back(salt_length, std::byte{'s'});
+  }
+
+  const SHA256::Kernel kernels[] = {SHA256::Kernel::Scalar,
+                                    SHA256::Kernel::SSE2, SHA256::Kernel::AVX2,
+                                    SHA256::Kernel::AVX512};
+  for (uint32_t iterations : {1, 3}) {
+    for (auto k : kernels) {
+      if (!SHA256::set_kernel(k)) {
+        continue;
+      }
+      std::vector<PBKDF2::Key::Request> requests;
+      std::vector<std::vector<std::byte>> got;
+      std::vector<std::vector<std::byte>> expected;
+      for (size_t i = 0; i < 23; i++) {
+        const PBKDF2::Key& key = keys.at(i % keys.size());
+        const std::vector<std::byte>& salt = salts.at(i % salts.size());
+        size_t offset = (i * 7) % 40;
+        size_t length = (i * 29) % 150;
+        got.emplace_back(length);
+        expected.emplace_back(length);
+        key.derive(salt.data(), salt.size(), iterations, offset,
+                   expected.back().data(), length);
+        requests.push_back(
+            {&key, salt.data(), salt.size(), offset, nullptr, length});
+      }
+      for (size_t i = 0; i < requests.size(); i++) {
+        requests.at(i).output = got.at(i).data();
+      }
+      PBKDF2::Key::derive_batch(requests.data(), requests.size(), iterations);
+      EXPECT_EQ(got, expected) << SHA256::kernel_name(k);
+    }
+  }
+  EXPECT_TRUE(SHA256::set_kernel(SHA256::Kernel::Auto));
+}
+
+// A key keeps deriving the same output when it is moved, by construction or
+// assignment, for either of its HMAC paths.
+TEST(PBKDF2Test, KeyMoves) {
+  std::vector<std::byte> passphrase = utilities::stringToBytes("password");
+  std::vector<std::byte> salt = utilities::stringToBytes("NaCl");
+  for (const EVP_MD* digest : {EVP_sha256(), EVP_sha1()}) {
+    std::vector<std::byte> expected =
+        PBKDF2(digest).hash(passphrase, salt, 2, 64);
+    PBKDF2::Key key(digest, passphrase.data(), passphrase.size());
+    PBKDF2::Key moved(std::move(key));
+    PBKDF2::Key assigned(EVP_sha512(), nullptr, 0);
+    assigned = std::move(moved);
+    std::vector<std::byte> got(64);
+    assigned.derive(salt.data(), salt.size(), 2, 0, got.data(), got.size());
+    EXPECT_EQ(got, expected);
+  }
+}
+
 }  // namespace
@@ -0,0 +1,146 @@
+// romix_test.cc - Some tests for BlockMix and ROMix
+
+#include <gtest/gtest.h>
+#include <romix.h>
+#include <salsa20.h>
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace {
+
+std::vector<uint32_t> Words(size_t n, uint32_t seed) {
+  std::vector<uint32_t> v(n);
+  for (auto& w : v) {
+    seed = seed * 1664525 + 1013904223;
+    w = seed;
+  }
+  return v;
+}
+
+// ROMix as in Section 5 of RFC 7914, over the generic BlockMix.
+std::vector<uint32_t> ReferenceROMix(uint32_t r, std::vector<uint32_t> X,
+                                     uint64_t N) {
+  Salsa20 salsa20_8(8);
+  size_t words = 32 * r;
+  std::vector<uint32_t> V(N * words), Y(words);
+  for (uint64_t i = 0; i < N; i++) {
+    std::copy(X.begin(), X.end(), V.begin() + i * words);
+    romix::BlockMix(X.data(), nullptr, Y.data(), 2 * r, salsa20_8);
+    std::swap(X, Y);
+  }
+  for (uint64_t i = 0; i < N; i++) {
+    uint64_t j = X[words - 16] & (N - 1);
+    romix::BlockMix(X.data(), V.data() + j * words, Y.data(), 2 * r,
+                    salsa20_8);
+    std::swap(X, Y);
+  }
+  return X;
+}
+
+template <uint32_t R>
+void ExpectBlockMixMatches() {
+  Salsa20 salsa20_8(8);
+  std::vector<uint32_t> B = Words(32 * R, R), V = Words(32 * R, R + 1);
+  std::vector<uint32_t> fixed(32 * R), generic(32 * R);
+  for (const uint32_t* v : {static_cast<const uint32_t*>(nullptr),
+                            static_cast<const uint32_t*>(V.data())}) {
+    romix::BlockMix<R>(B.data(), v, fixed.data(), salsa20_8);
+    romix::BlockMix(B.data(), v, generic.data(), 2 * R, salsa20_8);
+    EXPECT_EQ(fixed, generic) << "r = " << R;
+  }
+}
+
+TEST(ROMixTest, FixedBlockMixMatchesGeneric) {
+  ExpectBlockMixMatches<1>();
+  ExpectBlockMixMatches<2>();
+  ExpectBlockMixMatches<4>();
+  ExpectBlockMixMatches<8>();
+  ExpectBlockMixMatches<16>();
+  ExpectBlockMixMatches<32>();
+}
+
+TEST(ROMixTest, MatchesReference) {
+  const uint64_t N = 64;
+  // Specialized and generic block size factors alike.
+  for (uint32_t r : {1, 2, 3, 4, 5, 8, 16, 32}) {
+    std::vector<uint32_t> B = Words(32 * r, r);
+    std::vector<uint32_t> expected = ReferenceROMix(r, B, N);
+    std::vector<uint32_t> scratch(romix::ROMixScratchSize(r, N) / 4);
+    ASSERT_TRUE(romix::ROMix(r, B.data(), N, scratch.data()));
+    EXPECT_EQ(B, expected) << "r = " << r;
+  }
+}
+
+TEST(ROMixTest, InterleavedMatchesReference) {
+  const uint64_t N = 64;
+  for (uint32_t r : {1, 3, 8}) {
+    for (size_t count = 1; count <= romix::max_interleaved; count++) {
+      std::vector<std::vector<uint32_t>> B, scratch;
+      std::vector<uint32_t*> blocks, scratches;
+      for (size_t l = 0; l < count; l++) {
+        B.push_back(Words(32 * r, r + l));
+        scratch.emplace_back(romix::ROMixScratchSize(r, N) / 4);
+      }
+      for (size_t l = 0; l < count; l++) {
+        blocks.push_back(B[l].data());
+        scratches.push_back(scratch[l].data());
+      }
+      ASSERT_TRUE(romix::ROMixInterleaved(r, blocks.data(), count, N,
+                                          scratches.data()));
+      for (size_t l = 0; l < count; l++) {
+        EXPECT_EQ(B[l], ReferenceROMix(r, Words(32 * r, r + l), N))
+            << "r = " << r << ", lane " << l << " of " << count;
+      }
+    }
+  }
+}
+
+TEST(ROMixTest, TMTOMatchesReference) {
+  const uint64_t N = 64;
+  for (uint32_t r : {1, 3, 8}) {
+    std::vector<uint32_t> expected = ReferenceROMix(r, Words(32 * r, r), N);
+    for (uint64_t stride : {1, 2, 3, 7, 16, 63, 64}) {
+      std::vector<uint32_t> B = Words(32 * r, r);
+      std::vector<uint32_t> scratch(
+          romix::ROMixTMTOScratchSize(r, N, stride) / 4);
+      ASSERT_TRUE(romix::ROMixTMTO(r, B.data(), N, stride, scratch.data()));
+      EXPECT_EQ(B, expected) << "r = " << r << ", stride " << stride;
+    }
+  }
+}
+
+TEST(ROMixTest, TMTOStride) {
+  // 1024 entries of 1 KiB, and three blocks more.
+  EXPECT_EQ(romix::TMTOStride(8, 1024, 1027 * 1024), 1);
+  EXPECT_EQ(romix::TMTOStride(8, 1024, 1026 * 1024), 2);
+  EXPECT_EQ(romix::TMTOStride(8, 1024, 35 * 1024), 32);
+  EXPECT_EQ(romix::TMTOStride(8, 1024, 4 * 1024), 1024);
+  EXPECT_EQ(romix::TMTOStride(8, 1024, 4 * 1024 - 1), 0);
+  for (size_t bytes : {5000, 20000, 100000, 1000000}) {
+    uint64_t stride = romix::TMTOStride(8, 1024, bytes);
+    EXPECT_LE(romix::ROMixTMTOScratchSize(8, 1024, stride), bytes);
+    EXPECT_GT(romix::ROMixTMTOScratchSize(8, 1024, stride - 1), bytes);
+  }
+}
+
+// Scratch sizes that overflow a size_t come out as SIZE_MAX, never wrapped.
+TEST(ROMixTest, ScratchSizeOverflow) {
+  const uint64_t N = uint64_t{1} << 57;
+  EXPECT_EQ(romix::ROMixScratchSize(1, N), SIZE_MAX);
+  EXPECT_EQ(romix::ROMixScratchSize(1u << 20, uint64_t{1} << 40), SIZE_MAX);
+  EXPECT_EQ(romix::ROMixTMTOScratchSize(1, N, 1), SIZE_MAX);
+  EXPECT_EQ(romix::ROMixLanesScratchSize(1, N), SIZE_MAX);
+  EXPECT_EQ(romix::ROMixScratchSize(1, 16), 17 * 128);
+}
+
+TEST(ROMixTest, FixedROMixCancelled) {
+  std::atomic<bool> cancelled{true};
+  std::vector<uint32_t> B = Words(32 * 8, 8);
+  std::vector<uint32_t> scratch(romix::ROMixScratchSize(8, 16) / 4);
+  EXPECT_FALSE(romix::ROMix<8>(B.data(), 16, scratch.data(), &cancelled));
+}
+
+}  // namespace
@@ -3,6 +3,10 @@
 #include <gtest/gtest.h>
 #include <salsa20.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
 #include "utilities.h"
 
 namespace {
@@ -185,4 +189,180 @@ TEST(SalsaTest, ScryptRFCSanity0) {
   EXPECT_EQ(got, utilities::hexToBytes(expected));
 }
 
+// Every kernel this CPU supports must match the Section 8 vector
+TEST(SalsaTest, ScryptRFCSanityAllKernels) {
+  std::string input =
+      "7e 87 9a 21 4f 3e c9 86 7c a9 40 e6 41 71 8f 26 "
+      "ba ee 55 5b 8c 61 c1 b5 0d f8 46 11 6d cd 3b 1d "
+      "ee 24 f3 19 df 9b 3d 85 14 12 1e 4b 5a c5 aa 32 "
+      "76 02 1d 29 09 c7 48 29 ed eb c6 8d b8 b8 c2 5e ";
+  std::string expected =
+      "a4 1f 85 9c 66 08 cc 99 3b 81 ca cb 02 0c ef 05 "
+      "04 4b 21 81 a2 fd 33 7d fd 7b 1c 63 96 68 2f 29 "
+      "b4 39 31 68 e3 c9 e6 bc fe 6b c5 b7 a0 6d 96 ba "
+      "e4 24 cc 10 2c 91 74 5c 24 ad 67 3d c7 61 8f 81 ";
+
+  Salsa20 Salsa(8);
+  for (auto k : {Salsa20::Kernel::Scalar, Salsa20::Kernel::SSE2,
+                 Salsa20::Kernel::AVX2, Salsa20::Kernel::AVX512}) {
+    if (!Salsa20::set_kernel(k)) {
+      continue;
+    }
+    EXPECT_EQ(Salsa20::kernel(), k);
+    EXPECT_EQ(Salsa.hash(utilities::hexToBytes(input)),
+              utilities::hexToBytes(expected))
+        << Salsa20::kernel_name(k);
+  }
+  EXPECT_TRUE(Salsa20::set_kernel(Salsa20::Kernel::Auto));
+}
+
+// The pointer API may hash in place
+TEST(SalsaTest, ScryptRFCSanityInPlace) {
+  Salsa20 Salsa(8);
+  std::vector<std::byte> buffer = utilities::hexToBytes(
+      "7e 87 9a 21 4f 3e c9 86 7c a9 40 e6 41 71 8f 26 "
+      "ba ee 55 5b 8c 61 c1 b5 0d f8 46 11 6d cd 3b 1d "
+      "ee 24 f3 19 df 9b 3d 85 14 12 1e 4b 5a c5 aa 32 "
+      "76 02 1d 29 09 c7 48 29 ed eb c6 8d b8 b8 c2 5e ");
+  std::vector<std::byte> expected = Salsa.hash(buffer);
+  Salsa.hash(buffer.data(), buffer.data());
+  EXPECT_EQ(buffer, expected);
+}
+
+// The in-place word API must agree with the byte API
+TEST(SalsaTest, ScryptRFCSanityWords) {
+  Salsa20 Salsa(8);
+  std::vector<std::byte> input = utilities::hexToBytes(
+      "7e 87 9a 21 4f 3e c9 86 7c a9 40 e6 41 71 8f 26 "
+      "ba ee 55 5b 8c 61 c1 b5 0d f8 46 11 6d cd 3b 1d "
+      "ee 24 f3 19 df 9b 3d 85 14 12 1e 4b 5a c5 aa 32 "
+      "76 02 1d 29 09 c7 48 29 ed eb c6 8d b8 b8 c2 5e ");
+  std::vector<std::byte> expected = Salsa.hash(input);
+
+  uint32_t state[16];
+  for (size_t i = 0; i < 16; ++i) {
+    state[i] = 0;
+    for (size_t j = 0; j < 4; ++j) {
+      state[i] |= static_cast<uint32_t>(input.at(4 * i + j)) << (8 * j);
+    }
+  }
+  Salsa.hash(state);
+  for (size_t i = 0; i < 16; ++i) {
+    for (size_t j = 0; j < 4; ++j) {
+      EXPECT_EQ(static_cast<uint8_t>(state[i] >> (8 * j)),
+                static_cast<uint8_t>(expected.at(4 * i + j)));
+    }
+  }
+}
+
+// The diagonal order round trips, and hashing in it is hashing in the
+// natural order, on every kernel this CPU supports
+TEST(SalsaTest, DiagonalMatchesNatural) {
+  uint32_t input[16];
+  for (uint32_t i = 0; i < 16; ++i) {
+    input[i] = 0x9e3779b9 * (i + 1);
+  }
+  uint32_t round_trip[16];
+  std::copy(input, input + 16, round_trip);
+  Salsa20::to_diagonal(round_trip);
+  EXPECT_EQ(round_trip[Salsa20::diagonal_position(1)], input[1]);
+  Salsa20::from_diagonal(round_trip);
+  EXPECT_EQ(std::vector<uint32_t>(round_trip, round_trip + 16),
+            std::vector<uint32_t>(input, input + 16));
+
+  Salsa20 Salsa(8);
+  for (auto k : {Salsa20::Kernel::Scalar, Salsa20::Kernel::SSE2,
+                 Salsa20::Kernel::AVX2, Salsa20::Kernel::AVX512}) {
+    if (!Salsa20::set_kernel(k)) {
+      continue;
+    }
+    uint32_t natural[16], diagonal[16];
+    std::copy(input, input + 16, natural);
+    std::copy(input, input + 16, diagonal);
+    Salsa.hash(natural);
+    Salsa20::to_diagonal(diagonal);
+    Salsa.hash_diagonal(diagonal);
+    Salsa20::from_diagonal(diagonal);
+    EXPECT_EQ(std::vector<uint32_t>(diagonal, diagonal + 16),
+              std::vector<uint32_t>(natural, natural + 16))
+        << Salsa20::kernel_name(k);
+  }
+  EXPECT_TRUE(Salsa20::set_kernel(Salsa20::Kernel::Auto));
+}
+
+uint32_t Rotate(uint32_t y, int c) { return (y << c) | (y >> (32 - c)); }
+
+// The Salsa20 core as Sections 3 to 8 of the spec write it.
+std::vector<uint32_t> ReferenceCore(const std::vector<uint32_t>& input,
+                                    uint32_t rounds) {
+  std::vector<uint32_t> x = input;
+  auto quarterround = [&](int a, int b, int c, int d) {
+    x[b] ^= Rotate(x[a] + x[d], 7);
+    x[c] ^= Rotate(x[b] + x[a], 9);
+    x[d] ^= Rotate(x[c] + x[b], 13);
+    x[a] ^= Rotate(x[d] + x[c], 18);
+  };
+  for (uint32_t i = 0; i < rounds; i += 2) {
+    quarterround(0, 4, 8, 12);
+    quarterround(5, 9, 13, 1);
+    quarterround(10, 14, 2, 6);
+    quarterround(15, 3, 7, 11);
+    quarterround(0, 1, 2, 3);
+    quarterround(5, 6, 7, 4);
+    quarterround(10, 11, 8, 9);
+    quarterround(15, 12, 13, 14);
+  }
+  for (size_t i = 0; i < 16; ++i) {
+    x[i] += input[i];
+  }
+  return x;
+}
+
+// Every kernel this CPU supports agrees with the reference, on one state
+// and in every other lane of its multi-lane core, whose lanes in between
+// hash zeros to zeros
+TEST(SalsaTest, KernelsMatchReference) {
+  uint32_t seed = 0x9e3779b9;
+  for (uint32_t rounds : {2, 8, 20}) {
+    Salsa20 Salsa(static_cast<uint8_t>(rounds));
+    for (int trial = 0; trial < 4; ++trial) {
+      std::vector<uint32_t> input(16);
+      for (auto& w : input) {
+        seed = seed * 1664525 + 1013904223;
+        w = seed;
+      }
+      std::vector<uint32_t> expected = ReferenceCore(input, rounds);
+
+      for (auto k : {Salsa20::Kernel::Scalar, Salsa20::Kernel::SSE2,
+                     Salsa20::Kernel::AVX2, Salsa20::Kernel::AVX512}) {
+        if (!Salsa20::set_kernel(k)) {
+          continue;
+        }
+        std::vector<uint32_t> state = input;
+        Salsa.hash(state.data());
+        EXPECT_EQ(state, expected)
+            << Salsa20::kernel_name(k) << ", " << rounds << " rounds";
+
+        const size_t lanes = Salsa20::lanes();
+        std::vector<uint32_t> wide(16 * lanes);
+        for (size_t l = 0; l < lanes; l += 2) {
+          for (size_t i = 0; i < 16; ++i) {
+            wide[i * lanes + l] = input[i];
+          }
+        }
+        Salsa.hash_lanes(wide.data());
+        for (size_t l = 0; l < lanes; ++l) {
+          std::vector<uint32_t> lane(16);
+          for (size_t i = 0; i < 16; ++i) {
+            lane[i] = wide[i * lanes + l];
+          }
+          EXPECT_EQ(lane, (l % 2) ? std::vector<uint32_t>(16) : expected)
+              << Salsa20::kernel_name(k) << ", lane " << l;
+        }
+      }
+    }
+  }
+  EXPECT_TRUE(Salsa20::set_kernel(Salsa20::Kernel::Auto));
+}
+
 }  // namespace
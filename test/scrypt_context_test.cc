@@ -0,0 +1,159 @@
+// scrypt_context_test.cc - Some tests for the scratchpad cache
+
+#include <gtest/gtest.h>
+#include <romix.h>
+#include <scrypt.h>
+#include <scrypt_context.h>
+#include <utilities.h>
+
+#include <chrono>
+#include <thread>
+
+namespace {
+
+TEST(ScryptContextTest, ReusesScratchpads) {
+  ScryptContext context;
+  uint32_t* first;
+  {
+    auto lease = context.acquire(4096);
+    first = lease.data();
+    EXPECT_GE(lease.size(), 4096);
+  }
+  EXPECT_EQ(context.cached_bytes(), 4096);
+  {
+    // A request of the same size gets the cached scratchpad.
+    auto lease = context.acquire(4096);
+    EXPECT_EQ(lease.data(), first);
+    EXPECT_EQ(context.cached_bytes(), 0);
+  }
+  EXPECT_EQ(context.hits(), 1);
+  EXPECT_EQ(context.misses(), 1);
+}
+
+TEST(ScryptContextTest, LendsExactSize) {
+  ScryptContext context;
+  { auto lease = context.acquire(4096); }
+  {
+    // The reservation of the borrower covers 1024 bytes, not 4096.
+    auto lease = context.acquire(1024);
+    EXPECT_EQ(lease.size(), 1024);
+    EXPECT_EQ(context.cached_bytes(), 4096);
+  }
+  EXPECT_EQ(context.hits(), 0);
+  EXPECT_EQ(context.misses(), 2);
+}
+
+// Idle scratchpads count against the budget of the context.
+TEST(ScryptContextTest, ChargesBudget) {
+  auto budget = std::make_shared<MemoryBudget>(6000);
+  {
+    ScryptContext context(size_t{1} << 20, std::chrono::seconds(30), false,
+                          budget);
+    {
+      auto a = context.acquire(4096);
+      auto b = context.acquire(4096);
+      EXPECT_EQ(budget->in_use(), 0);
+    }
+    // Only one of the two fits in the budget.
+    EXPECT_EQ(context.cached_bytes(), 4096);
+    EXPECT_EQ(budget->in_use(), 4096);
+
+    // Lending it out hands it over to the reservation of the borrower.
+    { auto lease = context.acquire(4096); }
+    EXPECT_EQ(budget->in_use(), 4096);
+
+    // Taken scratchpads carry their charge with them, and back.
+    {
+      auto taken = context.take(*budget, 4096, 2);
+      EXPECT_EQ(taken.size(), 1);
+      EXPECT_EQ(context.cached_bytes(), 0);
+      EXPECT_EQ(budget->in_use(), 4096);
+    }
+    EXPECT_EQ(context.cached_bytes(), 4096);
+    EXPECT_EQ(budget->in_use(), 4096);
+
+    // A hash that needs the memory gets it.
+    context.make_room(*budget, 4096);
+    EXPECT_EQ(context.cached_bytes(), 0);
+    EXPECT_EQ(budget->in_use(), 0);
+
+    { auto lease = context.acquire(4096); }
+  }
+  EXPECT_EQ(budget->in_use(), 0);
+}
+
+TEST(ScryptContextTest, SizeLimit) {
+  ScryptContext context(6000);
+  {
+    auto a = context.acquire(4096);
+    auto b = context.acquire(4096);
+  }
+  // Only one of the two fits under the limit.
+  EXPECT_EQ(context.cached_bytes(), 4096);
+  {
+    auto big = context.acquire(8192);
+  }
+  EXPECT_EQ(context.cached_bytes(), 0);
+}
+
+TEST(ScryptContextTest, ShrinksWhenIdle) {
+  ScryptContext context(size_t{1} << 20, std::chrono::milliseconds(0));
+  { auto lease = context.acquire(4096); }
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  context.trim();
+  EXPECT_EQ(context.cached_bytes(), 0);
+}
+
+// From Section 12 of the RFC, hashing twice through one wiping context
+TEST(ScryptContextTest, RFCSanity1Repeated) {
+  Scrypt Scrypt;
+  auto context = std::make_shared<ScryptContext>(
+      size_t{1} << 30, std::chrono::seconds(30), true);
+  Scrypt.set_context(context);
+  std::string expected =
+      "fd ba be 1c 9d 34 72 00 78 56 e7 19 0d 01 e9 fe "
+      "7c 6a d7 cb c8 23 78 30 e7 73 76 63 4b 37 31 62 "
+      "2e af 30 d9 2e 22 a3 88 6f f1 09 27 9d 98 30 da "
+      "c7 27 af b9 4a 83 ee 6d 83 60 cb df a2 cc 06 40 ";
+
+  for (int i = 0; i < 2; i++) {
+    std::vector<std::byte> got =
+        Scrypt.hash(utilities::stringToBytes("password"),
+                    utilities::stringToBytes("NaCl"), 1024, 8, 16, 64);
+    EXPECT_EQ(got, utilities::hexToBytes(expected));
+  }
+  EXPECT_GT(context->hits(), 0);
+}
+
+// With a budget of exactly one hash, the scratchpad of the first hash is
+// cached, charged to the budget, and lent to the second.
+TEST(ScryptContextTest, ReusesUnderTightBudget) {
+  const uint32_t p = 1;
+  auto budget =
+      std::make_shared<MemoryBudget>(p * romix::ROMixScratchSize(1, 1024));
+  auto context = std::make_shared<ScryptContext>(
+      size_t{1} << 30, std::chrono::seconds(30), false, budget);
+  Scrypt Scrypt;
+  Scrypt.set_memory_budget(budget);
+  Scrypt.set_admission(MemoryBudget::Admission::FailFast);
+  Scrypt.set_context(context);
+
+  std::vector<std::byte> first =
+      Scrypt.hash(utilities::stringToBytes("password"),
+                  utilities::stringToBytes("NaCl"), 1024, 1, p, 64);
+  EXPECT_EQ(first.size(), 64);
+  EXPECT_EQ(context->cached_bytes(), budget->limit());
+  EXPECT_EQ(budget->in_use(), budget->limit());
+
+  EXPECT_EQ(Scrypt.hash(utilities::stringToBytes("password"),
+                        utilities::stringToBytes("NaCl"), 1024, 1, p, 64),
+            first);
+  EXPECT_EQ(context->hits(), p);
+  EXPECT_EQ(context->misses(), p);
+  EXPECT_EQ(budget->in_use(), budget->limit());
+
+  context->clear();
+  EXPECT_EQ(budget->in_use(), 0);
+}
+
+}  // namespace
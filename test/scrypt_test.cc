@@ -1,7 +1,9 @@
 // scrypt_test.cc - Some tests for Scrypt
 
 #include <gtest/gtest.h>
+#include <salsa20.h>
 #include <scrypt.h>
+#include <thread_pool.h>
 #include <utilities.h>
 
 namespace {
@@ -40,6 +42,349 @@ TEST(ScryptTest, RFCSanity1) {
   EXPECT_EQ(got, utilities::hexToBytes(expected));
 }
 
+// From Section 12 of the RFC, through the pointer API
+TEST(ScryptTest, RFCSanity1Pointers) {
+  Scrypt Scrypt;
+  std::string expected =
+      "fd ba be 1c 9d 34 72 00 78 56 e7 19 0d 01 e9 fe "
+      "7c 6a d7 cb c8 23 78 30 e7 73 76 63 4b 37 31 62 "
+      "2e af 30 d9 2e 22 a3 88 6f f1 09 27 9d 98 30 da "
+      "c7 27 af b9 4a 83 ee 6d 83 60 cb df a2 cc 06 40 ";
+
+  std::vector<std::byte> passphrase = utilities::stringToBytes("password");
+  std::vector<std::byte> salt = utilities::stringToBytes("NaCl");
+  std::byte out[64];
+  EXPECT_TRUE(Scrypt.hash(passphrase.data(), passphrase.size(), salt.data(),
+                          salt.size(), 1024, 8, 16, out, sizeof(out)));
+  EXPECT_EQ(std::vector<std::byte>(out, out + 64),
+            utilities::hexToBytes(expected));
+}
+
+// From Section 12 of the RFC, with lanes interleaved three to a thread
+TEST(ScryptTest, RFCSanity1Interleaved) {
+  Scrypt Scrypt(std::make_shared<ThreadPool>(3));
+  Scrypt.set_interleaving(3);
+  std::string expected =
+      "fd ba be 1c 9d 34 72 00 78 56 e7 19 0d 01 e9 fe "
+      "7c 6a d7 cb c8 23 78 30 e7 73 76 63 4b 37 31 62 "
+      "2e af 30 d9 2e 22 a3 88 6f f1 09 27 9d 98 30 da "
+      "c7 27 af b9 4a 83 ee 6d 83 60 cb df a2 cc 06 40 ";
+
+  std::vector<std::byte> got =
+      Scrypt.hash(utilities::stringToBytes("password"),
+                  utilities::stringToBytes("NaCl"), 1024, 8, 16, 64);
+  EXPECT_EQ(got, utilities::hexToBytes(expected));
+}
+
+// From Section 12 of the RFC, in an eighth of the memory per lane
+TEST(ScryptTest, RFCSanity1LaneMemoryLimit) {
+  Scrypt Scrypt;
+  Scrypt.set_lane_memory_limit(128 * 1024);
+  std::string expected =
+      "fd ba be 1c 9d 34 72 00 78 56 e7 19 0d 01 e9 fe "
+      "7c 6a d7 cb c8 23 78 30 e7 73 76 63 4b 37 31 62 "
+      "2e af 30 d9 2e 22 a3 88 6f f1 09 27 9d 98 30 da "
+      "c7 27 af b9 4a 83 ee 6d 83 60 cb df a2 cc 06 40 ";
+
+  std::vector<std::byte> got =
+      Scrypt.hash(utilities::stringToBytes("password"),
+                  utilities::stringToBytes("NaCl"), 1024, 8, 16, 64);
+  EXPECT_EQ(got, utilities::hexToBytes(expected));
+
+  // Not even three blocks and one entry of V fit.
+  Scrypt.set_lane_memory_limit(3 * 1024);
+  EXPECT_TRUE(Scrypt.hash(utilities::stringToBytes("password"),
+                          utilities::stringToBytes("NaCl"), 1024, 8, 16, 64)
+                  .empty());
+}
+
+// From Section 12 of the RFC, keeping every fifth entry of V
+TEST(ScryptTest, RFCSanity0TMTOStride) {
+  Scrypt Scrypt;
+  Scrypt.set_tmto_stride(5);
+  std::string expected =
+      "77 d6 57 62 38 65 7b 20 3b 19 ca 42 c1 8a 04 97 "
+      "f1 6b 48 44 e3 07 4a e8 df df fa 3f ed e2 14 42 "
+      "fc d0 06 9d ed 09 48 f8 32 6a 75 3a 0f c8 1f 17 "
+      "e8 d3 e0 fb 2e 0d 36 28 cf 35 e2 0c 38 d1 89 06 ";
+
+  std::vector<std::byte> got = Scrypt.hash(utilities::stringToBytes(""),
+                                           utilities::stringToBytes(""), 16,
+                                           1, 1, 64);
+  EXPECT_EQ(got, utilities::hexToBytes(expected));
+}
+
+// From Section 12 of the RFC, on a pool of our own
+TEST(ScryptTest, RFCSanity1OwnPool) {
+  Scrypt Scrypt(std::make_shared<ThreadPool>(3));
+  std::string expected =
+      "fd ba be 1c 9d 34 72 00 78 56 e7 19 0d 01 e9 fe "
+      "7c 6a d7 cb c8 23 78 30 e7 73 76 63 4b 37 31 62 "
+      "2e af 30 d9 2e 22 a3 88 6f f1 09 27 9d 98 30 da "
+      "c7 27 af b9 4a 83 ee 6d 83 60 cb df a2 cc 06 40 ";
+
+  std::vector<std::byte> got =
+      Scrypt.hash(utilities::stringToBytes("password"),
+                  utilities::stringToBytes("NaCl"), 1024, 8, 16, 64);
+  EXPECT_EQ(got, utilities::hexToBytes(expected));
+}
+
+// From Section 12 of the RFC, off the calling thread
+TEST(ScryptTest, RFCSanity1Async) {
+  std::string expected =
+      "fd ba be 1c 9d 34 72 00 78 56 e7 19 0d 01 e9 fe "
+      "7c 6a d7 cb c8 23 78 30 e7 73 76 63 4b 37 31 62 "
+      "2e af 30 d9 2e 22 a3 88 6f f1 09 27 9d 98 30 da "
+      "c7 27 af b9 4a 83 ee 6d 83 60 cb df a2 cc 06 40 ";
+
+  std::future<std::vector<std::byte>> got;
+  {
+    // The hash outlives the Scrypt that started it.
+    Scrypt Scrypt;
+    got = Scrypt.hash_async(utilities::stringToBytes("password"),
+                            utilities::stringToBytes("NaCl"), 1024, 8, 16,
+                            64);
+  }
+  EXPECT_EQ(got.get(), utilities::hexToBytes(expected));
+}
+
+// A cancelled hash gives up and reports an empty key through the callback.
+TEST(ScryptTest, AsyncCancelled) {
+  Scrypt Scrypt;
+  auto cancelled = std::make_shared<std::atomic<bool>>(true);
+  std::promise<std::vector<std::byte>> done;
+  Scrypt.hash_async(
+      utilities::stringToBytes("password"), utilities::stringToBytes("NaCl"),
+      uint64_t{1} << 20, 1, 1, 64,
+      [&done](std::vector<std::byte> key) { done.set_value(std::move(key)); },
+      cancelled);
+  EXPECT_TRUE(done.get_future().get().empty());
+}
+
+// N must be a power of two larger than 1; hash and hash_batch refuse the
+// others.
+TEST(ScryptTest, RejectsCostFactor) {
+  Scrypt Scrypt;
+  std::vector<std::byte> output(16);
+  for (uint64_t N : {0, 1, 3, 5, 24}) {
+    EXPECT_FALSE(Scrypt.hash(nullptr, 0, nullptr, 0, N, 1, 1, output.data(),
+                             output.size()))
+        << "N = " << N;
+    EXPECT_TRUE(Scrypt.hash({}, {}, N, 1, 1, 16).empty()) << "N = " << N;
+    EXPECT_TRUE(Scrypt.hash_batch({{{}, {}, N, 1, 1, 16}}).empty())
+        << "N = " << N;
+  }
+}
+
+// A scratch too large for a size_t is refused, not wrapped around.
+TEST(ScryptTest, RejectsOverflowingScratch) {
+  Scrypt Scrypt;
+  const uint64_t N = uint64_t{1} << 57;
+  EXPECT_TRUE(Scrypt.hash({}, {}, N, 1, 1, 16).empty());
+  EXPECT_TRUE(Scrypt.hash_batch({{{}, {}, N, 1, 1, 16}}).empty());
+  EXPECT_TRUE(Scrypt.hash_batch(std::vector<Scrypt::Job>(
+                                    Salsa20::lanes(), {{}, {}, N, 1, 1, 16}))
+                  .empty());
+}
+
+// r and p must be positive with r * p < 2^30; hash refuses the others
+// before it allocates anything.
+TEST(ScryptTest, RejectsBlockFactors) {
+  Scrypt Scrypt;
+  std::vector<std::byte> output(64);
+  for (auto [r, p] : std::vector<std::pair<uint32_t, uint32_t>>{
+           {0, 1}, {1, 0}, {0, 0}, {1u << 15, 1u << 15}, {1, 1u << 30}}) {
+    EXPECT_FALSE(Scrypt.hash(nullptr, 0, nullptr, 0, 16, r, p, output.data(),
+                             output.size()))
+        << "r = " << r << ", p = " << p;
+    EXPECT_TRUE(Scrypt.hash({}, {}, 16, r, p, 64).empty());
+  }
+}
+
+// From Section 12 of the RFC, with every scratch allocation strategy
+TEST(ScryptTest, RFCSanity0Allocations) {
+  std::string expected =
+      "77 d6 57 62 38 65 7b 20 3b 19 ca 42 c1 8a 04 97 "
+      "f1 6b 48 44 e3 07 4a e8 df df fa 3f ed e2 14 42 "
+      "fc d0 06 9d ed 09 48 f8 32 6a 75 3a 0f c8 1f 17 "
+      "e8 d3 e0 fb 2e 0d 36 28 cf 35 e2 0c 38 d1 89 06 ";
+
+  using Pages = ScratchAllocation::Pages;
+  for (Pages pages : {Pages::Normal, Pages::Transparent, Pages::HugeTLB}) {
+    for (bool node_local : {false, true}) {
+      Scrypt Scrypt;
+      Scrypt.set_scratch_allocation({pages, node_local});
+      std::vector<std::byte> got =
+          Scrypt.hash(utilities::stringToBytes(""),
+                      utilities::stringToBytes(""), 16, 1, 1, 64);
+      EXPECT_EQ(got, utilities::hexToBytes(expected));
+    }
+  }
+}
+
+// The multi-lane batch must match hash, with every kernel, whether a block
+// lands in a full group of lanes or in the remainder.
+TEST(ScryptTest, MultiMatchesHash) {
+  Scrypt Scrypt;
+  std::vector<std::pair<std::vector<std::byte>, std::vector<std::byte>>>
+      inputs;
+  for (int i = 0; i < 7; i++) {
+    inputs.emplace_back(
+        utilities::stringToBytes("password" + std::to_string(i)),
+        utilities::stringToBytes("NaCl"));
+  }
+
+  std::vector<std::vector<std::byte>> expected;
+  for (auto& input : inputs) {
+    expected.push_back(Scrypt.hash(input.first, input.second, 16, 2, 3, 32));
+  }
+
+  for (auto k : {Salsa20::Kernel::Scalar, Salsa20::Kernel::SSE2,
+                 Salsa20::Kernel::AVX2, Salsa20::Kernel::AVX512}) {
+    if (!Salsa20::set_kernel(k)) {
+      continue;
+    }
+    EXPECT_EQ(Scrypt.hash_multi(inputs, 16, 2, 3, 32), expected)
+        << Salsa20::kernel_name(k);
+  }
+  EXPECT_TRUE(Salsa20::set_kernel(Salsa20::Kernel::Auto));
+}
+
+// From Section 12 of the RFC, as a batch
+TEST(ScryptTest, RFCSanity0Multi) {
+  Scrypt Scrypt;
+  std::string expected =
+      "77 d6 57 62 38 65 7b 20 3b 19 ca 42 c1 8a 04 97 "
+      "f1 6b 48 44 e3 07 4a e8 df df fa 3f ed e2 14 42 "
+      "fc d0 06 9d ed 09 48 f8 32 6a 75 3a 0f c8 1f 17 "
+      "e8 d3 e0 fb 2e 0d 36 28 cf 35 e2 0c 38 d1 89 06 ";
+
+  std::vector<std::pair<std::vector<std::byte>, std::vector<std::byte>>>
+      inputs(Salsa20::lanes(), {utilities::stringToBytes(""),
+                                utilities::stringToBytes("")});
+  for (auto& got : Scrypt.hash_multi(inputs, 16, 1, 1, 64)) {
+    EXPECT_EQ(got, utilities::hexToBytes(expected));
+  }
+}
+
+// A batch of jobs with different N, r, p and key lengths must give what hash
+// gives for each job on its own.
+TEST(ScryptTest, BatchMatchesHash) {
+  Scrypt Scrypt;
+  std::vector<Scrypt::Job> jobs;
+  for (int i = 0; i < 11; i++) {
+    jobs.push_back({utilities::stringToBytes("password" + std::to_string(i)),
+                    utilities::stringToBytes("NaCl"),
+                    uint64_t{16} << (i % 3), 1 + uint32_t(i % 2),
+                    1 + uint32_t(i % 4), 16 + size_t(i)});
+  }
+
+  std::vector<std::vector<std::byte>> expected;
+  for (auto& job : jobs) {
+    expected.push_back(Scrypt.hash(job.passphrase, job.salt, job.cost_factor_N,
+                                   job.block_size_factor_r,
+                                   job.parallelization_factor_p,
+                                   job.desired_key_length));
+  }
+
+  EXPECT_EQ(Scrypt.hash_batch(jobs), expected);
+  EXPECT_TRUE(Scrypt.hash_batch({}).empty());
+}
+
+// A cancelled batch gives up and returns no keys.
+TEST(ScryptTest, BatchCancelled) {
+  Scrypt Scrypt;
+  auto cancelled = std::make_shared<std::atomic<bool>>(true);
+  std::vector<Scrypt::Job> jobs(
+      Salsa20::lanes() + 1,
+      {utilities::stringToBytes("password"), utilities::stringToBytes("NaCl"),
+       uint64_t{1} << 20, 1, 1, 32});
+  EXPECT_TRUE(Scrypt.hash_batch(jobs, cancelled).empty());
+}
+
+// A job with r or p out of range fails the batch it is in.
+TEST(ScryptTest, BatchRejectsBlockFactors) {
+  Scrypt Scrypt;
+  for (auto [r, p] : std::vector<std::pair<uint32_t, uint32_t>>{
+           {0, 1}, {1, 0}, {1u << 15, 1u << 15}}) {
+    std::vector<Scrypt::Job> jobs{
+        {utilities::stringToBytes("password"),
+         utilities::stringToBytes("NaCl"), 16, 1, 1, 32},
+        {utilities::stringToBytes("password"),
+         utilities::stringToBytes("NaCl"), 16, r, p, 32}};
+    EXPECT_TRUE(Scrypt.hash_batch(jobs).empty())
+        << "r = " << r << ", p = " << p;
+  }
+}
+
+// From Section 12 of the RFC, as a PHC string
+TEST(ScryptTest, EncodeRFC1) {
+  Scrypt Scrypt;
+  std::string expected =
+      "$scrypt$ln=10,r=8,p=16$TmFDbA$/bq+HJ00cgB4VucZDQHp/nxq18vII3gw53N2Y0s3"
+      "MWIurzDZLiKjiG/xCSedmDDaxyevuUqD7m2DYMvfoswGQA";
+  EXPECT_EQ(Scrypt.encode(utilities::stringToBytes("password"),
+                          utilities::stringToBytes("NaCl"), 1024, 8, 16, 64),
+            expected);
+  EXPECT_TRUE(Scrypt.verify(utilities::stringToBytes("password"), expected));
+  EXPECT_FALSE(Scrypt.verify(utilities::stringToBytes("passwork"), expected));
+
+  // Too small a buffer is refused rather than overrun.
+  std::vector<std::byte> salt = utilities::stringToBytes("NaCl");
+  std::vector<std::byte> key(64);
+  char encoded[Scrypt::max_phc_length];
+  EXPECT_EQ(Scrypt::encode(salt.data(), salt.size(), 1024, 8, 16, key.data(),
+                           key.size(), encoded, expected.size() - 1),
+            0);
+  EXPECT_EQ(Scrypt::encode(salt.data(), salt.size(), 1024, 8, 16, key.data(),
+                           key.size(), encoded, expected.size()),
+            expected.size());
+
+  // So is an N with no log2 to write.
+  for (uint64_t N : {0, 1, 3, 1000}) {
+    EXPECT_EQ(Scrypt::encode(salt.data(), salt.size(), N, 8, 16, key.data(),
+                             key.size(), encoded, sizeof(encoded)),
+              0)
+        << "N = " << N;
+    EXPECT_EQ(Scrypt.encode(utilities::stringToBytes("password"), salt, N, 8,
+                            16, 64),
+              "")
+        << "N = " << N;
+  }
+}
+
+TEST(ScryptTest, VerifyRejectsMalformed) {
+  Scrypt Scrypt;
+  std::vector<std::byte> passphrase = utilities::stringToBytes("pleaseletmein");
+  std::string good =
+      "$scrypt$ln=4,r=1,p=1$U29kaXVtQ2hsb3JpZGU$"
+      "u00N+n/1sWMzoRfpR4GP0jvd1lpFsckJXEvwqVwZ3BY";
+  EXPECT_TRUE(Scrypt.verify(passphrase, good));
+
+  for (std::string bad : {
+           "",
+           "$scrypt$",
+           "$scrypt$ln=4,r=1,p=1$U29kaXVtQ2hsb3JpZGU",
+           "$scrypt$ln=4,r=1,p=1$U29kaXVtQ2hsb3JpZGU$",
+           "$scrypt$ln=0,r=1,p=1$U29kaXVtQ2hsb3JpZGU$u00N",
+           "$scrypt$ln=64,r=1,p=1$U29kaXVtQ2hsb3JpZGU$u00N",
+           "$scrypt$ln=04,r=1,p=1$U29kaXVtQ2hsb3JpZGU$u00N",
+           "$scrypt$ln=4,r=0,p=1$U29kaXVtQ2hsb3JpZGU$u00N",
+           "$scrypt$ln=4,r=1,p=1073741824$U29kaXVtQ2hsb3JpZGU$u00N",
+           "$scrypt$ln=4,r=1,p=1$U29kaXVtQ2hsb3JpZGU=$u00N",
+           "$scrypt$ln=4,r=1,p=1$U29kaXVtQ2hsb3JpZGV$u00N",
+           "$scrypt$ln=4,r=1,p=1$U29kaXVtQ2hsb3JpZGU$u00N+",
+           "$argon2$ln=4,r=1,p=1$U29kaXVtQ2hsb3JpZGU$u00N",
+       }) {
+    EXPECT_FALSE(Scrypt.verify(passphrase, bad)) << bad;
+  }
+
+  // A well-formed string with another salt must not verify either.
+  std::string other_salt = good;
+  other_salt[21] = 'V';
+  EXPECT_FALSE(Scrypt.verify(passphrase, other_salt));
+}
+
 //
 // The following tests seem to take forever.
 //
@@ -0,0 +1,97 @@
+// sha256_test.cc - Some tests for SHA256
+
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+#include <sha256.h>
+
+#include <cstring>
+#include <vector>
+
+#include "utilities.h"
+
+namespace {
+
+const SHA256::Kernel kernels[] = {SHA256::Kernel::Scalar,
+                                  SHA256::Kernel::SSE2, SHA256::Kernel::AVX2,
+                                  SHA256::Kernel::AVX512};
+
+// From Appendix B of FIPS 180-2
+TEST(SHA256Test, FIPSExamples) {
+  std::vector<std::byte> abc = utilities::stringToBytes("abc");
+  std::vector<std::byte> digest(32);
+  SHA256::hash(abc.data(), abc.size(), digest.data());
+  EXPECT_EQ(digest, utilities::hexToBytes(
+                        "ba 78 16 bf 8f 01 cf ea 41 41 40 de 5d ae 22 23 "
+                        "b0 03 61 a3 96 17 7a 9c b4 10 ff 61 f2 00 15 ad "));
+
+  std::vector<std::byte> two_blocks = utilities::stringToBytes(
+      "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq");
+  SHA256::hash(two_blocks.data(), two_blocks.size(), digest.data());
+  EXPECT_EQ(digest, utilities::hexToBytes(
+                        "24 8d 6a 61 d2 06 38 b8 e5 c0 26 93 0c 3e 60 39 "
+                        "a3 3c e4 59 64 ff 21 67 f6 ec ed d4 19 db 06 c1 "));
+}
+
+// Every kernel must agree with OpenSSL on messages of every padding case.
+TEST(SHA256Test, MatchesOpenSSL) {
+  std::vector<std::byte> message(300);
+  for (size_t i = 0; i < message.size(); i++) {
+    message[i] = static_cast<std::byte>(i * 131 + 7);
+  }
+
+  for (auto k : kernels) {
+    if (!SHA256::set_kernel(k)) {
+      continue;
+    }
+    for (size_t length = 0; length <= message.size(); length++) {
+      unsigned char expected[32];
+      ::SHA256(reinterpret_cast<const unsigned char*>(message.data()), length,
+               expected);
+      std::byte got[32];
+      SHA256::hash(message.data(), length, got);
+      EXPECT_EQ(std::memcmp(got, expected, 32), 0)
+          << SHA256::kernel_name(k) << " " << length;
+    }
+  }
+  EXPECT_TRUE(SHA256::set_kernel(SHA256::Kernel::Auto));
+}
+
+// Each lane of the multi-buffer kernels must match the one-state compression.
+TEST(SHA256Test, LanesMatchCompress) {
+  for (auto k : kernels) {
+    if (!SHA256::set_kernel(k)) {
+      continue;
+    }
+    EXPECT_EQ(SHA256::kernel(), k);
+    size_t lanes = SHA256::lanes();
+
+    std::vector<std::byte> blocks(64 * lanes);
+    for (size_t i = 0; i < blocks.size(); i++) {
+      blocks[i] = static_cast<std::byte>(i * 29 + 3);
+    }
+    std::vector<const std::byte*> pointers;
+    std::vector<uint32_t> states(8 * lanes);
+    for (size_t l = 0; l < lanes; l++) {
+      pointers.push_back(blocks.data() + 64 * l);
+      for (size_t w = 0; w < 8; w++) {
+        states[w * lanes + l] = SHA256::initial_state[w] + uint32_t(l);
+      }
+    }
+    SHA256::compress_lanes(states.data(), pointers.data());
+
+    for (size_t l = 0; l < lanes; l++) {
+      uint32_t state[8];
+      for (size_t w = 0; w < 8; w++) {
+        state[w] = SHA256::initial_state[w] + uint32_t(l);
+      }
+      SHA256::compress(state, pointers[l], 1);
+      for (size_t w = 0; w < 8; w++) {
+        EXPECT_EQ(states[w * lanes + l], state[w])
+            << SHA256::kernel_name(k) << " lane " << l;
+      }
+    }
+  }
+  EXPECT_TRUE(SHA256::set_kernel(SHA256::Kernel::Auto));
+}
+
+}  // namespace
@@ -0,0 +1,74 @@
+// thread_pool_test.cc - Some tests for the thread pool
+
+#include <gtest/gtest.h>
+#include <thread_pool.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace {
+
+TEST(ThreadPoolTest, RunsEveryTask) {
+  ThreadPool pool(3);
+  std::atomic<int> count{0};
+  {
+    ThreadPool::TaskGroup group(pool);
+    for (int i = 0; i < 100; i++) {
+      group.run([&count] { count++; });
+    }
+    group.wait();
+    EXPECT_EQ(count, 100);
+  }
+}
+
+// Destroying the pool waits for posted tasks.
+TEST(ThreadPoolTest, PostedTasks) {
+  std::atomic<int> count{0};
+  {
+    ThreadPool pool(2);
+    for (int i = 0; i < 100; i++) {
+      pool.post([&count] { count++; });
+    }
+  }
+  EXPECT_EQ(count, 100);
+}
+
+// Groups started inside tasks must not leave every worker blocked.
+TEST(ThreadPoolTest, NestedGroups) {
+  ThreadPool pool(2);
+  std::atomic<int> count{0};
+  ThreadPool::TaskGroup outer(pool);
+  for (int i = 0; i < 8; i++) {
+    outer.run([&pool, &count] {
+      ThreadPool::TaskGroup inner(pool);
+      for (int j = 0; j < 8; j++) {
+        inner.run([&count] { count++; });
+      }
+      inner.wait();
+    });
+  }
+  outer.wait();
+  EXPECT_EQ(count, 64);
+}
+
+// Concurrent callers share the workers.
+TEST(ThreadPoolTest, ConcurrentCallers) {
+  ThreadPool pool(2);
+  std::atomic<int> count{0};
+  std::vector<std::thread> callers;
+  for (int c = 0; c < 4; c++) {
+    callers.emplace_back([&pool, &count] {
+      ThreadPool::TaskGroup group(pool);
+      for (int i = 0; i < 25; i++) {
+        group.run([&count] { count++; });
+      }
+    });
+  }
+  for (auto& t : callers) {
+    t.join();
+  }
+  EXPECT_EQ(count, 100);
+}
+
+}  // namespace
@@ -0,0 +1,81 @@
+// tuner_test.cc - Some tests for the parameter tuner
+
+#include <gtest/gtest.h>
+#include <romix.h>
+#include <scrypt.h>
+#include <tuner.h>
+
+#include <chrono>
+#include <memory>
+
+namespace {
+
+TEST(TunerTest, Measure) {
+  Tuner tuner;
+  Tuner::Measurement m = tuner.measure(1024, 1, 2, 2, 2);
+  EXPECT_EQ(m.cost_factor_N, 1024);
+  EXPECT_EQ(m.block_size_factor_r, 1);
+  EXPECT_EQ(m.parallelization_factor_p, 2);
+  EXPECT_EQ(m.concurrency, 2);
+  EXPECT_GT(m.latency.count(), 0);
+  EXPECT_GT(m.hashes_per_second, 0);
+}
+
+TEST(TunerTest, RefusedHashesCountAsTooExpensive) {
+  Scrypt scrypt;
+  scrypt.set_memory_budget(std::make_shared<MemoryBudget>(1024));
+  scrypt.set_admission(MemoryBudget::Admission::FailFast);
+  Tuner tuner(scrypt);
+  Tuner::Measurement m = tuner.measure(1024, 1, 1);
+  EXPECT_EQ(m.latency, std::chrono::nanoseconds::max());
+  EXPECT_EQ(m.hashes_per_second, 0);
+}
+
+TEST(TunerTest, StaysWithinMemory) {
+  Tuner::Target target;
+  target.latency = std::chrono::milliseconds(20);
+  target.memory = 1 << 20;
+  target.concurrency = 2;
+  target.block_size_factor_r = 4;
+  target.samples = 1;
+
+  Tuner tuner(Scrypt(), 4);
+  Tuner::Result result = tuner.tune(target);
+  EXPECT_EQ(result.block_size_factor_r, 4);
+  EXPECT_TRUE(romix::ValidCostFactor(result.cost_factor_N));
+  EXPECT_GE(result.parallelization_factor_p, 1);
+  EXPECT_LE(result.parallelization_factor_p, 2);
+  EXPECT_LE(result.parallelization_factor_p *
+                romix::ROMixScratchSize(4, result.cost_factor_N),
+            target.memory / 2);
+}
+
+TEST(TunerTest, ChosenParametersMeetTheTarget) {
+  Tuner::Target target;
+  target.latency = std::chrono::milliseconds(10);
+  target.block_size_factor_r = 1;
+  target.samples = 1;
+
+  Tuner tuner(Scrypt(), 1);
+  Tuner::Result result = tuner.tune(target);
+  ASSERT_FALSE(result.measurements.empty());
+  EXPECT_EQ(result.chosen.cost_factor_N, result.cost_factor_N);
+  EXPECT_EQ(result.chosen.parallelization_factor_p, 1);
+  EXPECT_EQ(result.met, result.chosen.latency <= target.latency);
+  // r = 1 caps N below 2^16.
+  EXPECT_LT(result.cost_factor_N, 1 << 16);
+}
+
+TEST(TunerTest, NothingFits) {
+  Tuner::Target target;
+  target.memory = 100;
+  target.samples = 1;
+
+  Tuner tuner;
+  Tuner::Result result = tuner.tune(target);
+  EXPECT_FALSE(result.met);
+  EXPECT_EQ(result.cost_factor_N, 2);
+  EXPECT_EQ(result.parallelization_factor_p, 1);
+}
+
+}  // namespace
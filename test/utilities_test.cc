@@ -0,0 +1,179 @@
+// utilities_test.cc - Some tests for the hex and base64 codecs
+
+#include <gtest/gtest.h>
+#include <utilities.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Base64Format = utilities::Base64Format;
+using CodecError = utilities::CodecError;
+using HexFormat = utilities::HexFormat;
+
+std::vector<std::byte> AllBytes() {
+  std::vector<std::byte> data;
+  for (int b = 0; b < 256; b++) {
+    data.push_back(static_cast<std::byte>(b));
+  }
+  return data;
+}
+
+std::string EncodeHex(const std::vector<std::byte>& data, HexFormat format) {
+  std::string hex(utilities::hexLength(data.size(), format), '?');
+  EXPECT_EQ(utilities::encodeHex(data.data(), data.size(), hex.data(), format),
+            hex.size());
+  return hex;
+}
+
+std::string EncodeBase64(const std::string& s, Base64Format format) {
+  std::vector<std::byte> data = utilities::stringToBytes(s);
+  std::string encoded(utilities::base64Length(data.size(), format), '?');
+  EXPECT_EQ(utilities::encodeBase64(data.data(), data.size(), encoded.data(),
+                                    format),
+            encoded.size());
+  return encoded;
+}
+
+utilities::Decoded DecodeBase64(const std::string& s, Base64Format format,
+                                std::string* decoded) {
+  std::vector<std::byte> out(s.size());
+  utilities::Decoded d = utilities::decodeBase64(
+      s.data(), s.size(), out.data(), out.size(), format);
+  decoded->assign(reinterpret_cast<const char*>(out.data()), d.length);
+  return d;
+}
+
+TEST(UtilitiesTest, HexFormats) {
+  std::vector<std::byte> data = utilities::hexToBytes("00 7f 80 ff");
+  EXPECT_EQ(EncodeHex(data, HexFormat::Compact), "007f80ff");
+  EXPECT_EQ(EncodeHex(data, HexFormat::Spaced), "00 7f 80 ff \n");
+
+  // The SIMD chunks and the tail agree with the table.
+  std::string compact = EncodeHex(AllBytes(), HexFormat::Compact);
+  for (int b = 0; b < 256; b++) {
+    EXPECT_EQ(compact.substr(2 * b, 2), EncodeHex({static_cast<std::byte>(b)},
+                                                  HexFormat::Compact));
+  }
+  std::vector<std::byte> sixteen(16, std::byte{0xab});
+  EXPECT_EQ(EncodeHex(sixteen, HexFormat::Spaced),
+            "ab ab ab ab ab ab ab ab ab ab ab ab ab ab ab ab \n\n");
+}
+
+TEST(UtilitiesTest, HexRoundTrip) {
+  std::vector<std::byte> data = AllBytes();
+  for (HexFormat format : {HexFormat::Compact, HexFormat::Spaced}) {
+    std::string hex = EncodeHex(data, format);
+    std::vector<std::byte> decoded(data.size());
+    utilities::Decoded d = utilities::decodeHex(
+        hex.data(), hex.size(), decoded.data(), decoded.size(), format);
+    EXPECT_TRUE(d.ok());
+    EXPECT_EQ(d.length, data.size());
+    EXPECT_EQ(decoded, data);
+  }
+  EXPECT_EQ(utilities::hexToBytes(utilities::bytesToHex(data)), data);
+  EXPECT_EQ(utilities::hexToBytes("DE\tad\r\nbE eF"),
+            utilities::hexToBytes("de ad be ef"));
+}
+
+TEST(UtilitiesTest, HexErrors) {
+  std::byte out[4];
+  auto decode = [&out](const std::string& s, HexFormat format,
+                       size_t capacity = 4) {
+    return utilities::decodeHex(s.data(), s.size(), out, capacity, format);
+  };
+
+  utilities::Decoded d = decode("00x1", HexFormat::Compact);
+  EXPECT_EQ(d.error, CodecError::InvalidCharacter);
+  EXPECT_EQ(d.position, 2);
+  EXPECT_EQ(d.length, 1);
+  EXPECT_EQ(decode("001", HexFormat::Compact).error,
+            CodecError::InvalidLength);
+  EXPECT_EQ(decode("00 111", HexFormat::Compact).error,
+            CodecError::InvalidCharacter);
+  EXPECT_EQ(decode("0011", HexFormat::Compact, 1).error, CodecError::Overflow);
+
+  d = decode("00 1 1", HexFormat::Spaced);
+  EXPECT_EQ(d.error, CodecError::InvalidCharacter);
+  EXPECT_EQ(d.position, 4);
+  EXPECT_EQ(decode("00 1", HexFormat::Spaced).error,
+            CodecError::InvalidLength);
+  d = decode("00 11 22", HexFormat::Spaced, 2);
+  EXPECT_EQ(d.error, CodecError::Overflow);
+  EXPECT_EQ(d.length, 2);
+
+  // The vector wrappers keep what they decoded before the error.
+  EXPECT_EQ(utilities::hexToBytes("01 02 zz 03"),
+            utilities::hexToBytes("01 02"));
+  EXPECT_EQ(utilities::hexToBytesStrict("01 02 zz 03"),
+            utilities::hexToBytes("01 02"));
+}
+
+// hexToBytes reads whitespace separated numbers, as it always has, while
+// hexToBytesStrict takes exactly two digits per byte.
+TEST(UtilitiesTest, HexToBytesTokens) {
+  std::vector<std::byte> expected{std::byte{0x0a}, std::byte{0xff},
+                                  std::byte{0xcd}};
+  EXPECT_EQ(utilities::hexToBytes("a 0xff abcd"), expected);
+  EXPECT_EQ(utilities::hexToBytesStrict("a 0xff abcd"),
+            std::vector<std::byte>());
+
+  std::vector<std::byte> pairs{std::byte{0xab}, std::byte{0xcd}};
+  EXPECT_EQ(utilities::hexToBytesStrict("abcd"), pairs);
+  EXPECT_EQ(utilities::hexToBytesStrict("ab\tCD"), pairs);
+  EXPECT_EQ(utilities::hexToBytes("ab\tCD"), pairs);
+}
+
+// The test vectors of Section 10 of RFC 4648
+TEST(UtilitiesTest, Base64RFC4648) {
+  const char* vectors[][3] = {
+      {"", "", ""},
+      {"f", "Zg", "Zg=="},
+      {"fo", "Zm8", "Zm8="},
+      {"foo", "Zm9v", "Zm9v"},
+      {"foob", "Zm9vYg", "Zm9vYg=="},
+      {"fooba", "Zm9vYmE", "Zm9vYmE="},
+      {"foobar", "Zm9vYmFy", "Zm9vYmFy"},
+  };
+  for (auto& v : vectors) {
+    EXPECT_EQ(EncodeBase64(v[0], Base64Format::Unpadded), v[1]);
+    EXPECT_EQ(EncodeBase64(v[0], Base64Format::Padded), v[2]);
+    std::string decoded;
+    EXPECT_TRUE(DecodeBase64(v[1], Base64Format::Unpadded, &decoded).ok());
+    EXPECT_EQ(decoded, v[0]);
+    EXPECT_TRUE(DecodeBase64(v[2], Base64Format::Padded, &decoded).ok());
+    EXPECT_EQ(decoded, v[0]);
+  }
+}
+
+TEST(UtilitiesTest, Base64Errors) {
+  std::string decoded;
+  auto error = [&decoded](const std::string& s, Base64Format format) {
+    return DecodeBase64(s, format, &decoded).error;
+  };
+  const Base64Format unpadded = Base64Format::Unpadded;
+  const Base64Format padded = Base64Format::Padded;
+
+  EXPECT_EQ(error("Zm9vY", unpadded), CodecError::InvalidLength);
+  EXPECT_EQ(error("Zg==", unpadded), CodecError::InvalidCharacter);
+  EXPECT_EQ(error("Zh", unpadded), CodecError::NonCanonical);
+  EXPECT_EQ(error("Zm9", unpadded), CodecError::NonCanonical);
+  EXPECT_EQ(error("Zg", padded), CodecError::InvalidLength);
+  EXPECT_EQ(error("Z===", padded), CodecError::InvalidCharacter);
+  EXPECT_EQ(error("Zg=A", padded), CodecError::InvalidCharacter);
+
+  utilities::Decoded d = DecodeBase64("Zm9v Zm9v", unpadded, &decoded);
+  EXPECT_EQ(d.error, CodecError::InvalidLength);
+  d = DecodeBase64("Zm9vZ!9v", unpadded, &decoded);
+  EXPECT_EQ(d.error, CodecError::InvalidCharacter);
+  EXPECT_EQ(d.position, 5);
+  EXPECT_EQ(decoded, "foo");
+
+  std::byte out[2];
+  EXPECT_EQ(utilities::decodeBase64("Zm9v", 4, out, sizeof(out)).error,
+            CodecError::Overflow);
+}
+
+}  // namespace
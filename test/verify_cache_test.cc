@@ -0,0 +1,129 @@
+// verify_cache_test.cc - Some tests for the cache of password checks
+
+#include <gtest/gtest.h>
+#include <scrypt.h>
+#include <utilities.h>
+#include <verify_cache.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+bool Contains(VerifyCache& cache, const std::string& passphrase,
+              const std::string& encoded) {
+  return cache.contains(reinterpret_cast<const std::byte*>(passphrase.data()),
+                        passphrase.size(), encoded.data(), encoded.size());
+}
+
+void Insert(VerifyCache& cache, const std::string& passphrase,
+            const std::string& encoded) {
+  cache.insert(reinterpret_cast<const std::byte*>(passphrase.data()),
+               passphrase.size(), encoded.data(), encoded.size());
+}
+
+TEST(VerifyCacheTest, HitsOnlyTheInsertedCheck) {
+  VerifyCache cache;
+  EXPECT_FALSE(Contains(cache, "password", "$scrypt$a"));
+  Insert(cache, "password", "$scrypt$a");
+  EXPECT_TRUE(Contains(cache, "password", "$scrypt$a"));
+  EXPECT_FALSE(Contains(cache, "Password", "$scrypt$a"));
+  EXPECT_FALSE(Contains(cache, "password", "$scrypt$b"));
+  // The length of the passphrase keeps the two apart.
+  EXPECT_FALSE(Contains(cache, "password$", "scrypt$a"));
+  EXPECT_EQ(cache.hits(), 1);
+  EXPECT_EQ(cache.misses(), 4);
+}
+
+TEST(VerifyCacheTest, Expires) {
+  VerifyCache cache(16, std::chrono::milliseconds(0));
+  Insert(cache, "password", "$scrypt$a");
+  EXPECT_FALSE(Contains(cache, "password", "$scrypt$a"));
+}
+
+TEST(VerifyCacheTest, Invalidate) {
+  VerifyCache cache;
+  Insert(cache, "password", "$scrypt$a");
+  Insert(cache, "other", "$scrypt$a");
+  Insert(cache, "password", "$scrypt$b");
+  cache.invalidate("$scrypt$a", 9);
+  EXPECT_FALSE(Contains(cache, "password", "$scrypt$a"));
+  EXPECT_FALSE(Contains(cache, "other", "$scrypt$a"));
+  EXPECT_TRUE(Contains(cache, "password", "$scrypt$b"));
+  cache.clear();
+  EXPECT_FALSE(Contains(cache, "password", "$scrypt$b"));
+}
+
+TEST(VerifyCacheTest, Capacity) {
+  VerifyCache cache(64, std::chrono::seconds(60), 4);
+  for (int i = 0; i < 1000; i++) {
+    Insert(cache, std::to_string(i), "$scrypt$a");
+  }
+  int kept = 0;
+  for (int i = 0; i < 1000; i++) {
+    kept += Contains(cache, std::to_string(i), "$scrypt$a");
+  }
+  EXPECT_GT(kept, 0);
+  EXPECT_LE(kept, 64);
+  // The latest check always has a slot.
+  EXPECT_TRUE(Contains(cache, "999", "$scrypt$a"));
+}
+
+// Readers racing inserts and invalidations never see a check nobody made
+TEST(VerifyCacheTest, ConcurrentReaders) {
+  VerifyCache cache(64, std::chrono::seconds(60), 2);
+  std::atomic<bool> done{false};
+  std::atomic<int> false_hits{0};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 3; t++) {
+    readers.emplace_back([&] {
+      while (!done) {
+        for (int i = 0; i < 64; i++) {
+          false_hits += Contains(cache, std::to_string(i), "$scrypt$never");
+        }
+      }
+    });
+  }
+  for (int round = 0; round < 200; round++) {
+    for (int i = 0; i < 64; i++) {
+      Insert(cache, std::to_string(i), "$scrypt$a");
+    }
+    cache.invalidate("$scrypt$a", 9);
+  }
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(false_hits, 0);
+}
+
+TEST(VerifyCacheTest, ScryptVerify) {
+  Scrypt Scrypt;
+  auto cache = std::make_shared<VerifyCache>();
+  Scrypt.set_verify_cache(cache);
+  std::vector<std::byte> password = utilities::stringToBytes("password");
+  std::string encoded =
+      Scrypt.encode(password, utilities::stringToBytes("NaCl"), 16, 1, 1, 32);
+  ASSERT_FALSE(encoded.empty());
+
+  EXPECT_FALSE(Scrypt.verify(utilities::stringToBytes("wrong"), encoded));
+  EXPECT_FALSE(Scrypt.verify(utilities::stringToBytes("wrong"), encoded));
+  EXPECT_EQ(cache->hits(), 0);
+
+  EXPECT_TRUE(Scrypt.verify(password, encoded));
+  EXPECT_TRUE(Scrypt.verify(password, encoded));
+  EXPECT_EQ(cache->hits(), 1);
+
+  // Malformed strings are rejected before the cache is asked.
+  EXPECT_FALSE(Scrypt.verify(password, encoded.substr(1)));
+  EXPECT_EQ(cache->misses(), 3);
+
+  cache->invalidate(encoded.data(), encoded.size());
+  EXPECT_TRUE(Scrypt.verify(password, encoded));
+  EXPECT_EQ(cache->hits(), 1);
+}
+
+}  // namespace